@@ -25,6 +25,86 @@
 
 #include "squeezelite.h"
 
+#if LINUX || OSX || FREEBSD
+#include <sys/mman.h>
+#endif
+
+#define ALIGN_BYTES 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static log_level loglevel = lWARN;
+
+unsigned buf_policy = BUF_ALIGN; // set from command line, applies to all buffers allocated afterwards
+
+// allocate buffer memory according to buf_policy, mapped is set to the mapping length if mmap is used
+static u8_t *buf_alloc(size_t size, size_t *mapped) {
+	u8_t *ptr = NULL;
+
+	*mapped = 0;
+
+#if LINUX || OSX || FREEBSD
+	if (buf_policy & (BUF_HUGE | BUF_LOCK | BUF_NODUMP)) {
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t len = (size + page - 1) / page * page;
+		bool huge = (buf_policy & BUF_HUGE) && size >= HUGE_PAGE_SIZE;
+		void *map = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+		if (huge) {
+			size_t hlen = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+			map = mmap(NULL, hlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (map != MAP_FAILED) {
+				len = hlen;
+			}
+		}
+#endif
+		if (map == MAP_FAILED) {
+			map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (map == MAP_FAILED) {
+				return NULL;
+			}
+#ifdef MADV_HUGEPAGE
+			// no reserved huge pages - ask for transparent ones
+			if (huge) {
+				madvise(map, len, MADV_HUGEPAGE);
+			}
+#endif
+		}
+#ifdef MADV_DONTDUMP
+		if (buf_policy & BUF_NODUMP) {
+			madvise(map, len, MADV_DONTDUMP);
+		}
+#endif
+		if ((buf_policy & BUF_LOCK) && mlock(map, len) == -1) {
+			LOG_WARN("unable to lock %u kB buffer: %s", (unsigned)(len / 1024), strerror(errno));
+		}
+
+		*mapped = len;
+		return map;
+	}
+
+	if (buf_policy & BUF_ALIGN) {
+		if (posix_memalign((void **)&ptr, ALIGN_BYTES, size)) {
+			return NULL;
+		}
+		return ptr;
+	}
+#endif
+
+	ptr = malloc(size);
+	return ptr;
+}
+
+static void buf_free(u8_t *ptr, size_t mapped) {
+#if LINUX || OSX || FREEBSD
+	if (mapped) {
+		munmap(ptr, mapped);
+		return;
+	}
+#endif
+	free(ptr);
+}
+
 // _* called with muxtex locked
 
 #if !WIN
@@ -81,11 +161,11 @@ void buf_adjust(struct buffer *buf, size_t mod) {
 
 // called with mutex locked to resize, does not retain contents, reverts to original size if fails
 void _buf_resize(struct buffer *buf, size_t size) {
-	free(buf->buf);
-	buf->buf = malloc(size);
+	buf_free(buf->buf, buf->mapped);
+	buf->buf = buf_alloc(size, &buf->mapped);
 	if (!buf->buf) {
 		size    = buf->size;
-		buf->buf= malloc(size);
+		buf->buf= buf_alloc(size, &buf->mapped);
 		if (!buf->buf) {
 			size = 0;
 		}
@@ -97,6 +177,55 @@ void _buf_resize(struct buffer *buf, size_t size) {
 	buf->base_size = size;
 }
 
+// allocate and free memory for _buf_swap without the mutex, as allocating, locking and freeing large buffers is slow
+u8_t *buf_mem_alloc(size_t size, size_t *mapped) {
+	return buf_alloc(size, mapped);
+}
+
+void buf_mem_free(u8_t *mem, size_t mapped) {
+	buf_free(mem, mapped);
+}
+
+// called with mutex locked to move the contents to the start of mem of size bytes, which becomes the buffer
+// ptrs are positions within the buffer held elsewhere, relocated to the same data, NULL entries are ignored
+// on success mem and mapped are set to the previous memory to be freed once the mutex is released
+// returns false and leaves the buffer unchanged if the contents or positions do not fit
+bool _buf_swap(struct buffer *buf, u8_t **mem, size_t *mapped, size_t size, u8_t **ptrs[], unsigned n) {
+	size_t used = _buf_used(buf), cont = _buf_cont_read(buf), off[8];
+	u8_t *old = buf->buf;
+	size_t old_mapped = buf->mapped;
+	unsigned i;
+
+	if (used >= size || n > sizeof(off) / sizeof(off[0])) return false;
+
+	for (i = 0; i < n; i++) {
+		u8_t *p = *ptrs[i];
+		if (!p) continue;
+		off[i] = p >= buf->readp ? p - buf->readp : p + buf->size - buf->readp;
+		if (off[i] >= size) return false;
+	}
+
+	memcpy(*mem, buf->readp, cont);
+	memcpy(*mem + cont, buf->buf, used - cont);
+
+	for (i = 0; i < n; i++) {
+		if (*ptrs[i]) *ptrs[i] = *mem + off[i];
+	}
+
+	buf->buf    = *mem;
+	buf->mapped = *mapped;
+	buf->readp  = buf->buf;
+	buf->writep = buf->buf + used;
+	buf->wrap   = buf->buf + size;
+	buf->size   = size;
+	buf->base_size = size;
+
+	*mem = old;
+	*mapped = old_mapped;
+
+	return true;
+}
+
 void _buf_unwrap(struct buffer *buf, size_t cont) {
 	ssize_t len, by = cont - (buf->wrap - buf->readp);
 	size_t size;
@@ -148,7 +277,7 @@ void _buf_unwrap(struct buffer *buf, size_t cont) {
 }
 
 void buf_init(struct buffer *buf, size_t size) {
-	buf->buf    = malloc(size);
+	buf->buf    = buf_alloc(size, &buf->mapped);
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
 	buf->wrap   = buf->buf + size;
@@ -159,7 +288,7 @@ void buf_init(struct buffer *buf, size_t size) {
 
 void buf_destroy(struct buffer *buf) {
 	if (buf->buf) {
-		free(buf->buf);
+		buf_free(buf->buf, buf->mapped);
 		buf->buf = NULL;
 		buf->size = 0;
 		buf->base_size = 0;
@@ -55,17 +55,19 @@ static bool running = true;
 
 static void *decode_thread(void *vargp) {
 
+	metrics_thread("decode");
+
 	while (running) {
 		size_t bytes, space, min_space;
 		bool toend;
 		bool ran = false;
 
-		LOCK_S;
+		mutex_lock_timed(streambuf->mutex, MET_WAIT_DECODE_S);
 		bytes = _buf_used(streambuf);
 		toend = (stream.state <= DISCONNECT);
 		UNLOCK_S;
-		LOCK_O;
-		space = _buf_space(outputbuf);
+		mutex_lock_timed(outputbuf->mutex, MET_WAIT_DECODE_O);
+		space = _output_buf_space();
 		UNLOCK_O;
 
 		LOCK_D;
@@ -73,17 +75,24 @@ static void *decode_thread(void *vargp) {
 		if (decode.state == DECODE_RUNNING && codec) {
 		
 			LOG_SDEBUG("streambuf bytes: %u outputbuf space: %u", bytes, space);
+			metrics_fill(MET_STREAMBUF, bytes, streambuf->size);
 
 			IF_DIRECT(
 				min_space = codec->min_space;
 			);
 			IF_PROCESS(
-				min_space = process.max_out_frames * BYTES_PER_FRAME;
+				min_space = process.max_out_frames * output.frame_bytes;
 			);
 			
 			if (space > min_space && (bytes > codec->min_read_bytes || toend)) {
-				
+#if METRICS || FLIGHTREC
+				u64_t start_us = gettime_us();
+#endif
+#if FLIGHTREC
+				u8_t *writep = outputbuf->writep; // only moved by this thread
+#endif
 				decode.state = codec->decode();
+				metrics_decode(codec, gettime_us() - start_us);
 
 				IF_PROCESS(
 					if (process.in_frames) {
@@ -95,6 +104,11 @@ static void *decode_thread(void *vargp) {
 					}
 				);
 
+#if FLIGHTREC
+				flight_record(FR_DECODE, codec->id, (outputbuf->writep >= writep ? outputbuf->writep - writep :
+							  outputbuf->writep + outputbuf->size - writep) / output.frame_bytes, bytes, gettime_us() - start_us);
+#endif
+
 				if (decode.state != DECODE_RUNNING) {
 
 					LOG_INFO("decode %s", decode.state == DECODE_COMPLETE ? "complete" : "error");
@@ -103,7 +117,7 @@ static void *decode_thread(void *vargp) {
 					if (output.fade_mode) _checkfade(false);
 					UNLOCK_O;
 
-					wake_controller();
+					wake_controller(WAKE_DECODE);
 				}
 
 				ran = true;
@@ -144,15 +158,12 @@ static void sort_codecs(int pry, struct codec* ptr) {
 
 static thread_type thread;
 
-void decode_init(log_level level, const char *include_codecs, const char *exclude_codecs) {
+static void register_codecs(const char *include_codecs, const char *exclude_codecs) {
 	int i;
 	char* order_codecs;
 
-	loglevel = level;
-
-	LOG_INFO("init decode");
+	memset(codecs, 0, sizeof(codecs));
 
-	// register codecs
 	// dsf,dff,alc,wma,wmap,wmal,aac,spt,ogg,ogf,flc,aif,pcm,mp3
 	i = 0;
 #if DSD
@@ -198,6 +209,21 @@ void decode_init(log_level level, const char *include_codecs, const char *exclud
 	if (!strstr(exclude_codecs, "mp3") && (!include_codecs || (order_codecs = strstr(include_codecs, "mp3"))))
 		sort_codecs((include_codecs ? order_codecs - include_codecs : i), register_mpg());
 #endif
+}
+
+// load all codec libraries in multi-player mode so the players inherit them when forked
+// each player registers the codecs selected by its own -c and -e again in decode_init, which finds the libraries loaded
+void decode_preload(log_level level) {
+	loglevel = level;
+	register_codecs(NULL, "");
+}
+
+void decode_init(log_level level, const char *include_codecs, const char *exclude_codecs) {
+	loglevel = level;
+
+	LOG_INFO("init decode");
+
+	register_codecs(include_codecs, exclude_codecs);
 
 	LOG_DEBUG("include codecs: %s exclude codecs: %s", include_codecs ? include_codecs : "", exclude_codecs);
 
@@ -257,15 +283,27 @@ unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]) {
 
 	MAY_PROCESS(
 		if (decode.process) {
+			unsigned fade_rates[2];
+			// crossfade due - only offer the rate of the track still in the buffer so the resampler converts to it
+			// and the crossfade can go ahead, the native rate is used again once the buffer is empty at a track start
+			if (decode.fade_resample && output.fade_mode == FADE_CROSSFADE && _buf_used(outputbuf) &&
+				output.next_sample_rate && output.next_sample_rate != sample_rate) {
+				LOG_INFO("crossfade from %u - resampling %u to match", output.next_sample_rate, sample_rate);
+				fade_rates[0] = output.next_sample_rate;
+				fade_rates[1] = 0;
+				supported_rates = fade_rates;
+			}
 			UNLOCK_O;
 			sample_rate = process_newstream(&decode.direct, sample_rate, supported_rates);
 			LOCK_O;
 		}
 	);
 
+	_output_buf_target(sample_rate);
+
 	// reduce threshold if we don't have enough room in outputbuf
-	if (output.threshold * sample_rate / 10 > outputbuf->size / BYTES_PER_FRAME / 2) {
-		output.threshold = (outputbuf->size / BYTES_PER_FRAME / 2 * 10) / sample_rate;
+	if (output.threshold * sample_rate / 10 > outputbuf->size / output.frame_bytes / 2) {
+		output.threshold = (outputbuf->size / output.frame_bytes / 2 * 10) / sample_rate;
 		LOG_WARN("output buffer too small - reducing threshold to %d ms", output.threshold * 10);
 	}
 
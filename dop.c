@@ -59,10 +59,17 @@ bool is_stream_dop(u8_t *lptr, u8_t *rptr, int step, frames_t frames) {
 	return false;
 }
 
-// update the dop marker and potentially invert polarity for frames in the output buffer
-// performaned on all output including silence to maintain marker phase consitency
-void update_dop(u32_t *ptr, frames_t frames, bool invert) {
-	static u32_t marker = 0x05;
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DOP_SSE2 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define DOP_NEON 1
+#include <arm_neon.h>
+#endif
+
+// marker kernels process a run of frames starting with marker and return the marker for the next frame
+static u32_t update_dop_c(u32_t *ptr, frames_t frames, bool invert, u32_t marker) {
 	if (!invert) {
 		while (frames--) {
 			u32_t scaled_marker = marker << 24;
@@ -82,6 +89,106 @@ void update_dop(u32_t *ptr, frames_t frames, bool invert) {
 			marker = ( 0x05 + 0xFA ) - marker;
 		}
 	}
+	return marker;
+}
+
+#if DOP_SSE2
+// 2 frames per vector, markers alternate per frame so the vector of markers is the same for each pair
+static u32_t update_dop_sse2(u32_t *ptr, frames_t frames, bool invert, u32_t marker) {
+	const __m128i mask = _mm_set1_epi32(0x00FFFF00);
+	const __m128i inv = _mm_set1_epi32(invert ? -1 : 0);
+	const __m128i mk = _mm_setr_epi32(marker << 24, marker << 24, (0xFF - marker) << 24, (0xFF - marker) << 24);
+	while (frames >= 2) {
+		__m128i x = _mm_xor_si128(_mm_loadu_si128((__m128i *)ptr), inv);
+		_mm_storeu_si128((__m128i *)ptr, _mm_or_si128(_mm_and_si128(x, mask), mk));
+		ptr += 4;
+		frames -= 2;
+	}
+	return update_dop_c(ptr, frames, invert, marker);
+}
+
+__attribute__((target("avx2")))
+static u32_t update_dop_avx2(u32_t *ptr, frames_t frames, bool invert, u32_t marker) {
+	const u32_t m0 = marker << 24, m1 = (0xFF - marker) << 24;
+	const __m256i mask = _mm256_set1_epi32(0x00FFFF00);
+	const __m256i inv = _mm256_set1_epi32(invert ? -1 : 0);
+	const __m256i mk = _mm256_setr_epi32(m0, m0, m1, m1, m0, m0, m1, m1);
+	while (frames >= 4) {
+		__m256i x = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)ptr), inv);
+		_mm256_storeu_si256((__m256i *)ptr, _mm256_or_si256(_mm256_and_si256(x, mask), mk));
+		ptr += 8;
+		frames -= 4;
+	}
+	return update_dop_sse2(ptr, frames, invert, marker);
+}
+#endif
+
+#if DOP_NEON
+static u32_t update_dop_neon(u32_t *ptr, frames_t frames, bool invert, u32_t marker) {
+	const u32_t m[4] = { marker << 24, marker << 24, (0xFF - marker) << 24, (0xFF - marker) << 24 };
+	const uint32x4_t mask = vdupq_n_u32(0x00FFFF00);
+	const uint32x4_t inv = vdupq_n_u32(invert ? 0xFFFFFFFF : 0);
+	const uint32x4_t mk = vld1q_u32(m);
+	while (frames >= 2) {
+		uint32x4_t x = veorq_u32(vld1q_u32(ptr), inv);
+		vst1q_u32(ptr, vorrq_u32(vandq_u32(x, mask), mk));
+		ptr += 4;
+		frames -= 2;
+	}
+	return update_dop_c(ptr, frames, invert, marker);
+}
+#endif
+
+static u32_t (*update_dop_kernel)(u32_t *ptr, frames_t frames, bool invert, u32_t marker) = update_dop_c;
+
+// update the dop marker and potentially invert polarity for frames in the output buffer
+// performaned on all output including silence to maintain marker phase consitency
+void update_dop(u32_t *ptr, frames_t frames, bool invert) {
+	static u32_t marker = 0x05;
+	marker = update_dop_kernel(ptr, frames, invert, marker);
+}
+
+// select the marker kernel for this cpu, checking it against the scalar version before use
+const char *dop_init(void) {
+	const char *name = "c";
+	u32_t ref[2 * 37], buf[2 * 37];
+	unsigned i;
+	int invert, start, fail = 0;
+
+#if DOP_SSE2
+	update_dop_kernel = update_dop_sse2;
+	name = "sse2";
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		update_dop_kernel = update_dop_avx2;
+		name = "avx2";
+	}
+#endif
+#if DOP_NEON
+	update_dop_kernel = update_dop_neon;
+	name = "neon";
+#endif
+
+	// odd frame count and both starting markers to cover the vector tail and marker phase
+	for (invert = 0; invert < 2; ++invert) {
+		for (start = 0; start < 2; ++start) {
+			u32_t marker = start ? 0xFA : 0x05;
+			for (i = 0; i < 2 * 37; ++i) {
+				ref[i] = buf[i] = i * 0x9E3779B9;
+			}
+			if (update_dop_c(ref, 37, invert, marker) != update_dop_kernel(buf, 37, invert, marker) ||
+				memcmp(ref, buf, sizeof(ref))) {
+				fail = 1;
+			}
+		}
+	}
+
+	if (fail) {
+		update_dop_kernel = update_dop_c;
+		name = "c (vector kernel failed check)";
+	}
+
+	return name;
 }
 
 #endif // DSD
@@ -65,6 +65,12 @@ typedef enum { UNKNOWN=0, DSF, DSDIFF } dsd_type;
 
 static dsd_format outfmt = PCM; // local copy of output.dsdfmt to avoid holding output lock
 
+// dsd to pcm conversion options, set in dsd_init
+static unsigned pcm_decimation = 1; // additional decimation after the 8:1 dsd2pcm filter, 0 = choose per stream
+static unsigned pcm_rate = 0;       // target pcm rate when choosing per stream, 0 = max rate of device
+static int pcm_quality = DSD2PCM_BALANCED; // stopband attenuation of the decimation stages
+static bool pcm_threads = false;    // convert right channel on a worker thread
+
 struct dsd {
 	dsd_type type;
 	u32_t consume;
@@ -74,11 +80,129 @@ struct dsd {
 	u32_t block_size;
 	bool  lsb_first;
 	dsd2pcm_ctx *dsd2pcm_ctx[2];
-	float *transfer[2];
 };
 
 static struct dsd *d;
 
+#if LINUX || OSX || FREEBSD
+// worker thread to convert the right channel in parallel with the left channel
+static struct {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool running;
+	bool busy;
+	dsd2pcm_ctx *ctx;
+	frames_t frames;
+	const u8_t *src;
+	ptrdiff_t stride;
+	bool lsb_first;
+	s32_t *dst;
+	frames_t out;
+} worker;
+
+static void *dsd_worker_thread(void *arg) {
+	pthread_mutex_lock(&worker.mutex);
+
+	while (worker.running) {
+		if (!worker.busy) {
+			pthread_cond_wait(&worker.cond, &worker.mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&worker.mutex);
+
+		worker.out = dsd2pcm_translate_s32(worker.ctx, worker.frames, worker.src, worker.stride, worker.lsb_first, worker.dst, 2);
+
+		pthread_mutex_lock(&worker.mutex);
+		worker.busy = false;
+		pthread_cond_broadcast(&worker.cond);
+	}
+
+	pthread_mutex_unlock(&worker.mutex);
+
+	return 0;
+}
+
+static void dsd_worker_start(void) {
+	pthread_attr_t attr;
+
+	if (worker.running) return;
+
+	pthread_mutex_init(&worker.mutex, NULL);
+	pthread_cond_init(&worker.cond, NULL);
+	worker.running = true;
+	worker.busy = false;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + DECODE_THREAD_STACK_SIZE);
+	if (pthread_create(&worker.thread, &attr, dsd_worker_thread, NULL)) {
+		LOG_WARN("unable to start dsd to pcm worker thread");
+		worker.running = false;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void dsd_worker_stop(void) {
+	if (!worker.running) return;
+
+	pthread_mutex_lock(&worker.mutex);
+	worker.running = false;
+	pthread_cond_broadcast(&worker.cond);
+	pthread_mutex_unlock(&worker.mutex);
+
+	pthread_join(worker.thread, NULL);
+	pthread_cond_destroy(&worker.cond);
+	pthread_mutex_destroy(&worker.mutex);
+}
+#endif
+
+// convert mono or stereo dsd to interleaved s32 pcm, returns the number of pcm frames written
+// with decimation this may be fewer than the number of input bytes per channel
+static frames_t dsd_to_pcm(frames_t frames, const u8_t *iptrl, const u8_t *iptrr, ptrdiff_t stride, bool lsb_first, s32_t *optr) {
+	frames_t out;
+
+	if (!iptrr) {
+		s32_t *ptr = optr;
+		frames_t count = out = dsd2pcm_translate_s32(d->dsd2pcm_ctx[0], frames, iptrl, stride, lsb_first, optr, 2);
+		while (count--) {
+			*(ptr + 1) = *ptr;
+			ptr += 2;
+		}
+		return out;
+	}
+
+#if LINUX || OSX || FREEBSD
+	if (worker.running) {
+		pthread_mutex_lock(&worker.mutex);
+		worker.ctx = d->dsd2pcm_ctx[1];
+		worker.frames = frames;
+		worker.src = iptrr;
+		worker.stride = stride;
+		worker.lsb_first = lsb_first;
+		worker.dst = optr + 1;
+		worker.busy = true;
+		pthread_cond_broadcast(&worker.cond);
+		pthread_mutex_unlock(&worker.mutex);
+
+		out = dsd2pcm_translate_s32(d->dsd2pcm_ctx[0], frames, iptrl, stride, lsb_first, optr, 2);
+
+		pthread_mutex_lock(&worker.mutex);
+		while (worker.busy) {
+			pthread_cond_wait(&worker.cond, &worker.mutex);
+		}
+		pthread_mutex_unlock(&worker.mutex);
+
+		return out;
+	}
+#endif
+
+	out = dsd2pcm_translate_s32(d->dsd2pcm_ctx[0], frames, iptrl, stride, lsb_first, optr, 2);
+	dsd2pcm_translate_s32(d->dsd2pcm_ctx[1], frames, iptrr, stride, lsb_first, optr + 1, 2);
+
+	return out;
+}
+
 static u64_t unpack64be(const u8_t *p) {
 	return 
 		(u64_t)p[0] << 56 | (u64_t)p[1] << 48 | (u64_t)p[2] << 40 | (u64_t)p[3] << 32 |
@@ -242,7 +366,7 @@ static decode_state _decode_dsf(void) {
 
 	while (block_left) {
 		
-		frames_t frames, out, count;
+		frames_t frames, out;
 		unsigned bytes_read;
 		
 		u8_t *iptrl = (u8_t *)streambuf->readp;
@@ -299,121 +423,15 @@ static decode_state _decode_dsf(void) {
 		frames = min(frames, BLOCK);
 		bytes_read = frames * bytes_per_frame;
 		
-		count = frames;
-		
 		switch (outfmt) {
 			
 		case DSD_U32_LE:
 		case DSD_U32_BE:
-			
-			if (d->channels == 1) {
-				if (d->lsb_first) {
-					while (count--) {
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 24 | dsd2pcm_bitreverse[*(iptrl+1)] << 16
-							| dsd2pcm_bitreverse[*(iptrl+2)] << 8 | dsd2pcm_bitreverse[*(iptrl+3)];
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 24 | dsd2pcm_bitreverse[*(iptrl+1)] << 16
-							| dsd2pcm_bitreverse[*(iptrl+2)] << 8 | dsd2pcm_bitreverse[*(iptrl+3)];
-						iptrl += 4;
-					}
-				} else {
-					while (count--) {
-						*(optr++) = *(iptrl) << 24 | *(iptrl+1) << 16 | *(iptrl+2) << 8 | *(iptrl+3);
-						*(optr++) = *(iptrl) << 24 | *(iptrl+1) << 16 | *(iptrl+2) << 8 | *(iptrl+3);
-						iptrl += 4;
-					}
-				}
-			} else {
-				if (d->lsb_first) {
-					while (count--) {
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 24 | dsd2pcm_bitreverse[*(iptrl+1)] << 16
-							| dsd2pcm_bitreverse[*(iptrl+2)] << 8 | dsd2pcm_bitreverse[*(iptrl+3)];
-						*(optr++) = dsd2pcm_bitreverse[*(iptrr)] << 24 | dsd2pcm_bitreverse[*(iptrr+1)] << 16
-							| dsd2pcm_bitreverse[*(iptrr+2)] << 8 | dsd2pcm_bitreverse[*(iptrr+3)];
-						iptrl += 4;
-						iptrr += 4;
-					}
-				} else {
-					while (count--) {
-						*(optr++) = *(iptrl) << 24 | *(iptrl+1) << 16 | *(iptrl+2) << 8 | *(iptrl+3);
-						*(optr++) = *(iptrr) << 24 | *(iptrr+1) << 16 | *(iptrr+2) << 8 | *(iptrr+3);
-						iptrl += 4;
-						iptrr += 4;
-					}
-				}
-			}
-			
-			break;
-
 		case DSD_U16_LE:
 		case DSD_U16_BE:
-			
-			if (d->channels == 1) {
-				if (d->lsb_first) {
-					while (count--) {
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 24 | dsd2pcm_bitreverse[*(iptrl+1)] << 16;
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 24 | dsd2pcm_bitreverse[*(iptrl+1)] << 16;
-						iptrl += 2;
-					}
-				} else {
-					while (count--) {
-						*(optr++) = *(iptrl) << 24 | *(iptrl+1) << 16;
-						*(optr++) = *(iptrl) << 24 | *(iptrl+1) << 16;
-						iptrl += 2;
-					}
-				}
-			} else {
-				if (d->lsb_first) {
-					while (count--) {
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 24 | dsd2pcm_bitreverse[*(iptrl+1)] << 16;
-						*(optr++) = dsd2pcm_bitreverse[*(iptrr)] << 24 | dsd2pcm_bitreverse[*(iptrr+1)] << 16;
-						iptrl += 2;
-						iptrr += 2;
-					}
-				} else {
-					while (count--) {
-						*(optr++) = *(iptrl) << 24 | *(iptrl+1) << 16;
-						*(optr++) = *(iptrr) << 24 | *(iptrr+1) << 16;
-						iptrl += 2;
-						iptrr += 2;
-					}
-				}
-			}
-			
-			break;
-
 		case DSD_U8:
 			
-			if (d->channels == 1) {
-				if (d->lsb_first) {
-					while (count--) {
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 24;
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 24;
-						iptrl += 1;
-					}
-				} else {
-					while (count--) {
-						*(optr++) = *(iptrl) << 24;
-						*(optr++) = *(iptrl) << 24;
-						iptrl += 1;
-					}
-				}
-			} else {
-				if (d->lsb_first) {
-					while (count--) {
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 24;
-						*(optr++) = dsd2pcm_bitreverse[*(iptrr)] << 24;
-						iptrl += 1;
-						iptrr += 1;
-					}
-				} else {
-					while (count--) {
-						*(optr++) = *(iptrl) << 24;
-						*(optr++) = *(iptrr) << 24;
-						iptrl += 1;
-						iptrr += 1;
-					}
-				}
-			}
+			dsd2pcm_pack(optr, iptrl, d->channels == 1 ? NULL : iptrr, frames, bytes_per_frame, 0, d->lsb_first);
 			
 			break;
 
@@ -421,68 +439,13 @@ static decode_state _decode_dsf(void) {
 		case DOP_S24_LE:
 		case DOP_S24_3LE:
 			
-			if (d->channels == 1) {
-				if (d->lsb_first) {
-					while (count--) {
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 16 | dsd2pcm_bitreverse[*(iptrl+1)] << 8;
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 16 | dsd2pcm_bitreverse[*(iptrl+1)] << 8;
-						iptrl += 2;
-					}
-				} else {
-					while (count--) {
-						*(optr++) = *(iptrl) << 16 | *(iptrl+1) << 8;
-						*(optr++) = *(iptrl) << 16 | *(iptrl+1) << 8;
-						iptrl += 2;
-					}
-				}
-			} else {
-				if (d->lsb_first) {
-					while (count--) {
-						*(optr++) = dsd2pcm_bitreverse[*(iptrl)] << 16 | dsd2pcm_bitreverse[*(iptrl+1)] << 8;
-						*(optr++) = dsd2pcm_bitreverse[*(iptrr)] << 16 | dsd2pcm_bitreverse[*(iptrr+1)] << 8;
-						iptrl += 2;
-						iptrr += 2;
-					}
-				} else {
-					while (count--) {
-						*(optr++) = *(iptrl) << 16 | *(iptrl+1) << 8;
-						*(optr++) = *(iptrr) << 16 | *(iptrr+1) << 8;
-						iptrl += 2;
-						iptrr += 2;
-					}
-				}
-			}
+			dsd2pcm_pack(optr, iptrl, d->channels == 1 ? NULL : iptrr, frames, bytes_per_frame, 8, d->lsb_first);
 			
 			break;
 
 		case PCM:
 			
-			if (d->channels == 1) {
-				float *iptrf = d->transfer[0];
-				dsd2pcm_translate(d->dsd2pcm_ctx[0], frames, iptrl, 1, d->lsb_first, iptrf, 1);
-				while (count--) {
-					double scaled = *iptrf++ * 0x7fffffff;
-					if (scaled >  2147483647.0) scaled =  2147483647.0;
-					if (scaled < -2147483648.0) scaled = -2147483648.0;
-					*optr++ = (s32_t)scaled;
-					*optr++ = (s32_t)scaled;
-				}
-			} else {
-				float *iptrfl = d->transfer[0];
-				float *iptrfr = d->transfer[1];
-				dsd2pcm_translate(d->dsd2pcm_ctx[0], frames, iptrl, 1, d->lsb_first, iptrfl, 1);
-				dsd2pcm_translate(d->dsd2pcm_ctx[1], frames, iptrr, 1, d->lsb_first, iptrfr, 1);
-				while (count--) {
-					double scaledl = *iptrfl++ * 0x7fffffff;
-					double scaledr = *iptrfr++ * 0x7fffffff;
-					if (scaledl >  2147483647.0) scaledl =  2147483647.0;
-					if (scaledl < -2147483648.0) scaledl = -2147483648.0;
-					if (scaledr >  2147483647.0) scaledr =  2147483647.0;
-					if (scaledr < -2147483648.0) scaledr = -2147483648.0;
-					*optr++ = (s32_t)scaledl;
-					*optr++ = (s32_t)scaledr;
-				}
-			}
+			frames = dsd_to_pcm(frames, iptrl, d->channels == 1 ? NULL : iptrr, 1, d->lsb_first, (s32_t *)optr);
 			
 			break;
 			
@@ -674,32 +637,7 @@ static decode_state _decode_dsdiff(void) {
 		
 	case PCM:
 		
-		if (d->channels == 1) {
-			float *iptrf = d->transfer[0];
-			dsd2pcm_translate(d->dsd2pcm_ctx[0], frames, iptr, 1, 0, iptrf, 1);
-			while (count--) {
-				double scaled = *iptrf++ * 0x7fffffff;
-				if (scaled >  2147483647.0) scaled =  2147483647.0;
-				if (scaled < -2147483648.0) scaled = -2147483648.0;
-				*optr++ = (s32_t)scaled;
-				*optr++ = (s32_t)scaled;
-			}
-		} else {
-			float *iptrfl = d->transfer[0];
-			float *iptrfr = d->transfer[1];
-			dsd2pcm_translate(d->dsd2pcm_ctx[0], frames, iptr,     d->channels, 0, iptrfl, 1);
-			dsd2pcm_translate(d->dsd2pcm_ctx[1], frames, iptr + 1, d->channels, 0, iptrfr, 1);
-			while (count--) {
-				double scaledl = *iptrfl++ * 0x7fffffff;
-				double scaledr = *iptrfr++ * 0x7fffffff;
-				if (scaledl >  2147483647.0) scaledl =  2147483647.0;
-				if (scaledl < -2147483648.0) scaledl = -2147483648.0;
-				if (scaledr >  2147483647.0) scaledr =  2147483647.0;
-				if (scaledr < -2147483648.0) scaledr = -2147483648.0;
-				*optr++ = (s32_t)scaledl;
-				*optr++ = (s32_t)scaledr;
-			}
-		}
+		frames = dsd_to_pcm(frames, iptr, d->channels == 1 ? NULL : iptr + 1, d->channels, false, (s32_t *)optr);
 
 		break;
 		
@@ -812,14 +750,28 @@ static decode_state dsd_decode(void) {
 			LOG_INFO("DSD sample rate too high for device - converting to PCM");
 			outfmt = PCM;
 		}
+
+		if (outfmt != PCM && output.frame_bytes != BYTES_PER_FRAME) {
+			LOG_INFO("DSD needs 32 bit outputbuf - converting to PCM");
+			outfmt = PCM;
+		}
 		
 		if (outfmt == PCM) {
-			LOG_INFO("DSD to PCM output");
-			output.next_sample_rate = decode_newstream(d->sample_rate / 8, output.supported_rates);
+			unsigned ratio = pcm_decimation;
+			if (!ratio) {
+				// decimate until at or below the target rate so no further resampling is needed
+				unsigned target = pcm_rate ? pcm_rate : output.supported_rates[0];
+				for (ratio = 1; ratio < 16 && d->sample_rate / 8 / ratio > target; ratio *= 2);
+			}
+			dsd2pcm_set_decimation(d->dsd2pcm_ctx[0], ratio, pcm_quality);
+			dsd2pcm_set_decimation(d->dsd2pcm_ctx[1], ratio, pcm_quality);
+			LOG_INFO("DSD to PCM output, decimation: %u", ratio);
+			output.next_sample_rate = decode_newstream(d->sample_rate / 8 / ratio, output.supported_rates);
 			if (output.fade_mode) _checkfade(true);
 		} else {
 			LOG_INFO("DSD%u stream, format: %s, rate: %uHz\n", d->sample_rate / 44100, fmtstr, output.next_sample_rate);
 			output.fade = FADE_INACTIVE;
+			_output_buf_target(output.next_sample_rate);
 		}
 
 		output.next_fmt = outfmt;
@@ -847,11 +799,47 @@ static decode_state dsd_decode(void) {
 	return ret;
 }
 
-void dsd_init(dsd_format format, unsigned delay) {
+void dsd_init(dsd_format format, unsigned delay, char *pcm_opt) {
 	LOCK_O;
 	output.dsdfmt = format;
 	output.dsd_delay = delay;
 	UNLOCK_O;
+
+	// pcm_opt = <ratio|rate|max>:<threads>:<quality>
+	// called before register_dsd sets the log level so errors are reported directly as for other options
+	if (pcm_opt) {
+		char *r = next_param(pcm_opt, ':');
+		char *t = next_param(NULL, ':');
+		char *q = next_param(NULL, ':');
+
+		if (r && *r) {
+			unsigned val = atoi(r);
+			if (!strcmp(r, "max")) {
+				pcm_decimation = 0;
+				pcm_rate = 0;
+			} else if (val == 1 || val == 2 || val == 4 || val == 8 || val == 16) {
+				pcm_decimation = val;
+			} else if (val > 16) {
+				pcm_decimation = 0;
+				pcm_rate = val;
+			} else {
+				fprintf(stderr, "invalid dsd to pcm decimation: %s, using 1\n", r);
+			}
+		}
+		if (t && *t) {
+#if LINUX || OSX || FREEBSD
+			pcm_threads = atoi(t) ? true : false;
+#else
+			fprintf(stderr, "dsd to pcm worker thread not supported on this platform\n");
+#endif
+		}
+		if (q && *q) {
+			if (!strcmp(q, "low")) pcm_quality = DSD2PCM_LOW_CPU;
+			else if (!strcmp(q, "balanced")) pcm_quality = DSD2PCM_BALANCED;
+			else if (!strcmp(q, "high")) pcm_quality = DSD2PCM_HIGH_PRECISION;
+			else fprintf(stderr, "invalid dsd to pcm quality: %s\n", q);
+		}
+	}
 }
 
 static void dsd_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
@@ -864,10 +852,12 @@ static void dsd_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 		dsd2pcm_reset(d->dsd2pcm_ctx[0]);
 		dsd2pcm_reset(d->dsd2pcm_ctx[1]);
 	}
-	if (!d->transfer[1]) {
-		d->transfer[0] = malloc(sizeof(float) * BLOCK);
-		d->transfer[1] = malloc(sizeof(float) * BLOCK);
+
+#if LINUX || OSX || FREEBSD
+	if (pcm_threads) {
+		dsd_worker_start();
 	}
+#endif
 }
 
 static void dsd_close(void) {
@@ -877,15 +867,13 @@ static void dsd_close(void) {
 		d->dsd2pcm_ctx[0] = NULL;
 		d->dsd2pcm_ctx[1] = NULL;
 	}
-	if (d->transfer[0]) {
-		free(d->transfer[0]);
-		free(d->transfer[1]);
-		d->transfer[0] = NULL;
-		d->transfer[1] = NULL;
-	}
+#if LINUX || OSX || FREEBSD
+	dsd_worker_stop();
+#endif
 }
 
 struct codec *register_dsd(void) {
+	const char *dop_kernel;
 	static struct codec ret = { 
 		'd',         // id
 		"dsf,dff",   // types
@@ -903,20 +891,20 @@ struct codec *register_dsd(void) {
 
 	memset(d, 0, sizeof(struct dsd));
 
+	// also selects the conversion and packing kernels for this cpu
 	dsd2pcm_precalc();
+	dop_kernel = dop_init();
 
 	LOG_INFO("using dsd to decode dsf,dff");
+	LOG_INFO("dsd to pcm kernel: %s decimation: %u rate: %u quality: %d threads: %u", dsd2pcm_kernel_name(), pcm_decimation, pcm_rate,
+			 pcm_quality, pcm_threads);
+	LOG_INFO("dsd packing kernel: %s dop kernel: %s", dsd2pcm_pack_name(), dop_kernel);
 	return &ret;
 }
 
 // invert polarity for frames in the output buffer
 void dsd_invert(u32_t *ptr, frames_t frames) {
-	while (frames--) {
-		*ptr = ~(*ptr);
-		++ptr;
-		*ptr = ~(*ptr);
-		++ptr;
-	}
+	dsd2pcm_invert(ptr, frames);
 }
 
 // fill silence buffer with 10101100 which represents dsd silence
@@ -31,11 +31,15 @@ or implied, of Sebastian Gesemann.
 Additions (c) Adrian Smith, 2013 under same licence terms:
 - expose bitreverse array as dsd2pcm_bitreverse
 - expose precalc function as dsd2pcm_precalc to allow it to be initalised
+- linear history and vectorised table lookup kernels (sse2/avx2/neon)
+- fused conversion to s32 and optional halfband decimation stages
+- dsf native and dop packing and polarity inversion kernels for squeezelite output
 
  */
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include "dsd2pcm.h"
 
@@ -48,6 +52,25 @@ Additions (c) Adrian Smith, 2013 under same licence terms:
 #error "FIFOSIZE too small"
 #endif
 
+#define HISTORY  (CTABLES*2-1)  /* bytes of past input needed per output */
+#define CHUNK    256            /* bytes processed per pass of the kernel */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define HB_MAXTAPS 171          /* longest halfband filter, (taps-1)/2 must be odd */
+#define HB_STAGES  4            /* maximum decimation of 16 */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DSD2PCM_SSE2 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define DSD2PCM_NEON 1
+#include <arm_neon.h>
+#endif
+
 /*
  * Properties of this 96-tap lowpass filter when applied on a signal
  * with sampling rate of 44100*64 Hz:
@@ -123,6 +146,79 @@ static float ctables[CTABLES][256];
 unsigned char dsd2pcm_bitreverse[256];
 static int precalculated = 0;
 
+/*
+ * Halfband designs for the decimation stages, only odd offsets from the centre
+ * are non zero so each output costs (taps+1)/4 multiplies plus the centre tap.
+ * Every stage keeps what aliases into the passband of the chain, 90% of the
+ * output nyquist, below the stopband attenuation of the preset.  A stage n from
+ * the end, running at 2^(n+1) times the output rate, has a transition band of
+ * 0.5 - 0.9/2^(n+1) of its input rate: early stages are short, the last one sets
+ * the passband.  Lengths and windows are the shortest meeting the attenuation.
+ */
+static struct hbdesign {
+	unsigned taps;
+	double beta;                  /* kaiser window */
+	float coefs[(HB_MAXTAPS+1)/4];
+} hbdesigns[][HB_STAGES] = {      /* [quality][stage counted from the last] */
+	{ { 119,  9.45 }, { 23, 10.35 }, { 15,  9.55 }, { 11,  8.10 } }, /* DSD2PCM_LOW_CPU:         90dB */
+	{ { 147, 11.60 }, { 27, 12.25 }, { 19, 11.10 }, { 15,  9.80 } }, /* DSD2PCM_BALANCED:       110dB */
+	{ { 171, 13.50 }, { 35, 15.45 }, { 23, 14.65 }, { 19, 13.55 } }, /* DSD2PCM_HIGH_PRECISION: 130dB */
+};
+
+static void kernel_c(size_t n, const unsigned char *lin, const unsigned char *rev, float *out);
+static void (*kernel)(size_t n, const unsigned char *lin, const unsigned char *rev, float *out) = kernel_c;
+static void (*pack)(uint32_t *dst, const unsigned char *srcl, const unsigned char *srcr, size_t frames,
+	unsigned bytes, unsigned shift, int lsbitfirst) = dsd2pcm_pack_c;
+static void (*invert)(uint32_t *ptr, size_t frames) = dsd2pcm_invert_c;
+
+/* zeroth order modified bessel function for kaiser window */
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	int k;
+	for (k=1; k<32; ++k) {
+		term *= (x / (2*k)) * (x / (2*k));
+		sum += term;
+	}
+	return sum;
+}
+
+/* halfband lowpass, kaiser windowed sinc */
+static void halfband_precalc(struct hbdesign *hd)
+{
+	const int half = (hd->taps-1)/2;
+	const int coefs = (hd->taps+1)/4;
+	double h[(HB_MAXTAPS+1)/4];
+	double sum = 0.0;
+	int j;
+	for (j=0; j<coefs; ++j) {
+		int n = 2*j+1;
+		double r = (double)n / (half+1);
+		double w = bessel_i0(hd->beta * sqrt(1.0 - r*r)) / bessel_i0(hd->beta);
+		h[j] = sin(M_PI * n / 2) / (M_PI * n) * w;
+		sum += h[j];
+	}
+	/* normalise for unity gain at dc: 0.5 + 2 * sum = 1 */
+	for (j=0; j<coefs; ++j) {
+		hd->coefs[j] = (float)(h[j] * 0.25 / sum);
+	}
+}
+
+#if DSD2PCM_SSE2
+static void kernel_sse2(size_t n, const unsigned char *lin, const unsigned char *rev, float *out);
+static void kernel_avx2(size_t n, const unsigned char *lin, const unsigned char *rev, float *out);
+static void pack_ssse3(uint32_t *dst, const unsigned char *srcl, const unsigned char *srcr, size_t frames,
+	unsigned bytes, unsigned shift, int lsbitfirst);
+static void invert_sse2(uint32_t *ptr, size_t frames);
+static void invert_avx2(uint32_t *ptr, size_t frames);
+#endif
+#if DSD2PCM_NEON
+static void kernel_neon(size_t n, const unsigned char *lin, const unsigned char *rev, float *out);
+static void pack_neon(uint32_t *dst, const unsigned char *srcl, const unsigned char *srcr, size_t frames,
+	unsigned bytes, unsigned shift, int lsbitfirst);
+static void invert_neon(uint32_t *ptr, size_t frames);
+#endif
+
 void dsd2pcm_precalc(void)
 {
 	int t, e, m, k;
@@ -144,21 +240,77 @@ void dsd2pcm_precalc(void)
 			ctables[CTABLES-1-t][e] = (float)acc;
 		}
 	}
+	for (t=0; t<(int)(sizeof(hbdesigns)/sizeof(hbdesigns[0])); ++t) {
+		for (k=0; k<HB_STAGES; ++k) {
+			halfband_precalc(&hbdesigns[t][k]);
+		}
+	}
+#if DSD2PCM_SSE2
+	kernel = kernel_sse2;
+	invert = invert_sse2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernel = kernel_avx2;
+		invert = invert_avx2;
+	}
+	if (__builtin_cpu_supports("ssse3")) pack = pack_ssse3;
+#endif
+#if DSD2PCM_NEON
+	kernel = kernel_neon;
+	pack = pack_neon;
+	invert = invert_neon;
+#endif
 	precalculated = 1;
 }
 
+const char *dsd2pcm_kernel_name(void)
+{
+#if DSD2PCM_SSE2
+	if (kernel == kernel_avx2) return "avx2";
+	if (kernel == kernel_sse2) return "sse2";
+#endif
+#if DSD2PCM_NEON
+	if (kernel == kernel_neon) return "neon";
+#endif
+	return "c";
+}
+
+struct halfband
+{
+	const struct hbdesign *design;
+	float x[HB_MAXTAPS*2];     /* mirrored delay line so a window is always contiguous */
+	unsigned pos;
+	unsigned phase;
+};
+
 struct dsd2pcm_ctx_s
 {
-	unsigned char fifo[FIFOSIZE];
-	unsigned fifopos;
+	unsigned char hist[HISTORY]; /* previous input bytes, oldest first, msb first */
+	unsigned ratio;
+	unsigned stages;
+	struct halfband hb[HB_STAGES];
 };
 
+static void halfband_reset(dsd2pcm_ctx* ptr)
+{
+	unsigned st;
+	for (st=0; st<HB_STAGES; ++st) {
+		memset(ptr->hb[st].x, 0, sizeof(ptr->hb[st].x));
+		ptr->hb[st].pos = 0;
+		ptr->hb[st].phase = 0;
+	}
+}
+
 extern dsd2pcm_ctx* dsd2pcm_init()
 {
 	dsd2pcm_ctx* ptr;
 	if (!precalculated) dsd2pcm_precalc();
 	ptr = (dsd2pcm_ctx*) malloc(sizeof(dsd2pcm_ctx));
-	if (ptr) dsd2pcm_reset(ptr);
+	if (ptr) {
+		ptr->ratio = 1;
+		ptr->stages = 0;
+		dsd2pcm_reset(ptr);
+	}
 	return ptr;
 }
 
@@ -180,14 +332,138 @@ extern dsd2pcm_ctx* dsd2pcm_clone(dsd2pcm_ctx* ptr)
 extern void dsd2pcm_reset(dsd2pcm_ctx* ptr)
 {
 	int i;
-	for (i=0; i<FIFOSIZE; ++i)
-		ptr->fifo[i] = 0x69; /* my favorite silence pattern */
-	ptr->fifopos = 0;
+	/* equivalent to the original fifo filled with 0x69, where bytes older than
+	 * CTABLES+1 are held bit reversed and so are seen as 0x96
+	 */
+	for (i=0; i<HISTORY; ++i)
+		ptr->hist[i] = i < HISTORY-CTABLES ? 0x96 : 0x69; /* my favorite silence pattern */
 	/* 0x69 = 01101001
 	 * This pattern "on repeat" makes a low energy 352.8 kHz tone
 	 * and a high energy 1.0584 MHz tone which should be filtered
 	 * out completely by any playback system --> silence
 	 */
+	halfband_reset(ptr);
+}
+
+extern int dsd2pcm_set_decimation(dsd2pcm_ctx* ptr, unsigned ratio, int quality)
+{
+	unsigned stages = 0, st;
+	while ((1u << stages) < ratio) ++stages;
+	if ((1u << stages) != ratio || stages > HB_STAGES)
+		return -1;
+	if (quality < 0 || quality >= (int)(sizeof(hbdesigns)/sizeof(hbdesigns[0])))
+		return -1;
+	ptr->ratio = ratio;
+	ptr->stages = stages;
+	for (st=0; st<stages; ++st) {
+		ptr->hb[st].design = &hbdesigns[quality][stages-1-st];
+	}
+	halfband_reset(ptr);
+	return 0;
+}
+
+/*
+ * FIR on a linear byte history - lin[k] for k < 0 holds previous bytes
+ * output i uses lin[i-t] (t < CTABLES) and the bit reversed bytes rev[i-HISTORY+t]
+ * the order of accumulation matches the original fifo implementation exactly
+ * so all kernels give bit identical results
+ */
+static void kernel_c(size_t n, const unsigned char *lin, const unsigned char *rev, float *out)
+{
+	size_t s;
+	unsigned i;
+	double acc;
+	for (s=0; s<n; ++s) {
+		acc = 0;
+		for (i=0; i<CTABLES; ++i) {
+			acc += ctables[i][lin[s-i]] + ctables[i][rev[s-HISTORY+i]];
+		}
+		out[s] = (float)acc;
+	}
+}
+
+#if DSD2PCM_SSE2
+/* 4 outputs at a time, pairs summed in single precision then accumulated in double as per kernel_c */
+static void kernel_sse2(size_t n, const unsigned char *lin, const unsigned char *rev, float *out)
+{
+	size_t s;
+	unsigned i;
+	for (s=0; s+4<=n; s+=4) {
+		__m128d lo = _mm_setzero_pd(), hi = _mm_setzero_pd();
+		for (i=0; i<CTABLES; ++i) {
+			const unsigned char *a = lin + s - i, *b = rev + s - HISTORY + i;
+			const float *t = ctables[i];
+			__m128 v = _mm_add_ps(_mm_set_ps(t[a[3]], t[a[2]], t[a[1]], t[a[0]]),
+								  _mm_set_ps(t[b[3]], t[b[2]], t[b[1]], t[b[0]]));
+			lo = _mm_add_pd(lo, _mm_cvtps_pd(v));
+			hi = _mm_add_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+		}
+		_mm_storeu_ps(out + s, _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+	}
+	if (s < n) kernel_c(n - s, lin + s, rev + s, out + s);
+}
+
+/* 8 outputs at a time using gathers for the table lookups */
+__attribute__((target("avx2")))
+static void kernel_avx2(size_t n, const unsigned char *lin, const unsigned char *rev, float *out)
+{
+	size_t s;
+	unsigned i;
+	for (s=0; s+8<=n; s+=8) {
+		__m256d lo = _mm256_setzero_pd(), hi = _mm256_setzero_pd();
+		for (i=0; i<CTABLES; ++i) {
+			__m256i ia = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(lin + s - i)));
+			__m256i ib = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(rev + s - HISTORY + i)));
+			__m256 v = _mm256_add_ps(_mm256_i32gather_ps(ctables[i], ia, 4), _mm256_i32gather_ps(ctables[i], ib, 4));
+			lo = _mm256_add_pd(lo, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+			hi = _mm256_add_pd(hi, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+		}
+		_mm_storeu_ps(out + s, _mm256_cvtpd_ps(lo));
+		_mm_storeu_ps(out + s + 4, _mm256_cvtpd_ps(hi));
+	}
+	if (s < n) kernel_c(n - s, lin + s, rev + s, out + s);
+}
+#endif
+
+#if DSD2PCM_NEON
+static void kernel_neon(size_t n, const unsigned char *lin, const unsigned char *rev, float *out)
+{
+	size_t s;
+	unsigned i;
+	for (s=0; s+4<=n; s+=4) {
+		float64x2_t lo = vdupq_n_f64(0), hi = vdupq_n_f64(0);
+		for (i=0; i<CTABLES; ++i) {
+			const unsigned char *a = lin + s - i, *b = rev + s - HISTORY + i;
+			const float *t = ctables[i];
+			float ta[4] = { t[a[0]], t[a[1]], t[a[2]], t[a[3]] };
+			float tb[4] = { t[b[0]], t[b[1]], t[b[2]], t[b[3]] };
+			float32x4_t v = vaddq_f32(vld1q_f32(ta), vld1q_f32(tb));
+			lo = vaddq_f64(lo, vcvt_f64_f32(vget_low_f32(v)));
+			hi = vaddq_f64(hi, vcvt_high_f64_f32(v));
+		}
+		vst1q_f32(out + s, vcvt_high_f32_f64(vcvt_f32_f64(lo), hi));
+	}
+	if (s < n) kernel_c(n - s, lin + s, rev + s, out + s);
+}
+#endif
+
+/* load next chunk of input after the history, returns pointer to first new byte */
+static unsigned char *load_chunk(dsd2pcm_ctx* ptr, unsigned char *lin, unsigned char *rev,
+	size_t n, const unsigned char *src, ptrdiff_t src_stride, int lsbf)
+{
+	size_t i;
+	unsigned char *in = lin + HISTORY;
+	memcpy(lin, ptr->hist, HISTORY);
+	if (lsbf) {
+		for (i=0; i<n; ++i, src += src_stride) in[i] = dsd2pcm_bitreverse[*src];
+	} else if (src_stride == 1) {
+		memcpy(in, src, n);
+	} else {
+		for (i=0; i<n; ++i, src += src_stride) in[i] = *src;
+	}
+	for (i=0; i<HISTORY+n; ++i) rev[i] = dsd2pcm_bitreverse[lin[i]];
+	memcpy(ptr->hist, lin + n, HISTORY);
+	return in;
 }
 
 extern void dsd2pcm_translate(
@@ -197,28 +473,290 @@ extern void dsd2pcm_translate(
 	int lsbf,
 	float *dst, ptrdiff_t dst_stride)
 {
-	unsigned ffp;
-	unsigned i;
-	unsigned bite1, bite2;
-	unsigned char* p;
+	unsigned char lin[HISTORY+CHUNK], rev[HISTORY+CHUNK];
+	float tmp[CHUNK];
+	while (samples > 0) {
+		size_t i, n = samples < CHUNK ? samples : CHUNK;
+		unsigned char *in = load_chunk(ptr, lin, rev, n, src, src_stride, lsbf);
+		if (dst_stride == 1) {
+			kernel(n, in, rev + HISTORY, dst);
+			dst += n;
+		} else {
+			kernel(n, in, rev + HISTORY, tmp);
+			for (i=0; i<n; ++i, dst += dst_stride) *dst = tmp[i];
+		}
+		src += n * src_stride;
+		samples -= n;
+	}
+}
+
+/* scale to s32 with clipping, note f * 0x7fffffff is evaluated in single precision */
+static void convert_s32(size_t n, const float *in, int32_t *dst, ptrdiff_t dst_stride)
+{
+	size_t i = 0;
+#if DSD2PCM_SSE2
+	const __m128 scale = _mm_set1_ps((float)0x7fffffff);
+	const __m128d top = _mm_set1_pd(2147483647.0), bot = _mm_set1_pd(-2147483648.0);
+	for (; i+2<=n; i+=2) {
+		__m128 f = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(in + i)));
+		__m128d v = _mm_cvtps_pd(_mm_mul_ps(f, scale));
+		__m128i r = _mm_cvttpd_epi32(_mm_max_pd(_mm_min_pd(v, top), bot));
+		dst[0] = _mm_cvtsi128_si32(r);
+		dst[dst_stride] = _mm_cvtsi128_si32(_mm_shuffle_epi32(r, 1));
+		dst += 2 * dst_stride;
+	}
+#endif
+	for (; i<n; ++i, dst += dst_stride) {
+		double scaled = in[i] * 0x7fffffff;
+		if (scaled >  2147483647.0) scaled =  2147483647.0;
+		if (scaled < -2147483648.0) scaled = -2147483648.0;
+		*dst = (int32_t)scaled;
+	}
+}
+
+/* push one sample into a halfband decimator, returns 1 and sets out when an output is due */
+static int halfband(struct halfband *hb, float in, float *out)
+{
+	const unsigned taps = hb->design->taps;
+	const float *c = hb->design->coefs;
+	const float *x;
 	double acc;
-	ffp = ptr->fifopos;
-	lsbf = lsbf ? 1 : 0;
-	while (samples-- > 0) {
-		bite1 = *src & 0xFFu;
-		if (lsbf) bite1 = dsd2pcm_bitreverse[bite1];
-		ptr->fifo[ffp] = bite1; src += src_stride;
-		p = ptr->fifo + ((ffp-CTABLES) & FIFOMASK);
-		*p = dsd2pcm_bitreverse[*p & 0xFF];
-		acc = 0;
-		for (i=0; i<CTABLES; ++i) {
-			bite1 = ptr->fifo[(ffp              -i) & FIFOMASK] & 0xFF;
-			bite2 = ptr->fifo[(ffp-(CTABLES*2-1)+i) & FIFOMASK] & 0xFF;
-			acc += ctables[i][bite1] + ctables[i][bite2];
+	unsigned j;
+	hb->x[hb->pos] = hb->x[hb->pos + taps] = in;
+	if (++hb->pos == taps) hb->pos = 0;
+	hb->phase ^= 1;
+	if (hb->phase) return 0;
+	x = hb->x + hb->pos + (taps-1)/2; /* centre of current window */
+	acc = 0.5 * x[0];
+	for (j=0; j<(taps+1)/4; ++j) {
+		acc += c[j] * ((double)x[-(int)(2*j+1)] + x[2*j+1]);
+	}
+	*out = (float)acc;
+	return 1;
+}
+
+extern size_t dsd2pcm_translate_s32(
+	dsd2pcm_ctx* ptr,
+	size_t samples,
+	const unsigned char *src, ptrdiff_t src_stride,
+	int lsbf,
+	int32_t *dst, ptrdiff_t dst_stride)
+{
+	unsigned char lin[HISTORY+CHUNK], rev[HISTORY+CHUNK];
+	float tmp[CHUNK];
+	size_t total = 0;
+	while (samples > 0) {
+		size_t i, n = samples < CHUNK ? samples : CHUNK, m = n;
+		unsigned char *in = load_chunk(ptr, lin, rev, n, src, src_stride, lsbf);
+		kernel(n, in, rev + HISTORY, tmp);
+		if (ptr->stages) {
+			/* decimate in place, each stage halves the number of samples */
+			unsigned st;
+			for (st=0; st<ptr->stages; ++st) {
+				size_t k = m;
+				for (i=0, m=0; i<k; ++i) {
+					if (halfband(&ptr->hb[st], tmp[i], tmp + m)) ++m;
+				}
+			}
 		}
-		*dst = (float)acc; dst += dst_stride;
-		ffp = (ffp + 1) & FIFOMASK;
+		convert_s32(m, tmp, dst, dst_stride);
+		dst += m * dst_stride;
+		total += m;
+		src += n * src_stride;
+		samples -= n;
 	}
-	ptr->fifopos = ffp;
+	return total;
 }
 
+/* native and dop packing, see dsd2pcm_pack in dsd2pcm.h */
+extern void dsd2pcm_pack_c(uint32_t *dst, const unsigned char *srcl, const unsigned char *srcr, size_t frames,
+	unsigned bytes, unsigned shift, int lsbitfirst)
+{
+	while (frames--) {
+		uint32_t l = 0, r = 0;
+		unsigned k;
+		for (k=0; k<bytes; ++k) {
+			unsigned char bl = srcl[k];
+			unsigned char br = srcr ? srcr[k] : bl;
+			if (lsbitfirst) {
+				bl = dsd2pcm_bitreverse[bl];
+				br = dsd2pcm_bitreverse[br];
+			}
+			l |= (uint32_t)bl << (24 - 8*k);
+			r |= (uint32_t)br << (24 - 8*k);
+		}
+		*(dst++) = l >> shift;
+		*(dst++) = r >> shift;
+		srcl += bytes;
+		if (srcr) srcr += bytes;
+	}
+}
+
+extern void dsd2pcm_invert_c(uint32_t *ptr, size_t frames)
+{
+	while (frames--) {
+		ptr[0] = ~ptr[0];
+		ptr[1] = ~ptr[1];
+		ptr += 2;
+	}
+}
+
+#if DSD2PCM_SSE2 || DSD2PCM_NEON
+/* byte shuffle placing the input bytes of frames [first, first+n) into little endian output samples, 0x80 = zero */
+static void pack_mask(unsigned char *mask, unsigned first, unsigned n, unsigned bytes, unsigned shift)
+{
+	unsigned j, p;
+	for (j=0; j<n; ++j) {
+		for (p=0; p<4; ++p) {
+			int k = 3 - (int)p - (int)shift/8;
+			mask[j*4+p] = (k >= 0 && k < (int)bytes) ? (first+j)*bytes + k : 0x80;
+		}
+	}
+}
+#endif
+
+#if DSD2PCM_SSE2
+/* bit reversal as two 16 entry nibble lookups: rev(b) = rev4(b & 0xF) << 4 | rev4(b >> 4) */
+__attribute__((target("ssse3")))
+static inline __m128i reverse_ssse3(__m128i x)
+{
+	const __m128i nib = _mm_set1_epi8(0x0F);
+	const __m128i rev_lo = _mm_setr_epi8(0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0,
+										 0x10, 0x90, 0x50, 0xD0, 0x30, 0xB0, 0x70, 0xF0);
+	const __m128i rev_hi = _mm_setr_epi8(0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF);
+	return _mm_or_si128(_mm_shuffle_epi8(rev_lo, _mm_and_si128(x, nib)),
+						_mm_shuffle_epi8(rev_hi, _mm_and_si128(_mm_srli_epi16(x, 4), nib)));
+}
+
+/* 16 input bytes per channel, each group of 4 frames is shuffled into place then interleaved l/r */
+__attribute__((target("ssse3")))
+static void pack_ssse3(uint32_t *dst, const unsigned char *srcl, const unsigned char *srcr, size_t frames,
+	unsigned bytes, unsigned shift, int lsbitfirst)
+{
+	const unsigned step = 16 / bytes;
+	__m128i mask[4];
+	unsigned g;
+
+	for (g=0; g<step/4; ++g) {
+		unsigned char m[16];
+		pack_mask(m, g*4, 4, bytes, shift);
+		mask[g] = _mm_loadu_si128((__m128i *)m);
+	}
+
+	while (frames >= step) {
+		__m128i l = _mm_loadu_si128((__m128i *)srcl);
+		__m128i r = srcr ? _mm_loadu_si128((__m128i *)srcr) : l;
+		if (lsbitfirst) {
+			l = reverse_ssse3(l);
+			r = srcr ? reverse_ssse3(r) : l;
+		}
+		for (g=0; g<step/4; ++g) {
+			__m128i lg = _mm_shuffle_epi8(l, mask[g]);
+			__m128i rg = _mm_shuffle_epi8(r, mask[g]);
+			_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi32(lg, rg));
+			_mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi32(lg, rg));
+			dst += 8;
+		}
+		srcl += 16;
+		if (srcr) srcr += 16;
+		frames -= step;
+	}
+
+	dsd2pcm_pack_c(dst, srcl, srcr, frames, bytes, shift, lsbitfirst);
+}
+
+static void invert_sse2(uint32_t *ptr, size_t frames)
+{
+	const __m128i ones = _mm_set1_epi32(-1);
+	while (frames >= 2) {
+		_mm_storeu_si128((__m128i *)ptr, _mm_xor_si128(_mm_loadu_si128((__m128i *)ptr), ones));
+		ptr += 4;
+		frames -= 2;
+	}
+	dsd2pcm_invert_c(ptr, frames);
+}
+
+__attribute__((target("avx2")))
+static void invert_avx2(uint32_t *ptr, size_t frames)
+{
+	const __m256i ones = _mm256_set1_epi32(-1);
+	while (frames >= 4) {
+		_mm256_storeu_si256((__m256i *)ptr, _mm256_xor_si256(_mm256_loadu_si256((__m256i *)ptr), ones));
+		ptr += 8;
+		frames -= 4;
+	}
+	invert_sse2(ptr, frames);
+}
+#endif
+
+#if DSD2PCM_NEON
+/* as ssse3 using tbl for the shuffles and rbit for the bit reversal */
+static void pack_neon(uint32_t *dst, const unsigned char *srcl, const unsigned char *srcr, size_t frames,
+	unsigned bytes, unsigned shift, int lsbitfirst)
+{
+	const unsigned step = 16 / bytes;
+	uint8x16_t mask[4];
+	unsigned g;
+
+	for (g=0; g<step/4; ++g) {
+		unsigned char m[16];
+		pack_mask(m, g*4, 4, bytes, shift);
+		mask[g] = vld1q_u8(m);
+	}
+
+	while (frames >= step) {
+		uint8x16_t l = vld1q_u8(srcl);
+		uint8x16_t r = srcr ? vld1q_u8(srcr) : l;
+		if (lsbitfirst) {
+			l = vrbitq_u8(l);
+			r = srcr ? vrbitq_u8(r) : l;
+		}
+		for (g=0; g<step/4; ++g) {
+			uint32x4x2_t z = vzipq_u32(vreinterpretq_u32_u8(vqtbl1q_u8(l, mask[g])),
+									   vreinterpretq_u32_u8(vqtbl1q_u8(r, mask[g])));
+			vst1q_u32(dst, z.val[0]);
+			vst1q_u32(dst + 4, z.val[1]);
+			dst += 8;
+		}
+		srcl += 16;
+		if (srcr) srcr += 16;
+		frames -= step;
+	}
+
+	dsd2pcm_pack_c(dst, srcl, srcr, frames, bytes, shift, lsbitfirst);
+}
+
+static void invert_neon(uint32_t *ptr, size_t frames)
+{
+	while (frames >= 2) {
+		vst1q_u32(ptr, vmvnq_u32(vld1q_u32(ptr)));
+		ptr += 4;
+		frames -= 2;
+	}
+	dsd2pcm_invert_c(ptr, frames);
+}
+#endif
+
+extern void dsd2pcm_pack(uint32_t *dst, const unsigned char *srcl, const unsigned char *srcr, size_t frames,
+	unsigned bytes, unsigned shift, int lsbitfirst)
+{
+	pack(dst, srcl, srcr, frames, bytes, shift, lsbitfirst);
+}
+
+extern void dsd2pcm_invert(uint32_t *ptr, size_t frames)
+{
+	invert(ptr, frames);
+}
+
+const char *dsd2pcm_pack_name(void)
+{
+#if DSD2PCM_SSE2
+	if (pack == pack_ssse3) return invert == invert_avx2 ? "ssse3/avx2" : "ssse3/sse2";
+	if (invert == invert_avx2) return "c/avx2";
+	if (invert == invert_sse2) return "c/sse2";
+#endif
+#if DSD2PCM_NEON
+	if (pack == pack_neon) return "neon";
+#endif
+	return "c";
+}
@@ -36,6 +36,7 @@ Marked additions (c) Adrian Smith, 2013 under same licence terms
 #define DSD2PCM_H_INCLUDED
 
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 #ifdef __cplusplus
@@ -96,10 +97,65 @@ extern void dsd2pcm_translate(dsd2pcm_ctx *ctx,
 extern unsigned char dsd2pcm_bitreverse[];
 
 extern void dsd2pcm_precalc(void);
+
 /**
  * End of addition
  */
 
+/**
+ * as dsd2pcm_translate but writes clipped s32 samples scaled by 0x7fffffff
+ * and applies the decimation set by dsd2pcm_set_decimation
+ * returns the number of output samples written, samples / ratio on average
+ * with a ratio of 1 the output is identical to dsd2pcm_translate followed by scaling
+ */
+extern size_t dsd2pcm_translate_s32(dsd2pcm_ctx *ctx,
+	size_t samples,
+	const unsigned char *src, ptrdiff_t src_stride,
+	int lsbitfirst,
+	int32_t *dst, ptrdiff_t dst_stride);
+
+#define DSD2PCM_LOW_CPU        0
+#define DSD2PCM_BALANCED       1
+#define DSD2PCM_HIGH_PRECISION 2
+
+/**
+ * set additional decimation applied by dsd2pcm_translate_s32 using cascaded
+ * halfband filters, ratio = 1, 2, 4, 8 or 16, returns 0 on success
+ * quality selects the stopband attenuation of the stages, 90, 110 or 130dB up
+ * to 90% of the output nyquist (DSD2PCM_LOW_CPU..)
+ * dsd2pcm_translate is not affected
+ */
+extern int dsd2pcm_set_decimation(dsd2pcm_ctx *ctx, unsigned ratio, int quality);
+
+/**
+ * name of the filter kernel selected for this cpu
+ */
+extern const char *dsd2pcm_kernel_name(void);
+
+/**
+ * dsf native and dop packing: takes bytes (1, 2 or 4) consecutive octets per channel
+ * per frame, msb first in the output sample, shifted right by shift (0 for native, 8 for dop)
+ * and bit reversed if lsbitfirst, writing interleaved l/r samples
+ * srcr is NULL for mono in which case the left channel is duplicated
+ * dsd2pcm_pack uses the kernel for this cpu selected by dsd2pcm_precalc, the _c version
+ * is the scalar reference
+ */
+extern void dsd2pcm_pack(uint32_t *dst, const unsigned char *srcl, const unsigned char *srcr, size_t frames,
+	unsigned bytes, unsigned shift, int lsbitfirst);
+extern void dsd2pcm_pack_c(uint32_t *dst, const unsigned char *srcl, const unsigned char *srcr, size_t frames,
+	unsigned bytes, unsigned shift, int lsbitfirst);
+
+/**
+ * invert polarity of frames of interleaved l/r samples
+ */
+extern void dsd2pcm_invert(uint32_t *ptr, size_t frames);
+extern void dsd2pcm_invert_c(uint32_t *ptr, size_t frames);
+
+/**
+ * name of the packing and inversion kernels selected for this cpu
+ */
+extern const char *dsd2pcm_pack_name(void);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
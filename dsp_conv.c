@@ -0,0 +1,726 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// fir convolution processing stage - eg for room correction filters
+//
+// partitioned overlap-save convolution in the frequency domain. The filter is split into a head section
+// with short blocks, which sets the latency, and a tail section with long blocks starting at 2 tail blocks
+// into the filter so it can be computed on a worker thread while the following head blocks are processed.
+// Left and right are transformed together as the real and imaginary parts of one complex signal.
+
+#include "squeezelite.h"
+
+#if DSP
+
+#include <math.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CONV_SSE 1
+#include <emmintrin.h>
+#elif defined(__GNUC__) && defined(__ARM_NEON)
+#define CONV_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define MAX_FILTERS 8
+#define MAX_TAPS (1 << 20)
+#define DEFAULT_BLOCK 256
+#define DEFAULT_TAIL 16
+#define CONV_THREAD_STACK_SIZE 64 * 1024
+
+extern log_level loglevel;
+
+struct fft {
+	unsigned n;
+	unsigned *rev;
+	float *cos, *sin;
+};
+
+// one uniformly partitioned section of the filter, spectra are stored split into re and im
+struct section {
+	unsigned block;         // input block, fft size is 2 * block
+	unsigned parts;
+	bool stereo;            // left and right filters differ
+	struct fft fft;
+	float *win_re, *win_im; // time domain window of last 2 blocks
+	float *h;               // per partition: A re, A im, B re, B im where A = (Hl + Hr) / 2, B = (Hl - Hr) / 2
+	float *fdl;             // per partition: X re, X im, Y re, Y im where Y[k] = conj(X[n - k])
+	unsigned head;          // newest partition in fdl
+	float *acc_re, *acc_im;
+};
+
+struct engine {
+	unsigned rate;
+	unsigned block;         // head block and latency in frames
+	unsigned factor;        // tail block = factor * block, 0 if no tail
+	struct section head, tail;
+	float *inq, *outq;      // head input and output queues, interleaved
+	unsigned pos;
+	unsigned long blocks;   // head blocks processed
+	float *tail_in[2], *tail_out[2]; // double buffered, interleaved
+	bool threaded;
+	unsigned long submitted, done;
+#if LINUX || OSX || FREEBSD
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool running;
+#endif
+};
+
+struct conv {
+	struct {
+		unsigned rate;      // 0 = any rate
+		char *file;
+	} filter[MAX_FILTERS];
+	unsigned filters;
+	unsigned block;
+	unsigned factor;
+	bool threads;
+	struct engine *engine;
+};
+
+static bool fft_init(struct fft *f, unsigned n) {
+	unsigned i, bits = 0;
+
+	while ((1u << bits) < n) bits++;
+
+	f->n = n;
+	f->rev = malloc(n * sizeof(unsigned));
+	f->cos = malloc(n / 2 * sizeof(float));
+	f->sin = malloc(n / 2 * sizeof(float));
+	if (!f->rev || !f->cos || !f->sin) return false;
+
+	for (i = 0; i < n; i++) {
+		unsigned r = 0, b;
+		for (b = 0; b < bits; b++) {
+			if (i & (1u << b)) r |= 1u << (bits - 1 - b);
+		}
+		f->rev[i] = r;
+	}
+	for (i = 0; i < n / 2; i++) {
+		f->cos[i] = (float)cos(2 * M_PI * i / n);
+		f->sin[i] = (float)sin(2 * M_PI * i / n);
+	}
+	return true;
+}
+
+static void fft_free(struct fft *f) {
+	free(f->rev);
+	free(f->cos);
+	free(f->sin);
+}
+
+// in place radix 2 complex fft, inverse is unscaled
+static void fft_run(struct fft *f, float *re, float *im, bool inverse) {
+	unsigned n = f->n, i, k, len;
+
+	for (i = 0; i < n; i++) {
+		unsigned r = f->rev[i];
+		if (r > i) {
+			float t = re[i]; re[i] = re[r]; re[r] = t;
+			t = im[i]; im[i] = im[r]; im[r] = t;
+		}
+	}
+
+	for (len = 2; len <= n; len <<= 1) {
+		unsigned half = len / 2, step = n / len;
+		for (k = 0; k < half; k++) {
+			float wr = f->cos[k * step];
+			float wi = inverse ? f->sin[k * step] : -f->sin[k * step];
+			for (i = k; i < n; i += len) {
+				unsigned b = i + half;
+				float tr = re[b] * wr - im[b] * wi;
+				float ti = re[b] * wi + im[b] * wr;
+				re[b] = re[i] - tr; im[b] = im[i] - ti;
+				re[i] += tr; im[i] += ti;
+			}
+		}
+	}
+}
+
+// acc += X * A + Y * B over n bins, B omitted if filters are the same for both channels
+static void cmac(float *acc_re, float *acc_im, const float *x, const float *h, unsigned n, bool stereo) {
+	const float *xr = x, *xi = x + n, *yr = x + 2 * n, *yi = x + 3 * n;
+	const float *ar = h, *ai = h + n, *br = h + 2 * n, *bi = h + 3 * n;
+	unsigned k = 0;
+
+#if CONV_SSE
+	for (; k + 4 <= n; k += 4) {
+		__m128 Xr = _mm_loadu_ps(xr + k), Xi = _mm_loadu_ps(xi + k), Ar = _mm_loadu_ps(ar + k), Ai = _mm_loadu_ps(ai + k);
+		__m128 re = _mm_sub_ps(_mm_mul_ps(Xr, Ar), _mm_mul_ps(Xi, Ai));
+		__m128 im = _mm_add_ps(_mm_mul_ps(Xr, Ai), _mm_mul_ps(Xi, Ar));
+		if (stereo) {
+			__m128 Yr = _mm_loadu_ps(yr + k), Yi = _mm_loadu_ps(yi + k), Br = _mm_loadu_ps(br + k), Bi = _mm_loadu_ps(bi + k);
+			re = _mm_add_ps(re, _mm_sub_ps(_mm_mul_ps(Yr, Br), _mm_mul_ps(Yi, Bi)));
+			im = _mm_add_ps(im, _mm_add_ps(_mm_mul_ps(Yr, Bi), _mm_mul_ps(Yi, Br)));
+		}
+		_mm_storeu_ps(acc_re + k, _mm_add_ps(_mm_loadu_ps(acc_re + k), re));
+		_mm_storeu_ps(acc_im + k, _mm_add_ps(_mm_loadu_ps(acc_im + k), im));
+	}
+#endif
+#if CONV_NEON
+	for (; k + 4 <= n; k += 4) {
+		float32x4_t Xr = vld1q_f32(xr + k), Xi = vld1q_f32(xi + k), Ar = vld1q_f32(ar + k), Ai = vld1q_f32(ai + k);
+		float32x4_t re = vmlsq_f32(vmlaq_f32(vld1q_f32(acc_re + k), Xr, Ar), Xi, Ai);
+		float32x4_t im = vmlaq_f32(vmlaq_f32(vld1q_f32(acc_im + k), Xr, Ai), Xi, Ar);
+		if (stereo) {
+			float32x4_t Yr = vld1q_f32(yr + k), Yi = vld1q_f32(yi + k), Br = vld1q_f32(br + k), Bi = vld1q_f32(bi + k);
+			re = vmlsq_f32(vmlaq_f32(re, Yr, Br), Yi, Bi);
+			im = vmlaq_f32(vmlaq_f32(im, Yr, Bi), Yi, Br);
+		}
+		vst1q_f32(acc_re + k, re);
+		vst1q_f32(acc_im + k, im);
+	}
+#endif
+	for (; k < n; k++) {
+		acc_re[k] += xr[k] * ar[k] - xi[k] * ai[k];
+		acc_im[k] += xr[k] * ai[k] + xi[k] * ar[k];
+		if (stereo) {
+			acc_re[k] += yr[k] * br[k] - yi[k] * bi[k];
+			acc_im[k] += yr[k] * bi[k] + yi[k] * br[k];
+		}
+	}
+}
+
+// set up section for taps [offset, offset + len) of the left and right filters
+static bool section_init(struct section *s, unsigned block, const float *l, const float *r, unsigned offset, unsigned len) {
+	unsigned n = 2 * block, p, k;
+
+	memset(s, 0, sizeof(struct section));
+	s->block = block;
+	s->parts = (len + block - 1) / block;
+	s->stereo = l != r;
+
+	if (!fft_init(&s->fft, n)) return false;
+
+	s->win_re = calloc(n, sizeof(float));
+	s->win_im = calloc(n, sizeof(float));
+	s->acc_re = malloc(n * sizeof(float));
+	s->acc_im = malloc(n * sizeof(float));
+	s->h = calloc((size_t)s->parts * 4 * n, sizeof(float));
+	s->fdl = calloc((size_t)s->parts * 4 * n, sizeof(float));
+	if (!s->win_re || !s->win_im || !s->acc_re || !s->acc_im || !s->h || !s->fdl) return false;
+
+	for (p = 0; p < s->parts; p++) {
+		float *h = s->h + (size_t)p * 4 * n;
+		unsigned taps = len - p * block < block ? len - p * block : block;
+
+		// transform left and right together then separate, scaled for the unscaled inverse
+		memset(s->acc_re, 0, n * sizeof(float));
+		memset(s->acc_im, 0, n * sizeof(float));
+		for (k = 0; k < taps; k++) {
+			s->acc_re[k] = l[offset + p * block + k];
+			s->acc_im[k] = r[offset + p * block + k];
+		}
+		fft_run(&s->fft, s->acc_re, s->acc_im, false);
+
+		for (k = 0; k < n; k++) {
+			unsigned m = (n - k) % n;
+			// Hl = (Z[k] + conj(Z[n-k])) / 2, Hr = (Z[k] - conj(Z[n-k])) / 2i
+			float hlr = (s->acc_re[k] + s->acc_re[m]) / 2, hli = (s->acc_im[k] - s->acc_im[m]) / 2;
+			float hrr = (s->acc_im[k] + s->acc_im[m]) / 2, hri = (s->acc_re[m] - s->acc_re[k]) / 2;
+			h[k]         = (hlr + hrr) / 2 / n;
+			h[n + k]     = (hli + hri) / 2 / n;
+			h[2 * n + k] = (hlr - hrr) / 2 / n;
+			h[3 * n + k] = (hli - hri) / 2 / n;
+		}
+	}
+
+	return true;
+}
+
+static void section_free(struct section *s) {
+	fft_free(&s->fft);
+	free(s->win_re); free(s->win_im);
+	free(s->acc_re); free(s->acc_im);
+	free(s->h); free(s->fdl);
+}
+
+static void section_reset(struct section *s) {
+	unsigned n = 2 * s->block;
+	memset(s->win_re, 0, n * sizeof(float));
+	memset(s->win_im, 0, n * sizeof(float));
+	memset(s->fdl, 0, (size_t)s->parts * 4 * n * sizeof(float));
+	s->head = 0;
+}
+
+// convolve one block of interleaved input, writing or adding a block of interleaved output
+static void section_block(struct section *s, const float *in, float *out, bool add) {
+	unsigned b = s->block, n = 2 * b, k, p;
+	float *x;
+
+	memmove(s->win_re, s->win_re + b, b * sizeof(float));
+	memmove(s->win_im, s->win_im + b, b * sizeof(float));
+	for (k = 0; k < b; k++) {
+		s->win_re[b + k] = in[2 * k];
+		s->win_im[b + k] = in[2 * k + 1];
+	}
+
+	s->head = (s->head + s->parts - 1) % s->parts;
+	x = s->fdl + (size_t)s->head * 4 * n;
+	memcpy(x, s->win_re, n * sizeof(float));
+	memcpy(x + n, s->win_im, n * sizeof(float));
+	fft_run(&s->fft, x, x + n, false);
+	for (k = 0; k < n; k++) {
+		unsigned m = (n - k) % n;
+		x[2 * n + k] = x[m];
+		x[3 * n + k] = -x[n + m];
+	}
+
+	memset(s->acc_re, 0, n * sizeof(float));
+	memset(s->acc_im, 0, n * sizeof(float));
+	for (p = 0; p < s->parts; p++) {
+		cmac(s->acc_re, s->acc_im, s->fdl + (size_t)((s->head + p) % s->parts) * 4 * n, s->h + (size_t)p * 4 * n, n, s->stereo);
+	}
+	fft_run(&s->fft, s->acc_re, s->acc_im, true);
+
+	for (k = 0; k < b; k++) {
+		if (add) {
+			out[2 * k] += s->acc_re[b + k];
+			out[2 * k + 1] += s->acc_im[b + k];
+		} else {
+			out[2 * k] = s->acc_re[b + k];
+			out[2 * k + 1] = s->acc_im[b + k];
+		}
+	}
+}
+
+#if LINUX || OSX || FREEBSD
+static void *conv_thread(void *arg) {
+	struct engine *e = arg;
+
+	pthread_mutex_lock(&e->mutex);
+	while (e->running) {
+		if (e->submitted > e->done) {
+			unsigned long m = e->done;
+			pthread_mutex_unlock(&e->mutex);
+			section_block(&e->tail, e->tail_in[m % 2], e->tail_out[m % 2], false);
+			pthread_mutex_lock(&e->mutex);
+			e->done++;
+			pthread_cond_broadcast(&e->cond);
+		} else {
+			pthread_cond_wait(&e->cond, &e->mutex);
+		}
+	}
+	pthread_mutex_unlock(&e->mutex);
+
+	return NULL;
+}
+#endif
+
+static void tail_submit(struct engine *e) {
+#if LINUX || OSX || FREEBSD
+	if (e->threaded) {
+		pthread_mutex_lock(&e->mutex);
+		e->submitted++;
+		pthread_cond_broadcast(&e->cond);
+		pthread_mutex_unlock(&e->mutex);
+		return;
+	}
+#endif
+	section_block(&e->tail, e->tail_in[e->submitted % 2], e->tail_out[e->submitted % 2], false);
+	e->submitted++;
+	e->done++;
+}
+
+static void tail_wait(struct engine *e, unsigned long count) {
+#if LINUX || OSX || FREEBSD
+	if (e->threaded) {
+		pthread_mutex_lock(&e->mutex);
+		while (e->done < count) {
+			pthread_cond_wait(&e->cond, &e->mutex);
+		}
+		pthread_mutex_unlock(&e->mutex);
+	}
+#endif
+}
+
+// process one head block from inq into outq, adding the tail contribution and feeding the tail section
+static void engine_block(struct engine *e) {
+	section_block(&e->head, e->inq, e->outq, false);
+
+	if (e->factor) {
+		unsigned long j = e->blocks, m = j / e->factor;
+		unsigned offset = (j % e->factor) * e->block * 2;
+		unsigned k;
+
+		// tail block m - 2 covers this output block, its computation was started factor blocks ago
+		if (m >= 2) {
+			float *t = e->tail_out[(m - 2) % 2] + offset;
+			if (j % e->factor == 0) tail_wait(e, m - 1);
+			for (k = 0; k < e->block * 2; k++) {
+				e->outq[k] += t[k];
+			}
+		}
+
+		memcpy(e->tail_in[m % 2] + offset, e->inq, e->block * 2 * sizeof(float));
+		if (j % e->factor == e->factor - 1) {
+			tail_submit(e);
+		}
+	}
+
+	e->blocks++;
+}
+
+static void engine_reset(struct engine *e) {
+	tail_wait(e, e->submitted);
+	section_reset(&e->head);
+	memset(e->inq, 0, e->block * 2 * sizeof(float));
+	memset(e->outq, 0, e->block * 2 * sizeof(float));
+	e->pos = 0;
+	e->blocks = 0;
+	if (e->factor) {
+		section_reset(&e->tail);
+		e->submitted = e->done = 0;
+	}
+}
+
+static void engine_destroy(struct engine *e) {
+#if LINUX || OSX || FREEBSD
+	if (e->threaded) {
+		pthread_mutex_lock(&e->mutex);
+		e->running = false;
+		pthread_cond_broadcast(&e->cond);
+		pthread_mutex_unlock(&e->mutex);
+		pthread_join(e->thread, NULL);
+		pthread_mutex_destroy(&e->mutex);
+		pthread_cond_destroy(&e->cond);
+	}
+#endif
+	section_free(&e->head);
+	if (e->factor) {
+		section_free(&e->tail);
+		free(e->tail_in[0]); free(e->tail_in[1]);
+		free(e->tail_out[0]); free(e->tail_out[1]);
+	}
+	free(e->inq);
+	free(e->outq);
+	free(e);
+}
+
+static u32_t read32le(const u8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (u32_t)p[3] << 24;
+}
+
+// load wav (16/24/32 bit integer or 32 bit float, first two channels used) or raw 32 bit float mono
+// returns taps, *r == *l for a single channel filter
+static unsigned load_filter(const char *file, float **l, float **r, unsigned *rate) {
+	FILE *fp = fopen(file, "rb");
+	u8_t hdr[12], chunk[8], fmt[40];
+	unsigned channels = 1, bits = 32, format = 3, taps = 0, i, c;
+	long data = 0;
+	u32_t data_len = 0;
+	u8_t *buf = NULL;
+
+	*l = *r = NULL;
+	*rate = 0;
+
+	if (!fp) {
+		LOG_WARN("unable to open filter: %s", file);
+		return 0;
+	}
+
+	if (fread(hdr, 1, 12, fp) == 12 && !memcmp(hdr, "RIFF", 4) && !memcmp(hdr + 8, "WAVE", 4)) {
+		while (fread(chunk, 1, 8, fp) == 8) {
+			u32_t len = read32le(chunk + 4);
+			if (!memcmp(chunk, "fmt ", 4) && len >= 16) {
+				unsigned n = len < sizeof(fmt) ? len : sizeof(fmt);
+				if (fread(fmt, 1, n, fp) != n) break;
+				format = fmt[0] | fmt[1] << 8;
+				channels = fmt[2] | fmt[3] << 8;
+				*rate = read32le(fmt + 4);
+				bits = fmt[14] | fmt[15] << 8;
+				// extensible - format is the start of the sub format guid
+				if (format == 0xFFFE && n >= 26) format = fmt[24] | fmt[25] << 8;
+				fseek(fp, len - n + (len & 1), SEEK_CUR);
+			} else if (!memcmp(chunk, "data", 4)) {
+				data = ftell(fp);
+				data_len = len;
+				break;
+			} else {
+				fseek(fp, len + (len & 1), SEEK_CUR);
+			}
+		}
+		if (!data || !channels || (format == 1 && bits != 16 && bits != 24 && bits != 32) || (format == 3 && bits != 32) ||
+			(format != 1 && format != 3)) {
+			LOG_WARN("unsupported wav filter format: %s", file);
+			fclose(fp);
+			return 0;
+		}
+	} else {
+		fseek(fp, 0, SEEK_END);
+		data_len = ftell(fp);
+	}
+
+	fseek(fp, data, SEEK_SET);
+	taps = data_len / (bits / 8) / channels;
+	if (taps > MAX_TAPS) {
+		LOG_WARN("filter too long, truncating to %u taps: %s", MAX_TAPS, file);
+		taps = MAX_TAPS;
+	}
+
+	buf = malloc((size_t)taps * channels * (bits / 8));
+	*l = malloc(taps * sizeof(float));
+	*r = channels > 1 ? malloc(taps * sizeof(float)) : *l;
+	if (!buf || !*l || !*r || fread(buf, (bits / 8) * channels, taps, fp) != taps) {
+		LOG_WARN("unable to read filter: %s", file);
+		if (*r != *l) free(*r);
+		free(*l);
+		free(buf);
+		fclose(fp);
+		*l = *r = NULL;
+		return 0;
+	}
+	fclose(fp);
+
+	for (i = 0; i < taps; i++) {
+		for (c = 0; c < (channels > 1 ? 2 : 1); c++) {
+			u8_t *p = buf + ((size_t)i * channels + c) * (bits / 8);
+			float v;
+			if (format == 3) {
+				u32_t u = read32le(p);
+				memcpy(&v, &u, sizeof(v));
+			} else if (bits == 16) {
+				v = (s16_t)(p[0] | p[1] << 8) / 32768.0f;
+			} else if (bits == 24) {
+				v = (s32_t)((u32_t)p[0] << 8 | (u32_t)p[1] << 16 | (u32_t)p[2] << 24) / 2147483648.0f;
+			} else {
+				v = (s32_t)read32le(p) / 2147483648.0f;
+			}
+			(c == 0 ? *l : *r)[i] = v;
+		}
+	}
+	free(buf);
+
+	return taps;
+}
+
+static struct engine *engine_create(struct conv *c, const char *file, unsigned rate) {
+	struct engine *e;
+	float *l, *r;
+	unsigned file_rate, taps, head_len;
+	u32_t start = gettime_ms();
+
+	taps = load_filter(file, &l, &r, &file_rate);
+	if (!taps) return NULL;
+
+	if (file_rate && file_rate != rate) {
+		LOG_WARN("filter %s is for %u, used at %u", file, file_rate, rate);
+	}
+
+	e = calloc(1, sizeof(struct engine));
+	if (!e) {
+		LOG_ERROR("malloc fail creating convolution");
+		exit(1);
+	}
+
+	e->rate = rate;
+	e->block = c->block;
+	// tail section starts 2 tail blocks into the filter, only used if the filter extends beyond that
+	e->factor = c->factor && taps > 2 * c->factor * c->block ? c->factor : 0;
+	head_len = e->factor ? 2 * e->factor * e->block : taps;
+
+	e->inq = calloc(e->block * 2, sizeof(float));
+	e->outq = calloc(e->block * 2, sizeof(float));
+	if (!e->inq || !e->outq || !section_init(&e->head, e->block, l, r, 0, head_len)) {
+		LOG_ERROR("malloc fail creating convolution");
+		exit(1);
+	}
+
+	if (e->factor) {
+		unsigned tb = e->factor * e->block, i;
+		if (!section_init(&e->tail, tb, l, r, head_len, taps - head_len)) {
+			LOG_ERROR("malloc fail creating convolution");
+			exit(1);
+		}
+		for (i = 0; i < 2; i++) {
+			e->tail_in[i] = calloc(tb * 2, sizeof(float));
+			e->tail_out[i] = calloc(tb * 2, sizeof(float));
+			if (!e->tail_in[i] || !e->tail_out[i]) {
+				LOG_ERROR("malloc fail creating convolution");
+				exit(1);
+			}
+		}
+#if LINUX || OSX || FREEBSD
+		if (c->threads) {
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + CONV_THREAD_STACK_SIZE);
+			pthread_mutex_init(&e->mutex, NULL);
+			pthread_cond_init(&e->cond, NULL);
+			e->running = true;
+			e->threaded = pthread_create(&e->thread, &attr, conv_thread, e) == 0;
+			pthread_attr_destroy(&attr);
+			if (!e->threaded) {
+				pthread_mutex_destroy(&e->mutex);
+				pthread_cond_destroy(&e->cond);
+			}
+		}
+#endif
+	}
+
+	if (r != l) free(r);
+	free(l);
+
+	LOG_INFO("convolution %s at %u: %u taps, %s, head %u x %u, tail %u x %u%s, latency %u frames, setup %u ms", file, rate,
+			 taps, e->head.stereo ? "stereo" : "mono", e->head.parts, e->block, e->factor ? e->tail.parts : 0,
+			 e->factor * e->block, e->threaded ? " threaded" : "", e->block, gettime_ms() - start);
+
+	return e;
+}
+
+static bool conv_newstream(struct process_stage *stage, struct processstate *process, unsigned supported_rates[]) {
+	struct conv *c = stage->priv;
+	unsigned rate = process->in_sample_rate, i;
+	const char *file = NULL;
+
+	// state is kept across streams at the same rate for gapless playback
+	if (c->engine && c->engine->rate == rate) {
+		return true;
+	}
+
+	if (c->engine) {
+		engine_destroy(c->engine);
+		c->engine = NULL;
+	}
+
+	for (i = 0; i < c->filters && !file; i++) {
+		if (c->filter[i].rate == rate) file = c->filter[i].file;
+	}
+	for (i = 0; i < c->filters && !file; i++) {
+		if (c->filter[i].rate == 0) file = c->filter[i].file;
+	}
+
+	if (!file) {
+		LOG_WARN("no convolution filter for %u", rate);
+		return false;
+	}
+
+	c->engine = engine_create(c, file, rate);
+
+	return c->engine != NULL;
+}
+
+// in place with a latency of one head block
+static void conv_samples(struct process_stage *stage, struct processstate *process) {
+	struct engine *e = ((struct conv *)stage->priv)->engine;
+	s32_t *ptr = (s32_t *)process->inbuf;
+	frames_t frames = process->in_frames;
+
+	while (frames) {
+		frames_t n = min(frames, e->block - e->pos);
+		float *iq = e->inq + e->pos * 2, *oq = e->outq + e->pos * 2;
+		unsigned i;
+
+		for (i = 0; i < n * 2; i++) {
+			double v = oq[i] * 2147483648.0;
+			iq[i] = ptr[i] / 2147483648.0f;
+			ptr[i] = v >= 2147483647.0 ? 0x7fffffff : v <= -2147483648.0 ? -0x7fffffff - 1 : (s32_t)lrint(v);
+		}
+
+		ptr += n * 2;
+		frames -= n;
+		e->pos += n;
+
+		if (e->pos == e->block) {
+			engine_block(e);
+			e->pos = 0;
+		}
+	}
+}
+
+static void conv_flush(struct process_stage *stage) {
+	struct conv *c = stage->priv;
+	if (c->engine) {
+		engine_reset(c->engine);
+	}
+}
+
+static bool pow2(unsigned v) {
+	return v && !(v & (v - 1));
+}
+
+// opt = <item>[,<item>...], item = [<rate>:]<file> | block:<frames> | tail:<factor> | threads:<0|1>
+struct process_stage *register_conv(const char *name, char *opt) {
+	struct process_stage *stage = malloc(sizeof(struct process_stage));
+	struct conv *c = malloc(sizeof(struct conv));
+	char *item = opt;
+
+	if (!stage || !c) {
+		LOG_ERROR("malloc fail creating convolution stage");
+		exit(1);
+	}
+
+	memset(stage, 0, sizeof(struct process_stage));
+	memset(c, 0, sizeof(struct conv));
+
+	c->block = DEFAULT_BLOCK;
+	c->factor = DEFAULT_TAIL;
+	c->threads = true;
+
+	while (item && *item) {
+		char *next = strchr(item, ',');
+		char *colon = strchr(item, ':');
+
+		if (next) *next++ = '\0';
+
+		if (!strncmp(item, "block:", 6)) {
+			unsigned v = atoi(item + 6);
+			if (pow2(v) && v >= 32 && v <= 16384) c->block = v;
+			else LOG_WARN("invalid convolution block, must be power of 2 from 32 to 16384: %s", item);
+		} else if (!strncmp(item, "tail:", 5)) {
+			unsigned v = atoi(item + 5);
+			if (v == 0 || (pow2(v) && v <= 256)) c->factor = v == 1 ? 0 : v;
+			else LOG_WARN("invalid convolution tail factor, must be 0 or power of 2 up to 256: %s", item);
+		} else if (!strncmp(item, "threads:", 8)) {
+			c->threads = atoi(item + 8) != 0;
+		} else if (c->filters == MAX_FILTERS) {
+			LOG_WARN("too many convolution filters, ignoring: %s", item);
+		} else if (colon && item[0] >= '0' && item[0] <= '9') {
+			c->filter[c->filters].rate = atoi(item);
+			c->filter[c->filters++].file = colon + 1;
+		} else {
+			c->filter[c->filters].rate = 0;
+			c->filter[c->filters++].file = item;
+		}
+
+		item = next;
+	}
+
+	LOG_INFO("convolution filters: %u block: %u tail factor: %u threads: %u", c->filters, c->block, c->factor, c->threads);
+
+	stage->name = "conv";
+	stage->in_place = true;
+	stage->newstream = conv_newstream;
+	stage->samples = conv_samples;
+	stage->drain = NULL;
+	stage->flush = conv_flush;
+	stage->priv = c;
+
+	return stage;
+}
+
+#endif // #if DSP
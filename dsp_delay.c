@@ -0,0 +1,159 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// per channel delay and gain processing stage - eg for speaker distance and level matching
+
+#include "squeezelite.h"
+
+#if DSP
+
+#include <math.h>
+
+#define MAX_DELAY_MS 1000
+
+extern log_level loglevel;
+
+struct delay {
+	double delay_ms[2];
+	double gain_db[2];
+	double gain[2];
+	unsigned rate;          // rate delay lines are sized for
+	unsigned frames[2];     // delay in frames at rate
+	s32_t *line[2];
+	unsigned pos[2];
+};
+
+static void delay_reset(struct delay *d) {
+	int c;
+	for (c = 0; c < 2; c++) {
+		if (d->line[c]) memset(d->line[c], 0, d->frames[c] * sizeof(s32_t));
+		d->pos[c] = 0;
+	}
+}
+
+static bool delay_newstream(struct process_stage *stage, struct processstate *process, unsigned supported_rates[]) {
+	struct delay *d = stage->priv;
+	int c;
+
+	// delay lines are kept across streams at the same rate for gapless playback
+	if (d->rate != process->in_sample_rate) {
+		d->rate = process->in_sample_rate;
+		for (c = 0; c < 2; c++) {
+			d->frames[c] = (unsigned)(d->delay_ms[c] * d->rate / 1000 + 0.5);
+			if (d->line[c]) free(d->line[c]);
+			d->line[c] = NULL;
+			if (d->frames[c]) {
+				d->line[c] = malloc(d->frames[c] * sizeof(s32_t));
+				if (!d->line[c]) {
+					LOG_ERROR("malloc fail creating delay line");
+					exit(1);
+				}
+			}
+		}
+		delay_reset(d);
+		LOG_DEBUG("delay frames left: %u right: %u at %u", d->frames[0], d->frames[1], d->rate);
+	}
+
+	return d->frames[0] || d->frames[1] || d->gain[0] != 1.0 || d->gain[1] != 1.0;
+}
+
+static void delay_samples(struct process_stage *stage, struct processstate *process) {
+	struct delay *d = stage->priv;
+	int c;
+
+	for (c = 0; c < 2; c++) {
+		s32_t *ptr = (s32_t *)process->inbuf + c;
+		frames_t frames = process->in_frames;
+
+		if (d->frames[c]) {
+			s32_t *line = d->line[c];
+			unsigned pos = d->pos[c], size = d->frames[c];
+			while (frames--) {
+				s32_t in = *ptr;
+				*ptr = line[pos];
+				line[pos] = in;
+				if (++pos == size) pos = 0;
+				ptr += 2;
+			}
+			d->pos[c] = pos;
+		}
+
+		if (d->gain[c] != 1.0) {
+			double gain = d->gain[c];
+			ptr = (s32_t *)process->inbuf + c;
+			frames = process->in_frames;
+			while (frames--) {
+				double v = *ptr * gain;
+				*ptr = v >= 2147483647.0 ? 0x7fffffff : v <= -2147483648.0 ? -0x7fffffff - 1 : (s32_t)lrint(v);
+				ptr += 2;
+			}
+		}
+	}
+}
+
+static void delay_flush(struct process_stage *stage) {
+	delay_reset(stage->priv);
+}
+
+// delay = <left ms>:<right ms>[:<left dB>:<right dB>], gain = <left dB>:<right dB>
+struct process_stage *register_delay(const char *name, char *opt) {
+	struct process_stage *stage = malloc(sizeof(struct process_stage));
+	struct delay *d = malloc(sizeof(struct delay));
+	double v[4] = { 0, 0, 0, 0 };
+	int c;
+
+	if (!stage || !d) {
+		LOG_ERROR("malloc fail creating delay stage");
+		exit(1);
+	}
+
+	memset(stage, 0, sizeof(struct process_stage));
+	memset(d, 0, sizeof(struct delay));
+
+	if (opt) {
+		sscanf(opt, "%lf:%lf:%lf:%lf", &v[0], &v[1], &v[2], &v[3]);
+	}
+
+	if (!strcmp(name, "gain")) {
+		v[2] = v[0]; v[3] = v[1];
+		v[0] = v[1] = 0;
+	}
+
+	for (c = 0; c < 2; c++) {
+		d->delay_ms[c] = v[c] < 0 ? 0 : v[c] > MAX_DELAY_MS ? MAX_DELAY_MS : v[c];
+		d->gain_db[c] = v[c + 2];
+		d->gain[c] = pow(10, d->gain_db[c] / 20);
+	}
+
+	LOG_INFO("%s left: %.2fms %.1fdB right: %.2fms %.1fdB", name, d->delay_ms[0], d->gain_db[0], d->delay_ms[1], d->gain_db[1]);
+
+	stage->name = "delay";
+	stage->in_place = true;
+	stage->newstream = delay_newstream;
+	stage->samples = delay_samples;
+	stage->drain = NULL;
+	stage->flush = delay_flush;
+	stage->priv = d;
+
+	return stage;
+}
+
+#endif // #if DSP
@@ -0,0 +1,481 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// drift correcting resampler processing stage - for synchronised players
+//
+// The rate of the output device clock is measured against the player clock (jiffies) from the frames played
+// and device delay used for STAT, and the stage resamples by the measured error so that audio is played at
+// the rate of the player clock. Server sync then sees no drift between players with disciplined clocks and
+// skip / pause corrections are only needed for the initial offset. Elapsed time reported to the server is
+// converted back to source time.
+// The stage should be last in the chain so it runs at the device rate.
+
+#include "squeezelite.h"
+
+#if DSP
+
+#include <math.h>
+
+#define HALF_TAPS 32          // interpolation filter half length
+#define PHASES 256            // filter phases, coefs are interpolated between phases
+#define KAISER_BETA 9.0
+#define MIN_WINDOW 20.0       // secs of measurement before correction is applied
+#define MAX_STEP_MS 2500      // measurement steps longer than this are discarded - status updates are 1s apart
+#define MAX_STEP_ERROR 0.005  // steps with larger error relative to the nominal rate are discontinuities
+#define STATS_INTERVAL 60000
+#define CHECKPOINTS 256       // changes of correction kept to map output frames back to source frames
+#define TRACKS 8              // tracks in the outputbuf, decoded but not all played
+
+extern log_level loglevel;
+
+// measurement and correction for one family of rates, which may use a different device clock
+struct drift_family {
+	double sw, st, sy, stt, sty; // exponentially weighted regression of drift frames against time
+	double t, y;                 // time in secs and accumulated drift in frames over valid steps
+	double residual;             // weighted mean square residual in frames^2
+	double measured_ppm;
+	double applied_ppm;
+	unsigned discontinuities;
+};
+
+struct drift {
+	mutex_type mutex;
+	double max_ppm;
+	double tau;                  // regression time constant in secs
+	double slew;                 // max change of applied correction in ppm/sec
+	struct drift_family family[2];
+	// last measurement, slimproto thread
+	bool last_valid;
+	u32_t last_time;
+	u32_t last_played;
+	unsigned last_rate;
+	u32_t last_stats;
+	// resampler, decode thread
+	float table[PHASES + 1][2 * HALF_TAPS];
+	unsigned rate;
+	s32_t *hist;
+	unsigned hist_frames;
+	unsigned hist_size;
+	double pos;
+	bool draining;
+	u64_t frames_in;
+	u64_t frames_out;
+	// source position of output frames, checkpoints and tracks are written by decode and read by slimproto under mutex
+	double src;                  // source frames consumed for frames_out, the sum of the steps
+	struct {
+		u64_t out;
+		double src;
+		double step;
+	} checkpoint[CHECKPOINTS];
+	unsigned checkpoints;        // total recorded, newest at (checkpoints - 1) % CHECKPOINTS
+	struct {
+		u64_t out;
+		double src;
+	} track[TRACKS];
+	unsigned tracks;             // started by the stage
+	unsigned tracks_played;      // started by the output, current is (tracks_played - 1) % TRACKS
+};
+
+static struct drift *d;
+
+static unsigned family(unsigned rate) {
+	return rate % 11025 == 0 ? 0 : 1;
+}
+
+static double bessel_i0(double x) {
+	double sum = 1, term = 1;
+	int k;
+	for (k = 1; k < 50; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void design(void) {
+	int p, k;
+
+	for (p = 0; p <= PHASES; p++) {
+		double frac = (double)p / PHASES, sum = 0;
+		for (k = 0; k < 2 * HALF_TAPS; k++) {
+			double x = frac + HALF_TAPS - 1 - k;
+			double w = fabs(x) < HALF_TAPS ? bessel_i0(KAISER_BETA * sqrt(1 - (x / HALF_TAPS) * (x / HALF_TAPS))) /
+				bessel_i0(KAISER_BETA) : 0;
+			double s = fabs(x) < 1e-9 ? 1 : sin(M_PI * x) / (M_PI * x);
+			d->table[p][k] = (float)(w * s);
+			sum += w * s;
+		}
+		for (k = 0; k < 2 * HALF_TAPS; k++) {
+			d->table[p][k] = (float)(d->table[p][k] / sum);
+		}
+	}
+}
+
+static void fit(struct drift_family *f) {
+	double det = f->sw * f->stt - f->st * f->st;
+	if (det > 0) {
+		f->measured_ppm = (f->sw * f->sty - f->st * f->sy) / det * 1e6;
+	}
+}
+
+// called by slimproto each time status is updated
+// played = frames heard (frames_played_dmp - device_frames) at time updated, rate = current output rate
+void drift_measure(u32_t played, u32_t updated, unsigned rate, bool running) {
+	struct drift_family *f;
+	u32_t dt;
+	double expected, error, window, step, ppm;
+
+	if (!d || !rate) return;
+
+	if (!running || !d->last_valid || rate != d->last_rate) {
+		d->last_valid = running;
+		d->last_time = updated;
+		d->last_played = played;
+		d->last_rate = rate;
+		return;
+	}
+
+	dt = updated - d->last_time;
+	if (dt == 0) return;
+
+	mutex_lock(d->mutex);
+
+	f = &d->family[family(rate)];
+	expected = (double)dt * rate / 1000;
+	error = (double)(s32_t)(played - d->last_played) - expected;
+
+	d->last_time = updated;
+	d->last_played = played;
+
+	// track start, skip, pause or stall - drop this step but keep measurement across it
+	if (dt > MAX_STEP_MS || fabs(error) > expected * MAX_STEP_ERROR + rate / 100) {
+		f->discontinuities++;
+		LOG_DEBUG("drift discontinuity: %u ms error: %.0f frames", dt, error);
+		mutex_unlock(d->mutex);
+		return;
+	}
+
+	// drift in frames relative to nominal rate, as a fraction of the rate so the slope is in units of 1
+	f->t += dt / 1000.0;
+	f->y += error / rate;
+
+	{
+		double decay = exp(-(dt / 1000.0) / d->tau), r;
+		f->sw  = f->sw  * decay + 1;
+		f->st  = f->st  * decay + f->t;
+		f->sy  = f->sy  * decay + f->y;
+		f->stt = f->stt * decay + f->t * f->t;
+		f->sty = f->sty * decay + f->t * f->y;
+		fit(f);
+		// residual against the current fit through the weighted mean
+		r = (f->y - f->sy / f->sw) - f->measured_ppm * 1e-6 * (f->t - f->st / f->sw);
+		f->residual = f->residual * decay + (1 - decay) * r * r * rate * rate;
+	}
+
+	// control - move applied correction towards measurement at limited slew rate once enough is measured
+	window = f->t < d->tau ? f->t : d->tau;
+	if (window >= MIN_WINDOW) {
+		ppm = f->measured_ppm > d->max_ppm ? d->max_ppm : f->measured_ppm < -d->max_ppm ? -d->max_ppm : f->measured_ppm;
+		step = d->slew * dt / 1000.0;
+		if (ppm > f->applied_ppm + step) {
+			f->applied_ppm += step;
+		} else if (ppm < f->applied_ppm - step) {
+			f->applied_ppm -= step;
+		} else {
+			f->applied_ppm = ppm;
+		}
+	}
+
+	if (updated - d->last_stats > STATS_INTERVAL) {
+		d->last_stats = updated;
+		LOG_INFO("drift %u: measured: %.2f ppm applied: %.2f ppm window: %.0f s residual: %.1f frames discontinuities: %u "
+				 "frames in: " FMT_u64 " out: " FMT_u64, rate, f->measured_ppm, f->applied_ppm, window, sqrt(f->residual),
+				 f->discontinuities, d->frames_in, d->frames_out);
+	}
+
+	mutex_unlock(d->mutex);
+}
+
+// convert elapsed ms at the device rate to source ms for reporting to the server
+// the source frames consumed for the frames played are found from the steps used when those frames were resampled,
+// which may be an outputbuf earlier, so reported position does not move when the correction changes
+u32_t drift_elapsed(u32_t ms, unsigned rate) {
+	u64_t out;
+	double src;
+	unsigned i, n;
+
+	if (!d || !rate) return ms;
+
+	mutex_lock(d->mutex);
+
+	if (!d->tracks_played || !d->checkpoints) {
+		mutex_unlock(d->mutex);
+		return ms;
+	}
+
+	i = (d->tracks_played - 1) % TRACKS;
+	out = d->track[i].out + (u64_t)ms * rate / 1000;
+
+	// newest checkpoint at or before the frame, else the oldest kept
+	n = d->checkpoints > CHECKPOINTS ? CHECKPOINTS : d->checkpoints;
+	do {
+		i = (d->checkpoints - n--) % CHECKPOINTS;
+	} while (n && d->checkpoint[(i + 1) % CHECKPOINTS].out <= out);
+
+	src = d->checkpoint[i].src + ((double)out - (double)d->checkpoint[i].out) * d->checkpoint[i].step -
+		d->track[(d->tracks_played - 1) % TRACKS].src;
+
+	mutex_unlock(d->mutex);
+
+	return src > 0 ? (u32_t)(src * 1000 / rate + 0.5) : 0;
+}
+
+// called by the output when it reaches the start of a track in the outputbuf
+void drift_track_start(void) {
+	if (!d) return;
+
+	mutex_lock(d->mutex);
+	if (d->tracks_played < d->tracks) {
+		d->tracks_played++;
+	}
+	mutex_unlock(d->mutex);
+}
+
+// called with mutex held
+static void checkpoint(double step) {
+	unsigned i = d->checkpoints % CHECKPOINTS;
+
+	d->checkpoint[i].out = d->frames_out;
+	d->checkpoint[i].src = d->src;
+	d->checkpoint[i].step = step;
+	d->checkpoints++;
+}
+
+bool drift_stats(struct drift_stats *stats, unsigned rate) {
+	struct drift_family *f;
+
+	if (!d) return false;
+
+	mutex_lock(d->mutex);
+	f = &d->family[family(rate)];
+	stats->measured_ppm = f->measured_ppm;
+	stats->applied_ppm = f->applied_ppm;
+	stats->window_secs = f->t < d->tau ? f->t : d->tau;
+	stats->residual_frames = sqrt(f->residual);
+	stats->discontinuities = f->discontinuities;
+	stats->frames_in = d->frames_in;
+	stats->frames_out = d->frames_out;
+	mutex_unlock(d->mutex);
+
+	return true;
+}
+
+static void drift_reset(void) {
+	// history starts with zeros so the first input frame is the center of the filter
+	d->hist_frames = HALF_TAPS - 1;
+	memset(d->hist, 0, d->hist_frames * BYTES_PER_FRAME);
+	d->pos = HALF_TAPS - 1;
+}
+
+static bool drift_newstream(struct process_stage *stage, struct processstate *process, unsigned supported_rates[]) {
+	// history is emptied by drain at the end of each track, here it only holds frames left by a flush
+	if (d->rate != process->in_sample_rate) {
+		d->rate = process->in_sample_rate;
+		drift_reset();
+	}
+
+	mutex_lock(d->mutex);
+	d->track[d->tracks % TRACKS].out = d->frames_out;
+	d->track[d->tracks % TRACKS].src = d->src;
+	d->tracks++;
+	checkpoint(1 / (1 + d->family[family(d->rate)].applied_ppm * 1e-6));
+	mutex_unlock(d->mutex);
+
+	return true;
+}
+
+static void drift_append(const s32_t *iptr, frames_t frames) {
+	if (d->hist_frames + frames > d->hist_size) {
+		d->hist_size = d->hist_frames + frames;
+		d->hist = realloc(d->hist, d->hist_size * BYTES_PER_FRAME);
+		if (!d->hist) {
+			LOG_ERROR("malloc fail creating drift history");
+			exit(1);
+		}
+	}
+	if (iptr) {
+		memcpy(d->hist + d->hist_frames * 2, iptr, frames * BYTES_PER_FRAME);
+	} else {
+		memset(d->hist + d->hist_frames * 2, 0, frames * BYTES_PER_FRAME);
+	}
+	d->hist_frames += frames;
+}
+
+// interpolate from the history while the filter is covered by it, returns frames written
+static frames_t drift_filter(s32_t *optr, frames_t max_out) {
+	frames_t out = 0;
+	double step;
+	unsigned keep;
+
+	mutex_lock(d->mutex);
+	step = 1 / (1 + d->family[family(d->rate)].applied_ppm * 1e-6);
+	if (step != d->checkpoint[(d->checkpoints - 1) % CHECKPOINTS].step) {
+		checkpoint(step);
+	}
+	mutex_unlock(d->mutex);
+
+	while (out < max_out) {
+		unsigned i = (unsigned)d->pos, p, k;
+		double phase, frac, l = 0, r = 0;
+		const float *c0, *c1;
+		const s32_t *h;
+
+		if (i + HALF_TAPS >= d->hist_frames) break;
+
+		phase = (d->pos - i) * PHASES;
+		p = (unsigned)phase;
+		frac = phase - p;
+		c0 = d->table[p];
+		c1 = d->table[p + 1];
+		h = d->hist + (i - HALF_TAPS + 1) * 2;
+
+		for (k = 0; k < 2 * HALF_TAPS; k++) {
+			double c = c0[k] + frac * (c1[k] - c0[k]);
+			l += c * h[2 * k];
+			r += c * h[2 * k + 1];
+		}
+
+		optr[0] = l >= 2147483647.0 ? 0x7fffffff : l <= -2147483648.0 ? -0x7fffffff - 1 : (s32_t)lrint(l);
+		optr[1] = r >= 2147483647.0 ? 0x7fffffff : r <= -2147483648.0 ? -0x7fffffff - 1 : (s32_t)lrint(r);
+		optr += 2;
+		out++;
+
+		d->pos += step;
+	}
+
+	// drop history no longer needed by the filter
+	keep = (unsigned)d->pos - (HALF_TAPS - 1);
+	if (keep) {
+		memmove(d->hist, d->hist + keep * 2, (d->hist_frames - keep) * BYTES_PER_FRAME);
+		d->hist_frames -= keep;
+		d->pos -= keep;
+	}
+
+	mutex_lock(d->mutex);
+	d->frames_out += out;
+	d->src += out * step;
+	mutex_unlock(d->mutex);
+
+	return out;
+}
+
+static void drift_samples(struct process_stage *stage, struct processstate *process) {
+	drift_append((s32_t *)process->inbuf, process->in_frames);
+
+	process->out_frames = drift_filter((s32_t *)process->outbuf, process->max_out_frames);
+	process->total_in += process->in_frames;
+	process->total_out += process->out_frames;
+	d->frames_in += process->in_frames;
+}
+
+// end of track - the last HALF_TAPS - 1 input frames are still in the history, zeros are added after them so the
+// filter reaches them, then the history is reset for the next track as the resampler does
+static bool drift_drain(struct process_stage *stage, struct processstate *process) {
+	if (!d->draining) {
+		drift_append(NULL, HALF_TAPS);
+		d->draining = true;
+	}
+
+	process->out_frames = drift_filter((s32_t *)process->outbuf, process->max_out_frames);
+	process->total_out += process->out_frames;
+
+	if (process->out_frames < process->max_out_frames) {
+		d->draining = false;
+		drift_reset();
+		return true;
+	}
+
+	return false;
+}
+
+static void drift_flush(struct process_stage *stage) {
+	d->draining = false;
+	drift_reset();
+
+	// outputbuf is flushed too so no track started by the stage is still to be played
+	mutex_lock(d->mutex);
+	d->tracks_played = d->tracks;
+	mutex_unlock(d->mutex);
+}
+
+// drift = [<max ppm>]:[<time constant secs>]:[<slew ppm/sec>]
+struct process_stage *register_drift(const char *name, char *opt) {
+	struct process_stage *stage = malloc(sizeof(struct process_stage));
+	double v[3] = { 500, 120, 2 };
+
+	if (d) {
+		LOG_WARN("drift stage already registered");
+		free(stage);
+		return NULL;
+	}
+
+	d = malloc(sizeof(struct drift));
+	if (!stage || !d) {
+		LOG_ERROR("malloc fail creating drift stage");
+		exit(1);
+	}
+
+	memset(stage, 0, sizeof(struct process_stage));
+	memset(d, 0, sizeof(struct drift));
+
+	if (opt) {
+		sscanf(opt, "%lf:%lf:%lf", &v[0], &v[1], &v[2]);
+	}
+
+	d->max_ppm = v[0] > 0 ? v[0] : 500;
+	d->tau = v[1] >= MIN_WINDOW ? v[1] : MIN_WINDOW;
+	d->slew = v[2] > 0 ? v[2] : 2;
+
+	d->hist_size = HALF_TAPS * 2;
+	d->hist = malloc(d->hist_size * BYTES_PER_FRAME);
+	if (!d->hist) {
+		LOG_ERROR("malloc fail creating drift stage");
+		exit(1);
+	}
+
+	mutex_create(d->mutex);
+	design();
+	drift_reset();
+
+	LOG_INFO("drift correction max: %.0f ppm time constant: %.0f s slew: %.1f ppm/s", d->max_ppm, d->tau, d->slew);
+
+	stage->name = "drift";
+	stage->in_place = false;
+	stage->newstream = drift_newstream;
+	stage->samples = drift_samples;
+	stage->drain = drift_drain;
+	stage->flush = drift_flush;
+	stage->priv = d;
+
+	return stage;
+}
+
+#endif // #if DSP
@@ -0,0 +1,301 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// parametric eq processing stage - cascaded biquads, left and right channels processed together
+
+#include "squeezelite.h"
+
+#if DSP
+
+#include <math.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define EQ_SSE2 1
+#include <emmintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define EQ_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define MAX_BANDS 16
+
+// tiny offset added to the input to keep filter state out of the denormal range during silence
+#define ANTI_DENORMAL 1e-15
+
+extern log_level loglevel;
+
+typedef enum { PEAK = 0, LOWSHELF, HIGHSHELF, LOWPASS, HIGHPASS } band_type;
+
+static const char *band_names[] = { "peak", "lowshelf", "highshelf", "lowpass", "highpass" };
+
+struct eq {
+	bool left, right;
+	unsigned bands;
+	struct {
+		band_type type;
+		double freq, gain, q;
+	} band[MAX_BANDS];
+	unsigned rate;              // rate coefficients are calculated for
+	// coefficients and transposed direct form II state per band, [0] = left, [1] = right
+	double b0[MAX_BANDS][2], b1[MAX_BANDS][2], b2[MAX_BANDS][2], a1[MAX_BANDS][2], a2[MAX_BANDS][2];
+	double z1[MAX_BANDS][2], z2[MAX_BANDS][2];
+};
+
+// rbj audio eq cookbook coefficients, normalised by a0
+static void eq_design(struct eq *e, unsigned rate) {
+	unsigned i;
+
+	for (i = 0; i < e->bands; i++) {
+		double A = pow(10, e->band[i].gain / 40);
+		double w0 = 2 * M_PI * e->band[i].freq / rate;
+		double cw = cos(w0), alpha = sin(w0) / (2 * e->band[i].q), sa = 2 * sqrt(A) * alpha;
+		double b0 = 1, b1 = 0, b2 = 0, a0 = 1, a1 = 0, a2 = 0;
+		int c;
+
+		if (e->band[i].freq >= rate / 2) {
+			LOG_WARN("eq band %s %.0fHz above nyquist at %u, bypassed", band_names[e->band[i].type], e->band[i].freq, rate);
+		} else {
+			switch (e->band[i].type) {
+			case PEAK:
+				b0 = 1 + alpha * A; b1 = -2 * cw; b2 = 1 - alpha * A;
+				a0 = 1 + alpha / A; a1 = -2 * cw; a2 = 1 - alpha / A;
+				break;
+			case LOWSHELF:
+				b0 = A * ((A + 1) - (A - 1) * cw + sa); b1 = 2 * A * ((A - 1) - (A + 1) * cw); b2 = A * ((A + 1) - (A - 1) * cw - sa);
+				a0 = (A + 1) + (A - 1) * cw + sa; a1 = -2 * ((A - 1) + (A + 1) * cw); a2 = (A + 1) + (A - 1) * cw - sa;
+				break;
+			case HIGHSHELF:
+				b0 = A * ((A + 1) + (A - 1) * cw + sa); b1 = -2 * A * ((A - 1) + (A + 1) * cw); b2 = A * ((A + 1) + (A - 1) * cw - sa);
+				a0 = (A + 1) - (A - 1) * cw + sa; a1 = 2 * ((A - 1) - (A + 1) * cw); a2 = (A + 1) - (A - 1) * cw - sa;
+				break;
+			case LOWPASS:
+				b0 = (1 - cw) / 2; b1 = 1 - cw; b2 = (1 - cw) / 2;
+				a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+				break;
+			case HIGHPASS:
+				b0 = (1 + cw) / 2; b1 = -(1 + cw); b2 = (1 + cw) / 2;
+				a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+				break;
+			}
+		}
+
+		// channels not selected pass through unchanged
+		for (c = 0; c < 2; c++) {
+			bool on = c == 0 ? e->left : e->right;
+			e->b0[i][c] = on ? b0 / a0 : 1;
+			e->b1[i][c] = on ? b1 / a0 : 0;
+			e->b2[i][c] = on ? b2 / a0 : 0;
+			e->a1[i][c] = on ? a1 / a0 : 0;
+			e->a2[i][c] = on ? a2 / a0 : 0;
+		}
+	}
+
+	e->rate = rate;
+}
+
+static void eq_reset(struct eq *e) {
+	memset(e->z1, 0, sizeof(e->z1));
+	memset(e->z2, 0, sizeof(e->z2));
+}
+
+static inline s32_t eq_clip(double y) {
+	if (y >= 2147483647.0) return 0x7fffffff;
+	if (y <= -2147483648.0) return -0x7fffffff - 1;
+	return (s32_t)lrint(y);
+}
+
+#if !EQ_SSE2 && !EQ_NEON
+// scalar version for platforms without a vector version
+static void eq_samples_c(struct eq *e, s32_t *ptr, frames_t frames) {
+	unsigned i, c;
+
+	while (frames--) {
+		for (c = 0; c < 2; c++) {
+			double x = ptr[c] + ANTI_DENORMAL;
+			for (i = 0; i < e->bands; i++) {
+				double y = e->b0[i][c] * x + e->z1[i][c];
+				e->z1[i][c] = e->b1[i][c] * x - e->a1[i][c] * y + e->z2[i][c];
+				e->z2[i][c] = e->b2[i][c] * x - e->a2[i][c] * y;
+				x = y;
+			}
+			ptr[c] = eq_clip(x);
+		}
+		ptr += 2;
+	}
+}
+#endif
+
+#if EQ_SSE2
+// left and right in one vector of doubles, state kept in registers for the block
+static void eq_samples_sse2(struct eq *e, s32_t *ptr, frames_t frames) {
+	__m128d b0[MAX_BANDS], b1[MAX_BANDS], b2[MAX_BANDS], a1[MAX_BANDS], a2[MAX_BANDS], z1[MAX_BANDS], z2[MAX_BANDS];
+	const __m128d offset = _mm_set1_pd(ANTI_DENORMAL);
+	const __m128d max = _mm_set1_pd(2147483647.0), min = _mm_set1_pd(-2147483648.0);
+	unsigned i, bands = e->bands;
+
+	for (i = 0; i < bands; i++) {
+		b0[i] = _mm_loadu_pd(e->b0[i]); b1[i] = _mm_loadu_pd(e->b1[i]); b2[i] = _mm_loadu_pd(e->b2[i]);
+		a1[i] = _mm_loadu_pd(e->a1[i]); a2[i] = _mm_loadu_pd(e->a2[i]);
+		z1[i] = _mm_loadu_pd(e->z1[i]); z2[i] = _mm_loadu_pd(e->z2[i]);
+	}
+
+	while (frames--) {
+		__m128d x = _mm_add_pd(_mm_cvtepi32_pd(_mm_loadl_epi64((__m128i *)ptr)), offset);
+		for (i = 0; i < bands; i++) {
+			__m128d y = _mm_add_pd(_mm_mul_pd(b0[i], x), z1[i]);
+			z1[i] = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1[i], x), _mm_mul_pd(a1[i], y)), z2[i]);
+			z2[i] = _mm_sub_pd(_mm_mul_pd(b2[i], x), _mm_mul_pd(a2[i], y));
+			x = y;
+		}
+		x = _mm_max_pd(_mm_min_pd(x, max), min);
+		_mm_storel_epi64((__m128i *)ptr, _mm_cvtpd_epi32(x));
+		ptr += 2;
+	}
+
+	for (i = 0; i < bands; i++) {
+		_mm_storeu_pd(e->z1[i], z1[i]);
+		_mm_storeu_pd(e->z2[i], z2[i]);
+	}
+}
+#endif
+
+#if EQ_NEON
+static void eq_samples_neon(struct eq *e, s32_t *ptr, frames_t frames) {
+	float64x2_t b0[MAX_BANDS], b1[MAX_BANDS], b2[MAX_BANDS], a1[MAX_BANDS], a2[MAX_BANDS], z1[MAX_BANDS], z2[MAX_BANDS];
+	const float64x2_t offset = vdupq_n_f64(ANTI_DENORMAL);
+	const float64x2_t max = vdupq_n_f64(2147483647.0), min = vdupq_n_f64(-2147483648.0);
+	unsigned i, bands = e->bands;
+
+	for (i = 0; i < bands; i++) {
+		b0[i] = vld1q_f64(e->b0[i]); b1[i] = vld1q_f64(e->b1[i]); b2[i] = vld1q_f64(e->b2[i]);
+		a1[i] = vld1q_f64(e->a1[i]); a2[i] = vld1q_f64(e->a2[i]);
+		z1[i] = vld1q_f64(e->z1[i]); z2[i] = vld1q_f64(e->z2[i]);
+	}
+
+	while (frames--) {
+		float64x2_t x = vaddq_f64(vcvtq_f64_s64(vmovl_s32(vld1_s32(ptr))), offset);
+		for (i = 0; i < bands; i++) {
+			float64x2_t y = vfmaq_f64(z1[i], b0[i], x);
+			z1[i] = vfmsq_f64(vfmaq_f64(z2[i], b1[i], x), a1[i], y);
+			z2[i] = vfmsq_f64(vmulq_f64(b2[i], x), a2[i], y);
+			x = y;
+		}
+		x = vmaxq_f64(vminq_f64(x, max), min);
+		vst1_s32(ptr, vmovn_s64(vcvtnq_s64_f64(x)));
+		ptr += 2;
+	}
+
+	for (i = 0; i < bands; i++) {
+		vst1q_f64(e->z1[i], z1[i]);
+		vst1q_f64(e->z2[i], z2[i]);
+	}
+}
+#endif
+
+static bool eq_newstream(struct process_stage *stage, struct processstate *process, unsigned supported_rates[]) {
+	struct eq *e = stage->priv;
+
+	// state is kept across streams at the same rate for gapless playback
+	if (e->rate != process->in_sample_rate) {
+		eq_design(e, process->in_sample_rate);
+		eq_reset(e);
+	}
+
+	return e->bands > 0;
+}
+
+static void eq_samples(struct process_stage *stage, struct processstate *process) {
+#if EQ_SSE2
+	eq_samples_sse2(stage->priv, (s32_t *)process->inbuf, process->in_frames);
+#elif EQ_NEON
+	eq_samples_neon(stage->priv, (s32_t *)process->inbuf, process->in_frames);
+#else
+	eq_samples_c(stage->priv, (s32_t *)process->inbuf, process->in_frames);
+#endif
+}
+
+static void eq_flush(struct process_stage *stage) {
+	eq_reset(stage->priv);
+}
+
+// opt = <type>:<freq>:<gain dB>[:<q>][,<type>:<freq>:<gain dB>[:<q>]...]
+struct process_stage *register_eq(const char *name, char *opt) {
+	struct process_stage *stage = malloc(sizeof(struct process_stage));
+	struct eq *e = malloc(sizeof(struct eq));
+	char *band = opt;
+
+	if (!stage || !e) {
+		LOG_ERROR("malloc fail creating eq stage");
+		exit(1);
+	}
+
+	memset(stage, 0, sizeof(struct process_stage));
+	memset(e, 0, sizeof(struct eq));
+
+	e->left = strcmp(name, "eqr") != 0;
+	e->right = strcmp(name, "eql") != 0;
+
+	while (band && *band) {
+		char *next = strchr(band, ',');
+		char type[16];
+		double freq, gain = 0, q = M_SQRT1_2;
+		int n, t;
+
+		if (next) *next++ = '\0';
+
+		n = sscanf(band, "%15[^:]:%lf:%lf:%lf", type, &freq, &gain, &q);
+
+		for (t = 0; t < sizeof(band_names) / sizeof(band_names[0]); t++) {
+			if (!strcmp(type, band_names[t])) break;
+		}
+
+		if (n < 2 || t == sizeof(band_names) / sizeof(band_names[0]) || freq <= 0 || q <= 0) {
+			LOG_WARN("invalid eq band: %s", band);
+		} else if (e->bands == MAX_BANDS) {
+			LOG_WARN("too many eq bands, ignoring: %s", band);
+		} else {
+			e->band[e->bands].type = t;
+			e->band[e->bands].freq = freq;
+			e->band[e->bands].gain = gain;
+			e->band[e->bands].q = q;
+			LOG_INFO("%s band %u: %s freq: %.1f gain: %.1f q: %.3f", name, e->bands, type, freq, gain, q);
+			e->bands++;
+		}
+
+		band = next;
+	}
+
+	stage->name = "eq";
+	stage->in_place = true;
+	stage->newstream = eq_newstream;
+	stage->samples = eq_samples;
+	stage->drain = NULL;
+	stage->flush = eq_flush;
+	stage->priv = e;
+
+	return stage;
+}
+
+#endif // #if DSP
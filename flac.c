@@ -182,7 +182,7 @@ static FLAC__StreamDecoderWriteStatus write_cb(const FLAC__StreamDecoder *decode
 #else
 #define MARKER_OFFSET 1
 #endif		
-		if (bits_per_sample == 24 && is_stream_dop(((u8_t *)lptr) + MARKER_OFFSET, ((u8_t *)rptr) + MARKER_OFFSET, 4, frames)) {
+		if (bits_per_sample == 24 && output.frame_bytes == BYTES_PER_FRAME && is_stream_dop(((u8_t *)lptr) + MARKER_OFFSET, ((u8_t *)rptr) + MARKER_OFFSET, 4, frames)) {
 			LOG_INFO("file contains DOP");
 			if (output.dsdfmt == DOP_S24_LE || output.dsdfmt == DOP_S24_3LE)
 				output.next_fmt = output.dsdfmt;
@@ -0,0 +1,133 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Flight recorder - the player threads record compact pipeline events into a lock free ring which is written to
+// a file when the output underruns, so the lead up to a glitch can be examined without debug logging
+// convert a dump with tools/flight2trace.c and load it in chrome://tracing or ui.perfetto.dev
+
+#include "squeezelite.h"
+
+#if FLIGHTREC
+
+#include <fcntl.h>
+
+#define FLIGHT_EVENTS  4096   // power of 2
+#define FLIGHT_HOLDOFF 5000   // ms between dumps
+#define FLIGHT_FILES   8      // dump file names are reused after this many
+
+static struct flight_event ring[FLIGHT_EVENTS];
+static u32_t head = 0;
+
+static u32_t pending = 0;     // type of the event which requested a dump
+static u32_t last_dump = 0;
+static unsigned dumps = 0;
+
+static const char *dir = NULL;   // dumps are only written when a directory is given
+
+static log_level loglevel;
+
+extern struct outputstate output;
+
+// any thread - claim a slot then invalidate it while it is rewritten so the dump can skip slots caught mid write
+void flight_record(flight_type type, u8_t flag, u32_t a, u32_t b, u32_t c) {
+	u32_t seq = fetch_add(head, 1);
+	struct flight_event *e = &ring[seq & (FLIGHT_EVENTS - 1)];
+
+	e->seq = 0;
+	write_fence();
+	e->us = gettime_us();
+	e->type = type;
+	e->flag = flag;
+	e->a = a;
+	e->b = b;
+	e->c = c;
+	store_release(e->seq, seq + 1);
+}
+
+// any thread - record the event and have slimproto write the ring to disk
+void flight_trigger(flight_type type, u8_t flag) {
+	flight_record(type, flag, 0, 0, 0);
+	if (dir && !exchange(pending, type)) {
+		wake_controller(WAKE_OUTPUT);
+	}
+}
+
+// slimproto thread - write a pending dump, oldest event first
+void flight_dump(void) {
+	struct flight_header hdr;
+	struct flight_event *events;
+	char path[PATH_MAX];
+	u32_t now = gettime_ms(), end, seq;
+	unsigned n = 0;
+	FILE *fp = NULL;
+	int fd;
+
+	if (!load_acquire(pending) || now - last_dump < FLIGHT_HOLDOFF) {
+		return;
+	}
+
+	if (!(events = malloc(sizeof(ring)))) {
+		return;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FLIGHT_MAGIC, sizeof(hdr.magic));
+	hdr.version = FLIGHT_VERSION;
+	hdr.reason = exchange(pending, 0);
+	hdr.rate = output.current_sample_rate;
+	hdr.us = gettime_us();
+
+	end = load_acquire(head);
+	for (seq = end - min(end, FLIGHT_EVENTS); seq != end; ++seq) {
+		struct flight_event *e = &ring[seq & (FLIGHT_EVENTS - 1)];
+		if (load_acquire(e->seq) != seq + 1) continue;
+		events[n] = *e;
+		read_fence();
+		if (e->seq == seq + 1) ++n;
+	}
+	hdr.count = n;
+
+	snprintf(path, sizeof(path), "%s/squeezelite-%d-%u.flight", dir, (int)getpid(), dumps++ % FLIGHT_FILES);
+
+	// the name is reused so remove our previous dump, then never follow or overwrite a file someone else created
+	unlink(path);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) < 0 || (fp = fdopen(fd, "wb")) == NULL) {
+		if (fd >= 0) close(fd);
+		LOG_WARN("unable to write flight recorder %s: %s", path, strerror(errno));
+	} else {
+		fwrite(&hdr, sizeof(hdr), 1, fp);
+		fwrite(events, sizeof(struct flight_event), n, fp);
+		fclose(fp);
+		LOG_INFO("flight recorder %s: %u events", path, n);
+	}
+
+	last_dump = now;
+	free(events);
+}
+
+// events are always recorded, opt is the directory to write dumps to
+void flight_init(log_level level, const char *opt) {
+	loglevel = level;
+	dir = opt;
+	last_dump = gettime_ms() - FLIGHT_HOLDOFF;
+}
+
+#endif // FLIGHTREC
@@ -209,7 +209,7 @@ static void *ir_thread(void *vargp) {
 			ir.code = ir_code;
 			ir.ts = now;
 			UNLOCK_I;
-			wake_controller();
+			wake_controller(WAKE_IR);
 		}
 		
 		free(code);
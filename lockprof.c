@@ -0,0 +1,153 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Mutex contention profiling - mutex_lock records acquisitions, wait and hold time for each call site
+// a report ranked by longest hold is written to stderr on SIGUSR1 and at exit
+
+#include "squeezelite.h"
+
+#if LOCKPROF
+
+static struct lock_site *sites = NULL;
+static unsigned site_count = 0;
+
+static pthread_t thread;
+static bool running = true;
+
+static void update_max(u64_t *max, u64_t v) {
+	u64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while (v > cur && !__atomic_compare_exchange_n(max, &cur, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// sites are added to the list on first use, one call site may lock different mutexes from several threads
+void lockprof_lock(lockprof_mutex *m, struct lock_site *site) {
+	u64_t start = gettime_us(), now = start;
+
+	if (pthread_mutex_trylock(&m->mutex) != 0) {
+		pthread_mutex_lock(&m->mutex);
+		now = gettime_us();
+		fetch_add(site->contended, 1);
+		fetch_add(site->wait_us, now - start);
+		update_max(&site->max_wait_us, now - start);
+	}
+
+	m->site = site;
+	m->since = now;
+
+	fetch_add(site->count, 1);
+
+	if (!load_acquire(site->listed) && !exchange(site->listed, 1)) {
+		site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&sites, &site->next, site, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		fetch_add(site_count, 1);
+	}
+}
+
+void lockprof_unlock(lockprof_mutex *m) {
+	struct lock_site *site = m->site;
+	u64_t hold = gettime_us() - m->since;
+
+	m->site = NULL;
+	pthread_mutex_unlock(&m->mutex);
+
+	if (site) {
+		fetch_add(site->hold_us, hold);
+		update_max(&site->max_hold_us, hold);
+	}
+}
+
+static int cmp_site(const void *a, const void *b) {
+	u64_t x = (*(struct lock_site **)a)->max_hold_us, y = (*(struct lock_site **)b)->max_hold_us;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void report(void) {
+	struct lock_site **list, *s;
+	unsigned n = load_acquire(site_count), i = 0;
+
+	if (!n || !(list = malloc(n * sizeof(struct lock_site *)))) {
+		return;
+	}
+
+	for (s = load_acquire(sites); s && i < n; s = s->next) {
+		list[i++] = s;
+	}
+	n = i;
+
+	qsort(list, n, sizeof(struct lock_site *), cmp_site);
+
+	fprintf(stderr, "%s lock profile - %u call sites, ranked by longest hold\n", logtime(), n);
+	fprintf(stderr, "%-24s %10s %10s %10s %10s %10s %10s %10s\n",
+			"site", "locks", "contended", "wait ms", "max wait", "hold ms", "avg hold", "max hold");
+
+	for (i = 0; i < n; ++i) {
+		char site[64];
+		u64_t count = load_acquire(list[i]->count);
+		s = list[i];
+		snprintf(site, sizeof(site), "%s:%d", s->file, s->line);
+		fprintf(stderr, "%-24s %10llu %10llu %10.1f %8lluus %10.1f %8lluus %8lluus\n", site,
+				(unsigned long long)count, (unsigned long long)load_acquire(s->contended),
+				load_acquire(s->wait_us) / 1000.0, (unsigned long long)load_acquire(s->max_wait_us),
+				load_acquire(s->hold_us) / 1000.0, (unsigned long long)(count ? load_acquire(s->hold_us) / count : 0),
+				(unsigned long long)load_acquire(s->max_hold_us));
+	}
+
+	fflush(stderr);
+	free(list);
+}
+
+static void *lockprof_thread(void *arg) {
+	sigset_t *set = arg;
+	int sig;
+
+	while (running) {
+		if (sigwait(set, &sig) == 0 && running) {
+			report();
+		}
+	}
+
+	return 0;
+}
+
+// must be called before other threads are created so they inherit SIGUSR1 blocked
+void lockprof_init(void) {
+	static sigset_t set;
+	pthread_attr_t attr;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 32 * 1024);
+	pthread_create(&thread, &attr, lockprof_thread, &set);
+	pthread_attr_destroy(&attr);
+}
+
+void lockprof_close(void) {
+	running = false;
+	pthread_kill(thread, SIGUSR1);
+	pthread_join(thread, NULL);
+
+	report();
+}
+
+#endif // LOCKPROF
@@ -25,6 +25,9 @@
 #include "squeezelite.h"
 
 #include <signal.h>
+#if LINUX || OSX || FREEBSD
+#include <sys/wait.h>
+#endif
 
 #define TITLE "Squeezelite " VERSION ", Copyright 2012-2015 Adrian Smith, 2015-2026 Ralph Irving."
 
@@ -80,9 +83,23 @@ static void usage(const char *argv0) {
 #else
 		   "  -a <l>\t\tSpecify Portaudio params to open output device, l = target latency in ms\n"
 #endif
+#endif
+#if PULSEAUDIO
+		   "  -a <l>\t\tSpecify PulseAudio params to open output device, l = target latency in ms\n"
 #endif
 		   "  -a <f>\t\tSpecify sample format (16|24|32) of output file when using -o - to output samples to stdout (interleaved little endian only)\n"
 		   "  -b <stream>:<output>\tSpecify internal Stream and Output buffer sizes in Kbytes. Default is %d:%d\n"
+		   "  \t\t\tOutput as <secs>s sizes it at each track start for that many seconds at the track's rate plus any crossfade\n"
+#if PROCESS
+		   "  -b <s>:<o>:16\t\tHold 16 bit samples in the Output buffer, halving its size for 16 bit sources and DACs (DSD is converted to PCM)\n"
+#endif
+#if LINUX || OSX || FREEBSD
+		   "  -H <playersfile>\tRun a player for each line of playersfile, holding that player's options (eg -n, -m, -o) added to the\n"
+		   "  \t\t\tcommon command line; codec libraries are loaded once, players which exit are restarted and those\n"
+		   "  \t\t\twithout -m get a locally administered mac address derived from this host's\n"
+		   "  -B <p1>,<p2>\t\tStream and Output buffer allocation: align (64 byte, default), huge (huge pages), lock (lock buffers in memory\n"
+		   "  \t\t\tinstead of the whole process), nodump (exclude from core dumps), none\n"
+#endif
 		   "  -c <codec1>,<codec2>\tRestrict codecs to those specified, otherwise load all available codecs; known codecs: " CODECS "\n"
 		   "  \t\t\tCodecs reported to LMS in order listed, allowing codec priority refinement.\n"
 		   "  -C <timeout>\t\tClose output device when idle after timeout seconds, default is to keep it open while player is 'on'\n"
@@ -96,6 +113,18 @@ static void usage(const char *argv0) {
 #endif
 		   "  -e <codec1>,<codec2>\tExplicitly exclude native support of one or more codecs; known codecs: " CODECS "\n"
 		   "  -f <logfile>\t\tWrite debug to logfile\n"
+#if DSP
+		   "  -F <stage>=<params>\tAdd processing stage, repeat for multiple stages which run in the order given,\n"
+		   "  \t\t\t eq|eql|eqr=<type>:<freq>:<gain dB>[:<q>][,<type>:...], parametric eq on both, left or right channels,\n"
+		   "  \t\t\t type = peak|lowshelf|highshelf|lowpass|highpass,\n"
+		   "  \t\t\t delay=<left ms>:<right ms>[:<left dB>:<right dB>], gain=<left dB>:<right dB>, per channel delay and gain,\n"
+		   "  \t\t\t conv=[<rate>:]<file>[,<rate>:<file>...][,block:<frames>][,tail:<factor>][,threads:0|1], fir convolution,\n"
+		   "  \t\t\t file = wav or raw 32 bit float mono impulse response, used for the matching rate or any rate if no rate given,\n"
+		   "  \t\t\t block = latency in frames (default 256), tail = long partition size as multiple of block, 0 = uniform (default 16),\n"
+		   "  \t\t\t drift=[<max ppm>]:[<time constant secs>]:[<slew ppm/sec>], resample to correct output clock drift for synchronised players,\n"
+		   "  \t\t\t measured against the player clock (default 500:120:2), should be the last stage,\n"
+		   "  \t\t\t resample = position of the -R resampler in the chain, otherwise it is first\n"
+#endif
 #if IR
 		   "  -i [<filename>]\tEnable lirc remote control support (lirc config file ~/.lircrc used if filename not specified)\n"
 #endif
@@ -116,13 +145,17 @@ static void usage(const char *argv0) {
 #endif
 #if RESAMPLE
 		   "  -R -u [params]\tResample, params = <recipe>:<flags>:<attenuation>:<precision>:<passband_end>:<stopband_start>:<phase_response>,\n" 
-		   "  \t\t\t recipe = (v|h|m|l|q)(L|I|M)(s) [E|X], E = exception - resample only if native rate not supported, X = async - resample to max rate for device, otherwise to max sync rate\n"
+		   "  \t\t\t recipe = (v|h|m|l|q)(L|I|M)(s) [E|X] [P] [C], E = exception - resample only if native rate not supported, X = async - resample to max rate for device, otherwise to max sync rate\n"
+		   "  \t\t\t P = resample left and right channels in parallel on separate threads\n"
+		   "  \t\t\t C = crossfade between tracks at different rates by resampling the new track to the rate of the previous one,\n"
+		   "  \t\t\t use with E to otherwise play at native rate, rate changes once the buffer is empty at a track start\n"
 		   "  \t\t\t flags = num in hex,\n"
 		   "  \t\t\t attenuation = attenuation in dB to apply (default is -1db if not explicitly set),\n"
 		   "  \t\t\t precision = number of bits precision (NB. HQ = 20. VHQ = 28),\n"
 		   "  \t\t\t passband_end = number in percent (0dB pt. bandwidth to preserve. nyquist = 100%%),\n"
 		   "  \t\t\t stopband_start = number in percent (Aliasing/imaging control. > passband_end),\n"
 		   "  \t\t\t phase_response = 0-100 (0 = minimum / 50 = linear / 100 = maximum)\n"
+		   "  \t\t\t built in resampler is used if libsoxr is not available, only recipe (v|h|m|l|q) [E|X] [C] and attenuation apply\n"
 #endif
 #if DSD
 #if ALSA
@@ -131,10 +164,19 @@ static void usage(const char *argv0) {
 #else
 		   "  -D [delay]\t\tOutput device supports DSD over PCM (DoP), delay = optional delay switching between PCM and DoP in ms\n"
 #endif
+		   "  -E <rate>:<threads>:<quality>\tDSD to PCM conversion, rate = decimation after DSD rate / 8 (1|2|4|8|16, default 1),\n"
+		   "  \t\t\t or target PCM rate in Hz, or max to decimate to the maximum rate of the device,\n"
+		   "  \t\t\t threads = convert channels on separate threads (0|1), quality = low|balanced|high\n"
 #endif
 #if VISEXPORT
 		   "  -v \t\t\tVisualizer support\n"
 #endif
+#if METRICS
+		   "  -I [<addr>:]<port>\tServe metrics in prometheus text format over http, on localhost unless addr is given\n"
+#endif
+#if FLIGHTREC
+		   "  -J <dir>\t\tWrite flight recorder dumps of recent pipeline events to dir on output underrun\n"
+#endif
 # if ALSA
 		   "  -O <mixer device>\tSpecify mixer device, defaults to 'output device'\n"
 		   "  -L \t\t\tList volume controls for output device\n"
@@ -195,6 +237,12 @@ static void usage(const char *argv0) {
 		   " RESAMPLE"
 #endif
 #endif
+#if NO_SOXR
+		   " NO_SOXR"
+#endif
+#if DSP
+		   " DSP"
+#endif
 #if ALAC
 		   " ALAC"
 #elif FFMPEG
@@ -215,6 +263,18 @@ static void usage(const char *argv0) {
 #if VISEXPORT
 		   " VISEXPORT"
 #endif
+#if METRICS
+		   " METRICS"
+#endif
+#if LOCKPROF
+		   " LOCKPROF"
+#endif
+#if FLIGHTREC
+		   " FLIGHTREC"
+#endif
+#if ASYNCLOG
+		   " ASYNCLOG"
+#endif
 #if IR
 		   " IR"
 #endif
@@ -295,7 +355,181 @@ static void sighandler(int signum) {
 	signal(signum, SIG_DFL);
 }
 
-int main(int argc, char **argv) {
+#if LINUX || OSX || FREEBSD
+// multi-player mode - one process per player forked from here after the codec libraries are loaded so they are shared
+// each line of the players file holds the options for one player, added to the common command line
+
+#define MAX_PLAYERS 32
+#define MAX_PLAYER_LINE 512
+#define RESPAWN_SECS 10
+
+static struct {
+	pid_t pid;
+	time_t started;
+	int argc;
+	char **argv;
+} player[MAX_PLAYERS];
+static unsigned nplayers;
+static volatile bool players_running = true;
+
+static void players_sighandler(int signum) {
+	unsigned i;
+	players_running = false;
+	for (i = 0; i < nplayers; i++) {
+		if (player[i].pid > 0) kill(player[i].pid, SIGTERM);
+	}
+}
+
+// build each player's command line - common options without those for this process, then the player's own
+// players without their own mac address get a locally administered one derived from the common one
+static void players_read(const char *file, char **args, int argc, u8_t mac[6]) {
+	char line[MAX_PLAYER_LINE];
+	FILE *fp = fopen(file, "r");
+
+	if (!fp) {
+		fprintf(stderr, "error opening players file %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), fp) && nplayers < MAX_PLAYERS) {
+		char **argv = malloc((argc + MAX_PLAYER_LINE / 2 + 3) * sizeof(char *));
+		bool has_mac = false;
+		int n = 0, common, i;
+		char *t;
+
+		if (!argv) {
+			fprintf(stderr, "malloc fail reading players file\n");
+			exit(1);
+		}
+
+		for (i = 0; i < argc; i++) {
+			if (i > 0 && (!strcmp(args[i], "-H") || !strcmp(args[i], "-P"))) {
+				i++;
+				continue;
+			}
+			if (i > 0 && !strcmp(args[i], "-z")) {
+				continue;
+			}
+			argv[n++] = args[i];
+		}
+
+		common = n;
+
+		for (t = strtok(line, " \t\r\n"); t && *t != '#'; t = strtok(NULL, " \t\r\n")) {
+			if (!strcmp(t, "-H")) {
+				fprintf(stderr, "-H not allowed in players file %s\n", file);
+				exit(1);
+			}
+			if (!strcmp(t, "-m")) has_mac = true;
+			argv[n++] = strdup(t);
+		}
+
+		if (n == common) {
+			// blank or comment line
+			free(argv);
+			continue;
+		}
+
+		if (!has_mac) {
+			// locally administered unicast so it can't be the address of a real interface, player number in the last byte
+			char *m = malloc(18);
+			if (!m) {
+				fprintf(stderr, "malloc fail reading players file\n");
+				exit(1);
+			}
+			sprintf(m, "%02x:%02x:%02x:%02x:%02x:%02x", (mac[0] | 0x02) & ~0x01, mac[1], mac[2], mac[3], mac[4],
+					mac[5] ^ (nplayers + 1));
+			argv[n++] = "-m";
+			argv[n++] = m;
+		}
+
+		argv[n] = NULL;
+		player[nplayers].argc = n;
+		player[nplayers].argv = argv;
+		nplayers++;
+	}
+
+	fclose(fp);
+
+	if (!nplayers) {
+		fprintf(stderr, "no players in %s\n", file);
+		exit(1);
+	}
+}
+
+// supervise the players, only returns in a forked player with its command line in argv
+static int players(const char *file, char **args, int argc, u8_t mac[6], char ***argv) {
+	unsigned i;
+
+	players_read(file, args, argc, mac);
+
+	signal(SIGINT, players_sighandler);
+	signal(SIGTERM, players_sighandler);
+#if defined(SIGQUIT)
+	signal(SIGQUIT, players_sighandler);
+#endif
+
+	for (i = 0; players_running; i = (i + 1) % nplayers) {
+		int status;
+		pid_t pid;
+
+		if (player[i].pid == 0) {
+			time_t now = time(NULL);
+
+			// restart a player which exits quickly no more than every RESPAWN_SECS
+			if (player[i].started && now - player[i].started < RESPAWN_SECS) {
+				sleep(RESPAWN_SECS - (now - player[i].started));
+				if (!players_running) break;
+			}
+
+			player[i].started = time(NULL);
+			player[i].pid = fork();
+
+			if (player[i].pid == 0) {
+				signal(SIGINT, SIG_DFL);
+				signal(SIGTERM, SIG_DFL);
+#if defined(SIGQUIT)
+				signal(SIGQUIT, SIG_DFL);
+#endif
+				*argv = player[i].argv;
+				return player[i].argc;
+			}
+
+			if (player[i].pid < 0) {
+				fprintf(stderr, "%s unable to fork player %u: %s\n", logtime(), i, strerror(errno));
+				player[i].pid = 0;
+			} else {
+				fprintf(stderr, "%s started player %u pid %d\n", logtime(), i, (int)player[i].pid);
+			}
+			continue;
+		}
+
+		if (i != nplayers - 1) continue;
+
+		// all players running - wait for one to exit
+		pid = wait(&status);
+
+		if (pid > 0) {
+			unsigned j;
+			for (j = 0; j < nplayers; j++) {
+				if (player[j].pid == pid) {
+					fprintf(stderr, "%s player %u pid %d exited: %d\n", logtime(), j, (int)pid,
+							WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+					player[j].pid = 0;
+				}
+			}
+		}
+	}
+
+	while (wait(NULL) > 0);
+
+	exit(0);
+}
+#endif
+
+// start up from the command line and run until exit
+// in multi-player mode this supervises the players and only returns in a forked player, with its command line in player_argv
+static int start(int argc, char **argv, char ***player_argv) {
 	char *server = NULL;
 	char *output_device = "default";
 	char *include_codecs = NULL;
@@ -305,6 +539,9 @@ int main(int argc, char **argv) {
 	char *modelname = NULL;
 	extern bool pcm_check_header;
 	extern bool user_rates;
+	extern unsigned outputbuf_headroom;
+	extern bool outputbuf_16bit;
+	extern unsigned buf_policy;
 	char *logfile = NULL;
 	u8_t mac[6];
 	unsigned stream_buf_size = STREAMBUF_SIZE;
@@ -312,6 +549,10 @@ int main(int argc, char **argv) {
 	unsigned rates[MAX_SUPPORTED_SAMPLERATES] = { 0 };
 	unsigned rate_delay = 0;
 	char *resample = NULL;
+#if DSP
+	char *dsp_stages[8];
+	unsigned dsp_count = 0;
+#endif
 	char *output_params = NULL;
 	unsigned idle = 0;
 #if LINUX || FREEBSD || SUN
@@ -319,6 +560,10 @@ int main(int argc, char **argv) {
 	char *pidfile = NULL;
 	FILE *pidfp = NULL;
 #endif
+#if LINUX || OSX || FREEBSD
+	char *players_file = NULL;
+	char **players_args = NULL;
+#endif
 #if ALSA
 	unsigned rt_priority = OUTPUT_RT_PRIORITY;
 	char *mixer_device = output_device;
@@ -329,10 +574,17 @@ int main(int argc, char **argv) {
 #if DSD
 	unsigned dsd_delay = 0;
 	dsd_format dsd_outfmt = PCM;
+	char *dsd_pcm = NULL;
 #endif
 #if VISEXPORT
 	bool visexport = false;
 #endif
+#if METRICS
+	char *metrics = NULL;
+#endif
+#if FLIGHTREC
+	char *flight_dir = NULL;
+#endif
 #if IR
 	char *lircrc = NULL;
 #endif
@@ -361,11 +613,38 @@ int main(int argc, char **argv) {
 		strcat(cmdline, " ");
 	}
 
+#if LINUX || OSX || FREEBSD
+	// multi-player mode - keep an unparsed copy of the command line for the players as parsing modifies options
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-H")) {
+			int j;
+			players_args = malloc(argc * sizeof(char *));
+			for (j = 0; players_args && j < argc; j++) players_args[j] = strdup(argv[j]);
+			break;
+		}
+	}
+#endif
+
 	while (optind < argc && strlen(argv[optind]) >= 2 && argv[optind][0] == '-') {
 		char *opt = argv[optind] + 1;
-		if (strstr("oabcCdefmMnNpPrsZ"
+		if (strstr("oabBcCdefmMnNpPrsZ"
+#if LINUX || OSX || FREEBSD
+				   "H"
+#endif
 #if ALSA
 				   "UVO"
+#endif
+#if DSD
+				   "E"
+#endif
+#if DSP
+				   "F"
+#endif
+#if METRICS
+				   "I"
+#endif
+#if FLIGHTREC
+				   "J"
 #endif
 				   , opt) && optind < argc - 1) {
 			optarg = argv[optind + 1];
@@ -416,10 +695,35 @@ int main(int argc, char **argv) {
 			{
 				char *s = next_param(optarg, ':');
 				char *o = next_param(NULL, ':');
+#if PROCESS
+				char *w = next_param(NULL, ':');
+				if (w) outputbuf_16bit = atoi(w) == 16;
+#endif
 				if (s) stream_buf_size = atoi(s) * 1024;
-				if (o) output_buf_size = atoi(o) * 1024;
+				if (o) {
+					if (strchr(o, 's')) {
+						// seconds of headroom at the current track's rate, outputbuf resized at each track start
+						outputbuf_headroom = atoi(o) > 1 ? atoi(o) : 1;
+						output_buf_size = 0;
+					} else {
+						outputbuf_headroom = 0;
+						output_buf_size = atoi(o) * 1024;
+					}
+				}
 			}
 			break;
+		case 'B':
+			buf_policy = 0;
+			if (strstr(optarg, "align"))  buf_policy |= BUF_ALIGN;
+			if (strstr(optarg, "huge"))   buf_policy |= BUF_HUGE;
+			if (strstr(optarg, "lock"))   buf_policy |= BUF_LOCK;
+			if (strstr(optarg, "nodump")) buf_policy |= BUF_NODUMP;
+			break;
+#if LINUX || OSX || FREEBSD
+		case 'H':
+			players_file = optarg;
+			break;
+#endif
 		case 'c':
 			include_codecs = optarg;
 			break;
@@ -522,6 +826,13 @@ int main(int argc, char **argv) {
 		case 's':
 			server = optarg;
 			break;
+#if DSP
+		case 'F':
+			if (dsp_count < sizeof(dsp_stages) / sizeof(dsp_stages[0])) {
+				dsp_stages[dsp_count++] = optarg;
+			}
+			break;
+#endif
 		case 'n':
 			name = optarg;
 			break;
@@ -582,12 +893,25 @@ int main(int argc, char **argv) {
 				}
 			}
 			break;
+		case 'E':
+			dsd_pcm = optarg;
+			break;
 #endif
 #if VISEXPORT
 		case 'v':
 			visexport = true;
 			break;
 #endif
+#if METRICS
+		case 'I':
+			metrics = optarg;
+			break;
+#endif
+#if FLIGHTREC
+		case 'J':
+			flight_dir = optarg;
+			break;
+#endif
 #if ALSA
 		case 'O':
 			mixer_device = optarg;
@@ -646,6 +970,13 @@ int main(int argc, char **argv) {
 					usage(argv[0]);
 					exit(1);
 				}
+#if LINUX || OSX || FREEBSD
+				// multi-player mode - the players drive the relay, not the supervisor
+				if (players_args) {
+					gpio_active = true;
+					break;
+				}
+#endif
 				if (gpio_init()){
 					gpio_active = true;
 					relay(0);
@@ -682,6 +1013,10 @@ int main(int argc, char **argv) {
 				usage(argv[0]);
 				exit(1);
 			}
+#if LINUX || OSX || FREEBSD
+			// multi-player mode - the players run the script, not the supervisor
+			if (players_args) break;
+#endif
 			relay_script(0);
 			break;
 #endif
@@ -726,7 +1061,10 @@ int main(int argc, char **argv) {
 #endif
 
 	// set the output buffer size if not specified on the command line, take account of resampling
-	if (!output_buf_size) {
+	// when sized in seconds start with the headroom at 44.1k, it is then resized at each track start for its rate
+	if (!output_buf_size && outputbuf_headroom) {
+		output_buf_size = outputbuf_headroom * 44100 * (outputbuf_16bit ? BYTES_PER_FRAME / 2 : BYTES_PER_FRAME);
+	} else if (!output_buf_size) {
 		output_buf_size = OUTPUTBUF_SIZE;
 		if (resample) {
 			unsigned scale = 8;
@@ -770,10 +1108,37 @@ int main(int argc, char **argv) {
 	}
 #endif
 
+#if LINUX || OSX || FREEBSD
+	if (players_file && players_args) {
+		decode_preload(log_decode);
+
+		// returns in each forked player, which then starts up with its own command line
+		return players(players_file, players_args, argc, mac, player_argv);
+	}
+#endif
+
 #if WIN
 	winsock_init();
 #endif
 
+#if LOCKPROF
+	lockprof_init();
+#endif
+
+#if ASYNCLOG
+	log_async_init();
+#endif
+
+#if FLIGHTREC
+	flight_init(log_output, flight_dir);
+#endif
+
+#if METRICS
+	if (metrics) {
+		metrics_init(log_slimproto, metrics);
+	}
+#endif
+
 	stream_init(log_stream, stream_buf_size);
 
 	if (!strcmp(output_device, "-")) {
@@ -792,7 +1157,7 @@ int main(int argc, char **argv) {
 	}
 
 #if DSD
-	dsd_init(dsd_outfmt, dsd_delay);
+	dsd_init(dsd_outfmt, dsd_delay, dsd_pcm);
 #endif
 
 #if VISEXPORT
@@ -803,9 +1168,13 @@ int main(int argc, char **argv) {
 
 	decode_init(log_decode, include_codecs, exclude_codecs);
 
-#if RESAMPLE
-	if (resample) {
-		process_init(resample);
+#if DSP
+	if (resample || dsp_count || outputbuf_16bit) {
+		process_init(resample, dsp_stages, dsp_count);
+	}
+#elif RESAMPLE
+	if (resample || outputbuf_16bit) {
+		process_init(resample, NULL, 0);
 	}
 #endif
 
@@ -847,6 +1216,18 @@ int main(int argc, char **argv) {
 	ir_close();
 #endif
 
+#if METRICS
+	metrics_close();
+#endif
+
+#if LOCKPROF
+	lockprof_close();
+#endif
+
+#if ASYNCLOG
+	log_async_close();
+#endif
+
 #if WIN
 	winsock_close();
 #endif
@@ -864,3 +1245,11 @@ int main(int argc, char **argv) {
 
 	exit(0);
 }
+
+int main(int argc, char **argv) {
+	char **player_argv;
+	int player_argc = start(argc, argv, &player_argv);
+
+	// forked player in multi-player mode, its command line has no -H so this runs it until exit
+	return start(player_argc, player_argv, &player_argv);
+}
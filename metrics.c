@@ -0,0 +1,314 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Metrics for monitoring - counters and histograms updated lock free by the player threads and served over http
+// in prometheus text format, eg curl http://127.0.0.1:9483/metrics
+
+#include "squeezelite.h"
+
+#if METRICS
+
+#include <time.h>
+
+#define HIST_BUCKETS  24     // powers of 2 from 1us to 8.4s
+#define FILL_BUCKETS  10     // 10% steps
+#define MAX_THREADS   8
+#define METRICS_BUF   65536
+#define METRICS_PORT  9483
+
+struct hist {
+	u64_t bucket[HIST_BUCKETS + 1]; // last holds values above the largest bucket
+	u64_t sum;                      // us or percent
+};
+
+static struct {
+	const char *name;
+	const char *labels;
+	const char *help;
+} hist_info[MET_HISTS] = {
+	{ "squeezelite_output_wake_late_seconds", "", "Time the alsa output thread woke after a period of device buffer became free" },
+	{ "squeezelite_output_frames_seconds", "", "Duration of each _output_frames call" },
+	{ "squeezelite_mutex_wait_seconds", "mutex=\"outputbuf\",thread=\"output\"", "Time waiting to take a buffer mutex" },
+	{ "squeezelite_mutex_wait_seconds", "mutex=\"outputbuf\",thread=\"decode\"", NULL },
+	{ "squeezelite_mutex_wait_seconds", "mutex=\"streambuf\",thread=\"decode\"", NULL },
+	{ "squeezelite_mutex_wait_seconds", "mutex=\"streambuf\",thread=\"stream\"", NULL },
+};
+
+static struct {
+	const char *labels;
+	const char *help;
+} fill_info[MET_FILLS] = {
+	{ "buffer=\"streambuf\"", "Buffer fill sampled while decoding (streambuf) and playing (outputbuf)" },
+	{ "buffer=\"outputbuf\"", NULL },
+};
+
+static struct {
+	const char *name;
+	const char *help;
+} count_info[MET_COUNTS] = {
+	{ "squeezelite_output_xruns_total", "Output device underruns (alsa xruns, portaudio callback underruns)" },
+	{ "squeezelite_stream_bytes_total", "Bytes received from the stream, rate() gives the network ingest rate" },
+};
+
+static struct hist hists[MET_HISTS];
+static struct hist fills[MET_FILLS];
+static u64_t counts[MET_COUNTS];
+
+// entries are only added by the decode thread, decoder_count is published once the entry is complete
+static struct {
+	const struct codec *codec;
+	struct hist hist;
+} decoders[MAX_CODECS];
+static unsigned decoder_count = 0;
+
+#if LINUX || FREEBSD
+// slots are claimed by fetch_add, name is published once the clock is set
+static struct {
+	const char *name;
+	clockid_t clock;
+} threads[MAX_THREADS];
+static unsigned thread_count = 0;
+#endif
+
+static log_level loglevel;
+
+static int server_fd = -1;
+static pthread_t thread;
+static bool running = true;
+
+static char *buf;
+static size_t len;
+
+void metrics_observe(metric_hist m, u64_t us) {
+	unsigned b = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+	fetch_add(hists[m].bucket[min(b, HIST_BUCKETS)], 1);
+	fetch_add(hists[m].sum, us);
+}
+
+void metrics_decode(const struct codec *codec, u64_t us) {
+	unsigned b = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+	unsigned i;
+
+	for (i = 0; i < decoder_count && decoders[i].codec != codec; ++i);
+
+	if (i == decoder_count) {
+		if (i == MAX_CODECS) return;
+		decoders[i].codec = codec;
+		store_release(decoder_count, i + 1);
+	}
+
+	fetch_add(decoders[i].hist.bucket[min(b, HIST_BUCKETS)], 1);
+	fetch_add(decoders[i].hist.sum, us);
+}
+
+void metrics_fill(metric_fill f, size_t used, size_t size) {
+	unsigned pct = size ? (unsigned)((u64_t)used * 100 / size) : 0;
+	unsigned b = pct ? (pct - 1) / (100 / FILL_BUCKETS) : 0;
+	fetch_add(fills[f].bucket[min(b, FILL_BUCKETS - 1)], 1);
+	fetch_add(fills[f].sum, pct);
+}
+
+void metrics_count(metric_count c, unsigned n) {
+	fetch_add(counts[c], n);
+}
+
+// register the calling thread so its cpu time is reported
+void metrics_thread(const char *name) {
+#if LINUX || FREEBSD
+	unsigned i = fetch_add(thread_count, 1);
+	if (i >= MAX_THREADS) return;
+	if (pthread_getcpuclockid(pthread_self(), &threads[i].clock) == 0) {
+		store_release(threads[i].name, name);
+	}
+#endif
+}
+
+static void out(const char *fmt, ...) {
+	va_list args;
+	int n;
+
+	if (len >= METRICS_BUF) return;
+
+	va_start(args, fmt);
+	n = vsnprintf(buf + len, METRICS_BUF - len, fmt, args);
+	va_end(args);
+
+	if (n > 0) len = min(len + n, METRICS_BUF);
+}
+
+static void out_header(const char *name, const char *type, const char *help) {
+	if (help) out("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// buckets are cumulative in the output, count is their total so the two are always consistent
+static void out_hist(const char *name, const char *labels, struct hist *h, bool fill) {
+	const char *sep = *labels ? "," : "";
+	u64_t total = 0;
+	unsigned b;
+
+	for (b = 0; b < (fill ? FILL_BUCKETS : HIST_BUCKETS); ++b) {
+		total += load_acquire(h->bucket[b]);
+		out("%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, fill ? (b + 1) / (double)FILL_BUCKETS : (double)(1 << b) / 1000000,
+			(unsigned long long)total);
+	}
+	total += load_acquire(h->bucket[HIST_BUCKETS]);
+
+	out("%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)total);
+	out("%s_sum%s%s%s %g\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", load_acquire(h->sum) / (fill ? 100.0 : 1000000.0));
+	out("%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", (unsigned long long)total);
+}
+
+static void render(void) {
+	unsigned i, n;
+
+#if LINUX || FREEBSD
+	out_header("squeezelite_thread_cpu_seconds_total", "counter", "Cpu time used by each player thread");
+	n = min(load_acquire(thread_count), MAX_THREADS);
+	for (i = 0; i < n; ++i) {
+		const char *name = load_acquire(threads[i].name);
+		struct timespec ts;
+		if (name && clock_gettime(threads[i].clock, &ts) == 0) {
+			out("squeezelite_thread_cpu_seconds_total{thread=\"%s\"} %.6f\n", name, ts.tv_sec + ts.tv_nsec / 1e9);
+		}
+	}
+#endif
+
+	for (i = 0; i < MET_COUNTS; ++i) {
+		out_header(count_info[i].name, "counter", count_info[i].help);
+		out("%s %llu\n", count_info[i].name, (unsigned long long)load_acquire(counts[i]));
+	}
+
+	for (i = 0; i < MET_HISTS; ++i) {
+		out_header(hist_info[i].name, "histogram", hist_info[i].help);
+		out_hist(hist_info[i].name, hist_info[i].labels, &hists[i], false);
+	}
+
+	out_header("squeezelite_decode_seconds", "histogram", "Duration of each codec decode call");
+	n = load_acquire(decoder_count);
+	for (i = 0; i < n; ++i) {
+		char labels[64];
+		snprintf(labels, sizeof(labels), "codec=\"%s\"", decoders[i].codec->types);
+		out_hist("squeezelite_decode_seconds", labels, &decoders[i].hist, false);
+	}
+
+	for (i = 0; i < MET_FILLS; ++i) {
+		out_header("squeezelite_buffer_fill_ratio", "histogram", fill_info[i].help);
+		out_hist("squeezelite_buffer_fill_ratio", fill_info[i].labels, &fills[i], true);
+	}
+}
+
+static void *metrics_server(void *arg) {
+	while (running) {
+		struct pollfd pollinfo = { server_fd, POLLIN, 0 };
+		char request[1024];
+		size_t sent = 0;
+		int fd;
+
+		if (poll(&pollinfo, 1, 1000) <= 0 || (fd = accept(server_fd, NULL, NULL)) < 0) {
+			continue;
+		}
+
+		// any request returns the metrics, read it only so the client does not see a reset
+		pollinfo.fd = fd;
+		if (poll(&pollinfo, 1, 1000) > 0) {
+			recv(fd, request, sizeof(request), 0);
+		}
+
+		len = 0;
+		out("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+		render();
+
+		if (len == METRICS_BUF) {
+			LOG_WARN("metrics truncated");
+		}
+
+		while (sent < len) {
+			ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+			if (n <= 0) break;
+			sent += n;
+		}
+
+		LOG_DEBUG("metrics sent: %u bytes", sent);
+		close(fd);
+	}
+
+	return 0;
+}
+
+// [<address>:]<port>, listens on localhost unless an address is given
+void metrics_init(log_level level, char *opt) {
+	struct sockaddr_in addr;
+	pthread_attr_t attr;
+	char *port = strrchr(opt, ':');
+	int on = 1;
+
+	loglevel = level;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(METRICS_PORT);
+
+	if (port) {
+		*port++ = '\0';
+		addr.sin_addr.s_addr = inet_addr(opt);
+	} else {
+		port = opt;
+	}
+	if (atoi(port)) {
+		addr.sin_port = htons(atoi(port));
+	}
+
+	buf = malloc(METRICS_BUF);
+	if (!buf) {
+		LOG_ERROR("unable to malloc metrics buffer");
+		exit(1);
+	}
+
+	server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+
+	if (server_fd < 0 || bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server_fd, 4) < 0) {
+		LOG_ERROR("unable to listen for metrics on %s:%u: %s", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), strerror(errno));
+		if (server_fd >= 0) close(server_fd);
+		server_fd = -1;
+		return;
+	}
+
+	LOG_INFO("metrics on http://%s:%u/metrics", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 32 * 1024);
+	pthread_create(&thread, &attr, metrics_server, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+void metrics_close(void) {
+	if (server_fd < 0) return;
+
+	running = false;
+	pthread_join(thread, NULL);
+	close(server_fd);
+	server_fd = -1;
+	free(buf);
+}
+
+#endif // METRICS
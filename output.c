@@ -32,11 +32,16 @@ static struct buffer buf;
 struct buffer *outputbuf = &buf;
 
 u8_t *silencebuf;
+static u8_t *widebuf;
 #if DSD
 u8_t *silencebuf_dsd;
 #endif
 
 bool user_rates = false;
+unsigned outputbuf_headroom = 0;                  // seconds set by -b ::<secs>s, 0 for a fixed size outputbuf
+bool outputbuf_16bit = false;                     // outputbuf holds 16 bit samples, widened as they are played
+
+static bool drained = false;
 
 #define LOCK   mutex_lock(outputbuf->mutex)
 #define UNLOCK mutex_unlock(outputbuf->mutex)
@@ -53,17 +58,34 @@ frames_t _output_frames(frames_t avail) {
 	
 	s32_t gainL = output.current_replay_gain ? gain(output.gainL, output.current_replay_gain) : output.gainL;
 	s32_t gainR = output.current_replay_gain ? gain(output.gainR, output.current_replay_gain) : output.gainR;
+#if METRICS
+	u64_t start_us = gettime_us();
+#endif
 
 	if (output.invert) { gainL = -gainL; gainR = -gainR; }
 
-	frames = _buf_used(outputbuf) / BYTES_PER_FRAME;
+	frames = _buf_used(outputbuf) / output.frame_bytes;
 	silence = false;
 
+	if (output.state == OUTPUT_RUNNING) {
+		metrics_fill(MET_OUTPUTBUF, _buf_used(outputbuf), outputbuf->size);
+	}
+
+	// outputbuf drained while running - wake slimproto to report it rather than wait for the next status update
+	if (output.state == OUTPUT_RUNNING && !frames) {
+		if (!drained) {
+			drained = true;
+			wake_controller(WAKE_OUTPUT);
+		}
+	} else {
+		drained = false;
+	}
+
 	// start when threshold met
 	if (output.state == OUTPUT_BUFFER && frames > output.threshold * output.next_sample_rate / 10 && frames > output.start_frames) {
 		output.state = OUTPUT_RUNNING;
 		LOG_INFO("start buffer frames: %u", frames);
-		wake_controller();
+		wake_controller(WAKE_OUTPUT);
 	}
 	
 	// skip ahead - consume outputbuf but play nothing
@@ -74,9 +96,9 @@ frames_t _output_frames(frames_t avail) {
 			frames -= skip;
 			output.frames_played += skip;
 			while (skip > 0) {
-				frames_t cont_frames = min(skip, _buf_cont_read(outputbuf) / BYTES_PER_FRAME);
+				frames_t cont_frames = min(skip, _buf_cont_read(outputbuf) / output.frame_bytes);
 				skip -= cont_frames;
-				_buf_inc_readp(outputbuf, cont_frames * BYTES_PER_FRAME);
+				_buf_inc_readp(outputbuf, cont_frames * output.frame_bytes);
 			}
 		}
 		output.state = OUTPUT_RUNNING;
@@ -120,7 +142,7 @@ frames_t _output_frames(frames_t avail) {
 	
 	while (size > 0) {
 		frames_t out_frames;
-		frames_t cont_frames = _buf_cont_read(outputbuf) / BYTES_PER_FRAME;
+		frames_t cont_frames = _buf_cont_read(outputbuf) / output.frame_bytes;
 		int wrote;
 		
 		if (output.track_start && !silence) {
@@ -154,6 +176,13 @@ frames_t _output_frames(frames_t avail) {
 				output.frames_played = 0;
 				output.track_started = true;
 				output.track_start_time = gettime_ms();
+#if DSP
+				drift_track_start();
+#endif
+				wake_controller(WAKE_OUTPUT);
+				if (output.current_sample_rate != output.next_sample_rate) {
+					flight_record(FR_RATE, 0, output.next_sample_rate, output.current_sample_rate, 0);
+				}
 				output.current_sample_rate = output.next_sample_rate;
 				IF_DSD(
 				   output.outfmt = output.next_fmt;
@@ -165,7 +194,7 @@ frames_t _output_frames(frames_t avail) {
 				break;
 			} else if (output.track_start > outputbuf->readp) {
 				// reduce cont_frames so we find the next track start at beginning of next chunk
-				cont_frames = min(cont_frames, (output.track_start - outputbuf->readp) / BYTES_PER_FRAME);
+				cont_frames = min(cont_frames, (output.track_start - outputbuf->readp) / output.frame_bytes);
 			}
 		}
 
@@ -181,29 +210,29 @@ frames_t _output_frames(frames_t avail) {
 					LOG_INFO("fade start reached");
 					output.fade = FADE_ACTIVE;
 				} else if (output.fade_start > outputbuf->readp) {
-					cont_frames = min(cont_frames, (output.fade_start - outputbuf->readp) / BYTES_PER_FRAME);
+					cont_frames = min(cont_frames, (output.fade_start - outputbuf->readp) / output.frame_bytes);
 				}
 			}
 			if (output.fade == FADE_ACTIVE) {
 				// find position within fade
-				frames_t cur_f = outputbuf->readp >= output.fade_start ? (outputbuf->readp - output.fade_start) / BYTES_PER_FRAME : 
-					(outputbuf->readp + outputbuf->size - output.fade_start) / BYTES_PER_FRAME;
-				frames_t dur_f = output.fade_end >= output.fade_start ? (output.fade_end - output.fade_start) / BYTES_PER_FRAME :
-					(output.fade_end + outputbuf->size - output.fade_start) / BYTES_PER_FRAME;
+				frames_t cur_f = outputbuf->readp >= output.fade_start ? (outputbuf->readp - output.fade_start) / output.frame_bytes : 
+					(outputbuf->readp + outputbuf->size - output.fade_start) / output.frame_bytes;
+				frames_t dur_f = output.fade_end >= output.fade_start ? (output.fade_end - output.fade_start) / output.frame_bytes :
+					(output.fade_end + outputbuf->size - output.fade_start) / output.frame_bytes;
 				if (cur_f >= dur_f) {
 					if (output.fade_mode == FADE_INOUT && output.fade_dir == FADE_DOWN) {
 						LOG_INFO("fade down complete, starting fade up");
 						output.fade_dir = FADE_UP;
 						output.fade_start = outputbuf->readp;
-						output.fade_end = outputbuf->readp + dur_f * BYTES_PER_FRAME;
+						output.fade_end = outputbuf->readp + dur_f * output.frame_bytes;
 						if (output.fade_end >= outputbuf->wrap) {
 							output.fade_end -= outputbuf->size;
 						}
 						cur_f = 0;
 					} else if (output.fade_mode == FADE_CROSSFADE) {
 						LOG_INFO("crossfade complete");
-						if (_buf_used(outputbuf) >= dur_f * BYTES_PER_FRAME) {
-							_buf_inc_readp(outputbuf, dur_f * BYTES_PER_FRAME);
+						if (_buf_used(outputbuf) >= dur_f * output.frame_bytes) {
+							_buf_inc_readp(outputbuf, dur_f * output.frame_bytes);
 							LOG_INFO("skipped crossfaded start");
 						} else {
 							LOG_WARN("unable to skip crossfaded start");
@@ -218,7 +247,7 @@ frames_t _output_frames(frames_t avail) {
 				// if fade in progress set fade gain, ensure cont_frames reduced so we get to end of fade at start of chunk
 				if (output.fade) {
 					if (output.fade_end > outputbuf->readp) {
-						cont_frames = min(cont_frames, (output.fade_end - outputbuf->readp) / BYTES_PER_FRAME);
+						cont_frames = min(cont_frames, (output.fade_end - outputbuf->readp) / output.frame_bytes);
 					}
 					if (output.fade_dir == FADE_UP || output.fade_dir == FADE_DOWN) {
 						// fade in, in-out, out handled via altering standard gain
@@ -234,7 +263,7 @@ frames_t _output_frames(frames_t avail) {
 					if (output.fade_dir == FADE_CROSS) {
 						// cross fade requires special treatment - performed later based on these values
 						// support different replay gain for old and new track by retaining old value until crossfade completes
-						if (_buf_used(outputbuf) / BYTES_PER_FRAME > dur_f + size) { 
+						if (_buf_used(outputbuf) / output.frame_bytes > dur_f + size) { 
 							cross_gain_in  = to_gain((float)cur_f / (float)dur_f);
 							cross_gain_out = FIXED_ONE - cross_gain_in;
 							if (output.current_replay_gain) {
@@ -246,7 +275,7 @@ frames_t _output_frames(frames_t avail) {
 							gainL = output.gainL;
 							gainR = output.gainR;
 							if (output.invert) { gainL = -gainL; gainR = -gainR; }
-							cross_ptr = (s32_t *)(output.fade_end + cur_f * BYTES_PER_FRAME);
+							cross_ptr = (s32_t *)(output.fade_end + cur_f * output.frame_bytes);
 						} else {
 							LOG_INFO("unable to continue crossfade - too few samples");
 							output.fade = FADE_INACTIVE;
@@ -264,6 +293,17 @@ frames_t _output_frames(frames_t avail) {
 			}
 		)
 
+		output.playp = outputbuf->readp;
+
+		// outputbuf holding 16 bit samples - widen each chunk for the backend, applying any crossfade as it is widened
+		if (output.frame_bytes != BYTES_PER_FRAME && !silence) {
+			out_frames = min(out_frames, MAX_SILENCE_FRAMES);
+			_widen_frames((s32_t *)(void *)widebuf, outputbuf, out_frames, cross_gain_in, cross_gain_out,
+						  output.fade == FADE_ACTIVE && output.fade_dir == FADE_CROSS ? cross_ptr : NULL);
+			output.playp = widebuf;
+			cross_ptr = NULL;
+		}
+
 		wrote = output.write_cb(out_frames, silence, gainL, gainR, flags, cross_gain_in, cross_gain_out, &cross_ptr);
 
 		if (wrote <= 0) {
@@ -278,30 +318,64 @@ frames_t _output_frames(frames_t avail) {
 		_vis_export(outputbuf, &output, out_frames, silence);
 
 		if (!silence) {
-			_buf_inc_readp(outputbuf, out_frames * BYTES_PER_FRAME);
+			_buf_inc_readp(outputbuf, out_frames * output.frame_bytes);
 			output.frames_played += out_frames;
 		}
 	}
 			
 	LOG_SDEBUG("wrote %u frames", frames);
 
+	_output_publish();
+
+	metrics_observe(MET_OUTPUT_FRAMES, gettime_us() - start_us);
+	flight_record(FR_OUTPUT, silence, avail, frames, _buf_used(outputbuf) / output.frame_bytes);
+
 	return frames;
 }
 
+// seqlock protected copy of output status - written with mutex locked so there is a single writer at a time
+static struct output_status published;
+static u32_t published_seq = 0;
+
+void _output_publish(void) {
+	store_release(published_seq, published_seq + 1);
+	write_fence();
+	published.state = output.state;
+	published.output_full = _buf_used(outputbuf);
+	published.output_size = outputbuf->size;
+	published.frames_played = output.frames_played_dmp;
+	published.device_frames = output.device_frames;
+	published.current_sample_rate = output.current_sample_rate;
+	published.updated = output.updated;
+	published.updated_us = output.updated_us;
+	write_fence();
+	store_release(published_seq, published_seq + 1);
+}
+
+// lock free read of the status last published, retried if an update was in progress
+void output_status(struct output_status *s) {
+	u32_t seq;
+	do {
+		while ((seq = load_acquire(published_seq)) & 1);
+		*s = published;
+		read_fence();
+	} while (seq != load_acquire(published_seq));
+}
+
 void _checkfade(bool start) {
 	frames_t bytes;
 
 	LOG_INFO("fade mode: %u duration: %u %s", output.fade_mode, output.fade_secs, start ? "track-start" : "track-end");
 
-	bytes = output.next_sample_rate * BYTES_PER_FRAME * output.fade_secs;
+	bytes = output.next_sample_rate * output.frame_bytes * output.fade_secs;
 	if (output.fade_mode == FADE_INOUT) {
 		/* align on a frame boundary */
-		bytes = ((bytes / 2) / BYTES_PER_FRAME) * BYTES_PER_FRAME;
+		bytes = ((bytes / 2) / output.frame_bytes) * output.frame_bytes;
 	}
 
 	if (start && (output.fade_mode == FADE_IN || (output.fade_mode == FADE_INOUT && _buf_used(outputbuf) == 0))) {
-		bytes = min(bytes, outputbuf->size - BYTES_PER_FRAME); // shorter than full buffer otherwise start and end align
-		LOG_INFO("fade IN: %u frames", bytes / BYTES_PER_FRAME);
+		bytes = min(bytes, outputbuf->size - output.frame_bytes); // shorter than full buffer otherwise start and end align
+		LOG_INFO("fade IN: %u frames", bytes / output.frame_bytes);
 		output.fade = FADE_DUE;
 		output.fade_dir = FADE_UP;
 		output.fade_start = outputbuf->writep;
@@ -313,7 +387,7 @@ void _checkfade(bool start) {
 
 	if (!start && (output.fade_mode == FADE_OUT || output.fade_mode == FADE_INOUT)) {
 		bytes = min(_buf_used(outputbuf), bytes);
-		LOG_INFO("fade %s: %u frames", output.fade_mode == FADE_INOUT ? "IN-OUT" : "OUT", bytes / BYTES_PER_FRAME);
+		LOG_INFO("fade %s: %u frames", output.fade_mode == FADE_INOUT ? "IN-OUT" : "OUT", bytes / output.frame_bytes);
 		output.fade = FADE_DUE;
 		output.fade_dir = FADE_DOWN;
 		output.fade_start = outputbuf->writep - bytes;
@@ -331,7 +405,7 @@ void _checkfade(bool start) {
 			}
 			bytes = min(bytes, _buf_used(outputbuf));               // max of current remaining samples from previous track
 			bytes = min(bytes, (frames_t)(outputbuf->size * 0.9));  // max of 90% of outputbuf as we consume additional buffer during crossfade
-			LOG_INFO("CROSSFADE: %u frames", bytes / BYTES_PER_FRAME);
+			LOG_INFO("CROSSFADE: %u frames", bytes / output.frame_bytes);
 			output.fade = FADE_DUE;
 			output.fade_dir = FADE_CROSS;
 			output.fade_start = outputbuf->writep - bytes;
@@ -340,7 +414,7 @@ void _checkfade(bool start) {
 			}
 			output.fade_end = outputbuf->writep;
 			output.track_start = output.fade_start;
-		} else if (outputbuf->size == OUTPUTBUF_SIZE && outputbuf->readp == outputbuf->buf) {
+		} else if (!outputbuf_headroom && outputbuf->size == OUTPUTBUF_SIZE && outputbuf->readp == outputbuf->buf) {
 			// if default setting used and nothing in buffer attempt to resize to provide full crossfade support
 			LOG_INFO("resize outputbuf for crossfade");
 			_buf_resize(outputbuf, OUTPUTBUF_SIZE_CROSSFADE);
@@ -351,6 +425,88 @@ void _checkfade(bool start) {
 	}
 }
 
+// called with mutex locked, which is released while the new buffer is allocated and touched and the old one freed so
+// the output thread is only held up for the copy of the contents, which are checked again once the mutex is retaken
+static bool _output_buf_resize(size_t size, unsigned rate) {
+	u8_t **ptrs[] = { &output.track_start, &output.fade_start, &output.fade_end };
+	size_t old = outputbuf->size, mapped;
+	u8_t *mem;
+	bool ok;
+
+	UNLOCK;
+
+	mem = buf_mem_alloc(size, &mapped);
+#if LINUX || FREEBSD
+	if (mem) touch_memory(mem, size);
+#endif
+
+	LOCK;
+
+	if (!mem) return false;
+
+	// fade positions are only live while a fade is pending or running
+	if (output.fade == FADE_INACTIVE) {
+		output.fade_start = output.fade_end = NULL;
+	}
+
+	ok = _buf_swap(outputbuf, &mem, &mapped, size, ptrs, sizeof(ptrs) / sizeof(ptrs[0]));
+
+	UNLOCK;
+	buf_mem_free(mem, mapped);
+	LOCK;
+
+	if (ok) {
+		LOG_INFO("outputbuf resized %u -> %u kB, %.1f secs at %u", (unsigned)(old / 1024), (unsigned)(size / 1024),
+				 (double)size / output.frame_bytes / rate, rate);
+	}
+
+	return ok;
+}
+
+// called in decode thread with mutex locked at the start of each track to size outputbuf for its rate, the mutex is
+// released while a new buffer is allocated
+// growing is done immediately so the crossfade and threshold use the new size, shrinking is left to _output_buf_space
+void _output_buf_target(unsigned rate) {
+	size_t size;
+
+	if (!outputbuf_headroom || !rate) return;
+
+	size = (size_t)(outputbuf_headroom + (output.fade_mode == FADE_CROSSFADE ? output.fade_secs : 0)) * rate * output.frame_bytes;
+	size = size < OUTPUTBUF_SIZE_MIN ? OUTPUTBUF_SIZE_MIN : size > OUTPUTBUF_SIZE_MAX ? OUTPUTBUF_SIZE_MAX : size;
+	size -= size % output.frame_bytes;
+
+	output.buf_target = 0;
+
+	if (size > outputbuf->size) {
+		if (!_output_buf_resize(size, rate)) {
+			LOG_WARN("unable to grow outputbuf to %u kB", (unsigned)(size / 1024));
+		}
+	} else if (size < outputbuf->size / 4 * 3) {
+		LOG_DEBUG("outputbuf shrink to %u kB pending", (unsigned)(size / 1024));
+		output.buf_target = size;
+	}
+}
+
+// called in decode thread with mutex locked between decode calls, returns space available to the decoder
+// a pending shrink is applied once the contents fit, until then the decoder is held back so the buffer drains
+size_t _output_buf_space(void) {
+	size_t space = _buf_space(outputbuf);
+
+	if (output.buf_target) {
+		size_t target = output.buf_target;
+		if (_buf_used(outputbuf) < target && _output_buf_resize(target, output.next_sample_rate)) {
+			output.buf_target = 0;
+			space = _buf_space(outputbuf);
+		} else {
+			size_t excess = outputbuf->size - target;
+			space = _buf_space(outputbuf);
+			space = space > excess ? space - excess : 0;
+		}
+	}
+
+	return space;
+}
+
 void output_init_common(log_level level, const char *device, unsigned output_buf_size, unsigned rates[], unsigned idle) {
 	unsigned i;
 
@@ -372,6 +528,18 @@ void output_init_common(log_level level, const char *device, unsigned output_buf
 	}
 	memset(silencebuf, 0, MAX_SILENCE_FRAMES * BYTES_PER_FRAME);
 
+	output.frame_bytes = BYTES_PER_FRAME;
+
+	if (outputbuf_16bit) {
+		output.frame_bytes = BYTES_PER_FRAME / 2;
+		widebuf = malloc(MAX_SILENCE_FRAMES * BYTES_PER_FRAME);
+		if (!widebuf) {
+			LOG_ERROR("unable to malloc widening buffer");
+			exit(1);
+		}
+		LOG_INFO("outputbuf holds 16 bit samples");
+	}
+
 	IF_DSD(
 		silencebuf_dsd = malloc(MAX_SILENCE_FRAMES * BYTES_PER_FRAME);
 		if (!silencebuf_dsd) {
@@ -430,6 +598,7 @@ void output_init_common(log_level level, const char *device, unsigned output_buf
 void output_close_common(void) {
 	buf_destroy(outputbuf);
 	free(silencebuf);
+	if (widebuf) free(widebuf);
 	IF_DSD(
 		free(silencebuf_dsd);
 	)
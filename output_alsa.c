@@ -59,6 +59,7 @@ static struct {
 	unsigned rate;
 	bool mmap;
 	bool reopen;
+	bool tstamp;
 	u8_t *write_buf;
 	const char *volume_mixer_name;
 	bool mixer_linear;
@@ -81,6 +82,7 @@ static bool running = true;
 
 extern struct outputstate output;
 extern struct buffer *outputbuf;
+extern unsigned buf_policy;
 
 #define LOCK   mutex_lock(outputbuf->mutex)
 #define UNLOCK mutex_unlock(outputbuf->mutex)
@@ -534,6 +536,27 @@ static int alsa_open(const char *device, unsigned sample_rate, unsigned alsa_buf
 		return err;
 	}
 
+	// timestamp each hw pointer update on the monotonic clock so delay and the time it applies to are read together
+	snd_pcm_sw_params_t *sw_params;
+	snd_pcm_sw_params_alloca(&sw_params);
+
+	alsa.tstamp = false;
+	if ((err = snd_pcm_sw_params_current(pcmp, sw_params)) < 0 ||
+		(err = snd_pcm_sw_params_set_tstamp_mode(pcmp, sw_params, SND_PCM_TSTAMP_ENABLE)) < 0) {
+		LOG_DEBUG("unable to enable timestamps: %s", snd_strerror(err));
+	} else {
+#if SND_LIB_VERSION >= 0x01001d
+		if ((err = snd_pcm_sw_params_set_tstamp_type(pcmp, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC)) < 0) {
+			LOG_DEBUG("unable to set monotonic timestamps: %s", snd_strerror(err));
+		} else if ((err = snd_pcm_sw_params(pcmp, sw_params)) < 0) {
+			LOG_DEBUG("unable to set sw params: %s", snd_strerror(err));
+		} else {
+			alsa.tstamp = true;
+		}
+#endif
+	}
+	LOG_DEBUG("device timestamps: %s", alsa.tstamp ? "monotonic" : "none");
+
 	// dump info
 	if (loglevel == lSDEBUG) {
 		static snd_output_t *debug_output;
@@ -579,7 +602,7 @@ static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t g
 		}
 	}
 
-	inputptr = (s32_t *) (silence ? silencebuf : outputbuf->readp);
+	inputptr = (s32_t *) (silence ? silencebuf : output.playp);
 
 	IF_DSD(
 		if (output.outfmt != PCM) {
@@ -604,7 +627,7 @@ static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t g
 		outputptr = (void *)inputptr;
 
 		if (!silence) {
-			_apply_gain(outputbuf, out_frames, gainL, gainR, flags);
+			_apply_gain(inputptr, out_frames, gainL, gainR, flags);
 		}
 	}
 
@@ -646,8 +669,14 @@ static void *output_thread(void *arg) {
 	bool start = true;
 	bool output_off = (output.state == OUTPUT_OFF);
 	bool probe_device = (arg != NULL);
+	snd_pcm_status_t *pcm_status;
 	int err;
 
+	// allocated once here as alloca within the loop would grow the stack on every period
+	snd_pcm_status_alloca(&pcm_status);
+
+	metrics_thread("output");
+
 	while (running) {
 
 		// disabled output - player is off
@@ -713,6 +742,8 @@ static void *output_thread(void *arg) {
 
 		if (state == SND_PCM_STATE_XRUN) {
 			LOG_INFO("XRUN");
+			metrics_count(MET_XRUNS, 1);
+			flight_trigger(FR_XRUN, 0);
 			if ((err = snd_pcm_recover(pcmp, -EPIPE, 1)) < 0) {
 				LOG_INFO("XRUN recover failed: %s", snd_strerror(err));
 				usleep(10000);
@@ -734,6 +765,10 @@ static void *output_thread(void *arg) {
 		snd_pcm_sframes_t avail = snd_pcm_avail_update(pcmp);
 
 		if (avail < 0) {
+			if (avail == -EPIPE) {
+				metrics_count(MET_XRUNS, 1);
+				flight_trigger(FR_XRUN, 0);
+			}
 			if ((err = snd_pcm_recover(pcmp, avail, 1)) < 0) {
 				if (err == -ENODEV) {
 					LOG_INFO("Device %s no longer available", output.device);
@@ -780,6 +815,11 @@ static void *output_thread(void *arg) {
 			continue;
 		}
 
+		// frames beyond a period show how late the thread woke after space became available
+		if (!start) {
+			metrics_observe(MET_OUTPUT_LATE, (u64_t)(avail - alsa.period_size) * 1000000 / alsa.rate);
+		}
+
 		// restrict avail to within sensible limits as alsa drivers can return erroneous large values
 		// in writei mode restrict to period_size due to size of write_buf
 		if (alsa.mmap) {
@@ -795,7 +835,7 @@ static void *output_thread(void *arg) {
 			continue;
 		}
 
-		LOCK;
+		mutex_lock_timed(outputbuf->mutex, MET_WAIT_OUTPUT_O);
 
 		// turn off if requested
 		if (output.state == OUTPUT_OFF) {
@@ -817,25 +857,29 @@ static void *output_thread(void *arg) {
 			continue;
 		}
 
-		// measure output delay
-		snd_pcm_sframes_t delay;
-		if ((err = snd_pcm_delay(pcmp, &delay)) < 0) {
-			if (err == -EPIPE) {
-				// EPIPE indicates underrun - attempt to recover
+		// measure output delay - status gives the delay with the time of the hw pointer update it was derived from
+		if ((err = snd_pcm_status(pcmp, pcm_status)) < 0 || snd_pcm_status_get_state(pcm_status) == SND_PCM_STATE_XRUN) {
+			if (!err) {
+				// underrun - recovered and counted by the state check at the top of the loop
 				UNLOCK;
 				continue;
 			} else if (err == -EIO) {
 				// EIO can occur with non existant pulse server
 				UNLOCK;
-				LOG_SDEBUG("snd_pcm_delay returns: EIO - sleeping");
+				LOG_SDEBUG("snd_pcm_status returns: EIO - sleeping");
 				usleep(100000);
 				continue;
 			} else {
-				LOG_DEBUG("snd_pcm_delay returns: %d", err);
+				LOG_DEBUG("snd_pcm_status returns: %d", err);
 			}
 		} else {
-			output.device_frames = delay;
+			snd_htimestamp_t ts;
+			snd_pcm_status_get_htstamp(pcm_status, &ts);
+			output.device_frames = snd_pcm_status_get_delay(pcm_status);
 			output.updated = gettime_ms();
+			// timestamp is zero until the device is running
+			output.updated_us = alsa.tstamp && (ts.tv_sec || ts.tv_nsec) ?
+				(u64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 : gettime_us();
 			output.frames_played_dmp = output.frames_played;
 		}
 
@@ -994,19 +1038,24 @@ void output_init_alsa(log_level level, const char *device, unsigned output_buf_s
 	}
 
 #if LINUX
-	// RT linux - aim to avoid pagefaults by locking memory: 
-	// https://rt.wiki.kernel.org/index.php/Threaded_RT-application_with_memory_locking_and_stack_handling_example
-	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
-		LOG_INFO("unable to lock memory: %s", strerror(errno));
+	if (buf_policy & BUF_LOCK) {
+		// stream and output buffers are locked individually when allocated, leaving library heaps unlocked
+		LOG_INFO("buffer memory locked");
 	} else {
-		LOG_INFO("memory locked");
-	}
+		// RT linux - aim to avoid pagefaults by locking memory: 
+		// https://rt.wiki.kernel.org/index.php/Threaded_RT-application_with_memory_locking_and_stack_handling_example
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+			LOG_INFO("unable to lock memory: %s", strerror(errno));
+		} else {
+			LOG_INFO("memory locked");
+		}
 
 #ifdef __GLIBC__
-	mallopt(M_TRIM_THRESHOLD, -1);
-	mallopt(M_MMAP_MAX, 0);
-	LOG_INFO("glibc detected using mallopt");
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+		LOG_INFO("glibc detected using mallopt");
 #endif
+	}
 
 	touch_memory(silencebuf, MAX_SILENCE_FRAMES * BYTES_PER_FRAME);
 	touch_memory(outputbuf->buf, outputbuf->size);
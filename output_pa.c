@@ -59,16 +59,37 @@ static unsigned paFramesPerBuffer = 4096;
 static unsigned paNumberOfBuffers = 4;
 #endif /* PA18API */
 
+// staging ring between the feeder thread and the portaudio callback, sized when the stream is opened to hold two
+// callbacks plus the latency target, and at least this many ms at the current sample rate
+#define PA_RING_MS 40
+
 // ouput device
 static struct {
 	unsigned rate;
 	PaStream *stream;
+	// single producer (feeder thread) / single consumer (callback) ring of packed frames
+	// the callback runs in the host api real time context so must not take the output mutex
+	u8_t *ring;
+	unsigned ring_alloc;    // frames allocated
+	unsigned ring_size;     // frames in use for current rate
+	unsigned ring_readp;    // frame index - written by callback only
+	unsigned ring_writep;   // frame index - written by feeder only
+	unsigned active;        // feeder may fill ring
+	unsigned complete;      // set by feeder, callback returns paComplete once ring drained
+	unsigned dac_frames;    // set by callback - frames queued in host api
+	unsigned underruns;     // incremented by callback
 } pa;
 
 static log_level loglevel;
 
 static bool running = true;
 
+static thread_type feeder_thread;
+
+static u8_t *optr;
+
+static frames_t _pa_fill(void);
+
 extern struct outputstate output;
 extern struct buffer *outputbuf;
 
@@ -257,7 +278,7 @@ static void pa_stream_finished(void *userdata) {
 		LOG_INFO("stream finished");
 		LOCK;
 		output.pa_reopen = true;
-		wake_controller();
+		wake_controller(WAKE_OUTPUT);
 		UNLOCK;
 	}
 }
@@ -333,6 +354,12 @@ void _pa_open(void) {
 		}
 	}
 
+	// callback is no longer running so ring can be reset
+	pa.active = 0;
+	pa.complete = 0;
+	pa.dac_frames = 0;
+	pa.ring_readp = pa.ring_writep = 0;
+
 	if (output.state == OUTPUT_OFF) {
 		// we get called when transitioning to OUTPUT_OFF to create the probe thread
 		// set err to avoid opening device and logging messages
@@ -418,6 +445,41 @@ void _pa_open(void) {
 #endif
 		pa.rate = output.current_sample_rate;
 
+		// size ring for this stream, leaving one slot free to distinguish full from empty
+		// v19 callback size is unspecified so may be up to the host latency, pa18 uses fixed size buffers
+		{
+#ifndef PA18API
+			unsigned callback = (unsigned)(Pa_GetStreamInfo(pa.stream)->outputLatency * pa.rate);
+			unsigned target = (unsigned)(outputParameters.suggestedLatency * pa.rate);
+#else
+			unsigned callback = paFramesPerBuffer;
+			unsigned target = 0;
+#endif
+			unsigned size = 2 * callback + target;
+
+			if (size < pa.rate * PA_RING_MS / 1000) {
+				size = pa.rate * PA_RING_MS / 1000;
+			}
+			size += 1;
+
+			if (size > pa.ring_alloc) {
+				u8_t *ring = realloc(pa.ring, size * BYTES_PER_FRAME);
+				if (!ring) {
+					LOG_ERROR("unable to malloc staging ring");
+					exit(1);
+				}
+				pa.ring = ring;
+				pa.ring_alloc = size;
+			}
+			pa.ring_size = size;
+
+			LOG_DEBUG("staging ring: %u frames, callback %u frames", pa.ring_size, callback);
+		}
+		pa.active = 1;
+
+		// prime the ring so the first callbacks have data
+		_pa_fill();
+
 #ifndef PA18API
 		if ((err = Pa_SetStreamFinishedCallback(pa.stream, pa_stream_finished)) != paNoError) {
 			LOG_WARN("error setting finish callback: %s", Pa_GetErrorText(err));
@@ -450,8 +512,6 @@ void _pa_open(void) {
 	output.error_opening = !!err;
 }
 
-static u8_t *optr;
-
 static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t gainR, u8_t flags,
 						 s32_t cross_gain_in, s32_t cross_gain_out, s32_t **cross_ptr) {
 	
@@ -462,17 +522,17 @@ static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t g
 		}
 		
 		if (gainL != FIXED_ONE || gainR!= FIXED_ONE) {
-			_apply_gain(outputbuf, out_frames, gainL, gainR, flags);
+			_apply_gain((s32_t *)(void *)output.playp, out_frames, gainL, gainR, flags);
 		}
 
 		IF_DSD(
 			if (output.outfmt == DOP) {
-				update_dop((u32_t *) outputbuf->readp, out_frames, output.invert);
+				update_dop((u32_t *) output.playp, out_frames, output.invert);
 			} else if (output.outfmt != PCM && output.invert)
-				dsd_invert((u32_t *) outputbuf->readp, out_frames);
+				dsd_invert((u32_t *) output.playp, out_frames);
 		)
 
-		memcpy(optr, outputbuf->readp, out_frames * BYTES_PER_FRAME);
+		memcpy(optr, output.playp, out_frames * BYTES_PER_FRAME);
 
 	} else {
 
@@ -493,59 +553,139 @@ static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t g
 	return (int)out_frames;
 }
 
+// called with mutex locked, fill free space in ring from outputbuf
+static frames_t _pa_fill(void) {
+	unsigned size = pa.ring_size;
+	unsigned readp = load_acquire(pa.ring_readp);
+	unsigned writep = pa.ring_writep;
+	frames_t filled = 0;
+
+	// report delay of frames queued in ring as well as those in the host api
+	output.device_frames = load_acquire(pa.dac_frames) + (writep + size - readp) % size;
+	output.updated = gettime_ms();
+	output.updated_us = gettime_us();
+	output.frames_played_dmp = output.frames_played;
+
+	while (!pa.complete) {
+		frames_t space = (readp + size - writep - 1) % size;
+		frames_t frames;
+
+		if (!space) {
+			break;
+		}
+
+		optr = pa.ring + writep * BYTES_PER_FRAME;
+
+		frames = _output_frames(min(space, size - writep));
+
+		if (!frames) {
+			break;
+		}
+
+		writep = (writep + frames) % size;
+		store_release(pa.ring_writep, writep);
+		filled += frames;
+
+		// stop filling once the stream needs to be reopened, callback completes once ring is drained
+		if (output.state == OUTPUT_OFF) {
+			LOG_INFO("output off");
+			store_release(pa.complete, 1);
+		} else if (pa.rate != output.current_sample_rate) {
+			store_release(pa.complete, 1);
+		}
+	}
+
+	return filled;
+}
+
+// feeder thread - runs _output_frames outside the host api callback so the callback never blocks on the mutex
+static void *pa_feeder(void *arg) {
+	unsigned underruns = 0;
+
+	metrics_thread("output");
+
+	while (running) {
+		frames_t filled = 0;
+
+		LOCK;
+
+		if (pa.active && pa.stream) {
+			filled = _pa_fill();
+
+#ifdef PA18API
+			// pa18 has no stream finished callback, signal reopen once callback has returned paComplete
+			if (pa.complete == 1 && load_acquire(pa.ring_readp) == pa.ring_writep) {
+				pa.complete = 2;
+				if (running) {
+					LOG_INFO("stream finished");
+					output.pa_reopen = true;
+					wake_controller(WAKE_OUTPUT);
+				}
+			}
+#endif
+		}
+
+		UNLOCK;
+
+		if (load_acquire(pa.underruns) != underruns) {
+			metrics_count(MET_XRUNS, load_acquire(pa.underruns) - underruns);
+			flight_trigger(FR_XRUN, 0);
+			underruns = load_acquire(pa.underruns);
+			LOG_DEBUG("callback underruns: %u", underruns);
+		}
+
+		if (!filled) {
+			usleep(PA_RING_MS * 1000 / 4);
+		}
+	}
+
+	return 0;
+}
+
+// host api callback - copies frames from the ring only, must not lock, log or otherwise block
 #ifndef PA18API
 static int pa_callback(const void *pa_input, void *pa_output, unsigned long pa_frames_wanted, 
 					   const PaStreamCallbackTimeInfo *time_info, PaStreamCallbackFlags statusFlags, void *userData) {
 #else
 static int pa_callback(void *pa_input, void *pa_output, unsigned long pa_frames_wanted,PaTimestamp outTime, void *userData) {
 #endif
-	int ret;
-	frames_t frames;
-
-	optr = (u8_t *)pa_output;
-
-	LOCK;
+	u8_t *out = (u8_t *)pa_output;
+	unsigned size = pa.ring_size;
+	unsigned readp = pa.ring_readp;
+	unsigned writep = load_acquire(pa.ring_writep);
+	unsigned dac_frames = 0;
 
 #ifndef PA18API
 	if (time_info->outputBufferDacTime > time_info->currentTime) {
 		// workaround for wdm-ks which can return outputBufferDacTime with a different epoch
-		output.device_frames = (unsigned)((time_info->outputBufferDacTime - time_info->currentTime) * output.current_sample_rate);
-	} else {
-		output.device_frames = 0;
+		dac_frames = (unsigned)((time_info->outputBufferDacTime - time_info->currentTime) * pa.rate);
 	}
-
-#else
-	output.device_frames = 0;
 #endif
-	output.updated = gettime_ms();
-	output.frames_played_dmp = output.frames_played;
+	store_release(pa.dac_frames, dac_frames);
 
-	do {
-		frames = _output_frames(pa_frames_wanted);
+	while (pa_frames_wanted > 0 && readp != writep) {
+		unsigned frames = min(pa_frames_wanted, (writep >= readp ? writep : size) - readp);
+
+		memcpy(out, pa.ring + readp * BYTES_PER_FRAME, frames * BYTES_PER_FRAME);
+		out += frames * BYTES_PER_FRAME;
+		readp = (readp + frames) % size;
 		pa_frames_wanted -= frames;
-	} while (pa_frames_wanted > 0 && frames != 0);
+	}
+
+	store_release(pa.ring_readp, readp);
 
 	if (pa_frames_wanted > 0) {
-		LOG_DEBUG("pad with silence");
-		memset(optr, 0, pa_frames_wanted * BYTES_PER_FRAME);
+		memset(out, 0, pa_frames_wanted * BYTES_PER_FRAME);
+		if (!load_acquire(pa.complete)) {
+			fetch_add(pa.underruns, 1);
+		}
 	}
 
-	if (output.state == OUTPUT_OFF) {
-		LOG_INFO("output off");
-		ret = paComplete;
-	} else if (pa.rate != output.current_sample_rate) {
-		ret = paComplete;
-	} else {
-		ret = paContinue;
+	if (load_acquire(pa.complete) && readp == writep) {
+		return paComplete;
 	}
 
-	UNLOCK;
-
-#ifdef PA18API
-	if ( ret == paComplete )
-		pa_stream_finished (userData);
-#endif
-	return ret;
+	return paContinue;
 }
 
 void output_init_pa(log_level level, const char *device, unsigned output_buf_size, char *params, unsigned rates[], unsigned rate_delay,
@@ -604,11 +744,37 @@ void output_init_pa(log_level level, const char *device, unsigned output_buf_siz
 
 	output_init_common(level, device, output_buf_size, rates, idle);
 
+	// initial staging ring for the highest supported rate, grown if a stream needs more
+	{
+		unsigned i, max_rate = 0;
+		for (i = 0; output.supported_rates[i]; ++i) {
+			if (output.supported_rates[i] > max_rate) max_rate = output.supported_rates[i];
+		}
+		pa.ring_alloc = max_rate * PA_RING_MS / 1000 + 1;
+		pa.ring = malloc(pa.ring_alloc * BYTES_PER_FRAME);
+		if (!pa.ring) {
+			LOG_ERROR("unable to malloc staging ring");
+			exit(1);
+		}
+	}
+
 	LOCK;
 
 	_pa_open();
 
 	UNLOCK;
+
+#if LINUX || OSX || FREEBSD
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + OUTPUT_THREAD_STACK_SIZE);
+	pthread_create(&feeder_thread, &attr, pa_feeder, NULL);
+	pthread_attr_destroy(&attr);
+#endif
+#if WIN
+	feeder_thread = CreateThread(NULL, OUTPUT_THREAD_STACK_SIZE, (LPTHREAD_START_ROUTINE)&pa_feeder, NULL, 0, NULL);
+	SetThreadPriority(feeder_thread, THREAD_PRIORITY_HIGHEST);
+#endif
 }
 
 void output_close_pa(void) {
@@ -620,6 +786,7 @@ void output_close_pa(void) {
 
 	running = false;
 	monitor_thread_running = false;
+	pa.active = 0;
 
 	if (pa.stream) {
 		if ((err = Pa_AbortStream(pa.stream)) != paNoError) {
@@ -633,6 +800,17 @@ void output_close_pa(void) {
 
 	UNLOCK;
 
+#if LINUX || OSX || FREEBSD
+	pthread_join(feeder_thread, NULL);
+#endif
+#if WIN
+	WaitForSingleObject(feeder_thread, INFINITE);
+	CloseHandle(feeder_thread);
+#endif
+
+	free(pa.ring);
+	pa.ring = NULL;
+
 	output_close_common();
 }
 
@@ -375,35 +375,54 @@ void _apply_cross(struct buffer *outputbuf, frames_t out_frames, s32_t cross_gai
 	}
 }
 
+// widen frames from an outputbuf holding 16 bit samples, mixing in the crossfade from cross_ptr if set
+void _widen_frames(s32_t *outptr, struct buffer *outputbuf, frames_t cnt, s32_t cross_gain_in, s32_t cross_gain_out, s32_t *cross_ptr) {
+	s16_t *iptr = (s16_t *)(void *)outputbuf->readp;
+	frames_t count = cnt * 2;
+	if (cross_ptr) {
+		s16_t *cptr = (s16_t *)(void *)cross_ptr;
+		while (count--) {
+			if (cptr >= (s16_t *)(void *)outputbuf->wrap) {
+				cptr -= outputbuf->size / 2;
+			}
+			*(outptr++) = gain(cross_gain_out, *(iptr++) << 16) + gain(cross_gain_in, *(cptr++) << 16);
+		}
+	} else {
+		while (count--) {
+			*(outptr++) = *(iptr++) << 16;
+		}
+	}
+}
+
 #if !WIN
 inline 
 #endif
-void _apply_gain(struct buffer *outputbuf, frames_t count, s32_t gainL, s32_t gainR, u8_t flags) {
+void _apply_gain(s32_t *inputptr, frames_t count, s32_t gainL, s32_t gainR, u8_t flags) {
 	if (gainL == FIXED_ONE && gainR == FIXED_ONE && !(flags & (MONO_LEFT | MONO_RIGHT))) {
 		return;
 	} else if ((flags & MONO_LEFT) && (flags & MONO_RIGHT)) {
-		ISAMPLE_T *ptrL = (ISAMPLE_T *)(void *)outputbuf->readp;
-		ISAMPLE_T *ptrR = (ISAMPLE_T *)(void *)outputbuf->readp + 1;
+		ISAMPLE_T *ptrL = (ISAMPLE_T *)inputptr;
+		ISAMPLE_T *ptrR = (ISAMPLE_T *)inputptr + 1;
 		while (count--) {
 			*ptrL = *ptrR = (gain(gainL, *ptrL) + gain(gainR, *ptrR)) / 2;
 			ptrL += 2; ptrR += 2;
 		}
 
 	} else if (flags & MONO_RIGHT) {
-		ISAMPLE_T *ptr = (ISAMPLE_T *)(void *)outputbuf->readp + 1;
+		ISAMPLE_T *ptr = (ISAMPLE_T *)inputptr + 1;
 		while (count--) {
 			*(ptr - 1) = *ptr = gain(gainR, *ptr);
 			ptr += 2;
 		}
 	} else if (flags & MONO_LEFT) {
-		ISAMPLE_T *ptr = (ISAMPLE_T *)(void *)outputbuf->readp;
+		ISAMPLE_T *ptr = (ISAMPLE_T *)inputptr;
 		while (count--) {
 			*(ptr + 1) = *ptr = gain(gainL, *ptr);
 			ptr += 2;
 		}
 	} else {
-	   	ISAMPLE_T *ptrL = (ISAMPLE_T *)(void *)outputbuf->readp;
-		ISAMPLE_T *ptrR = (ISAMPLE_T *)(void *)outputbuf->readp + 1;
+	   	ISAMPLE_T *ptrL = (ISAMPLE_T *)inputptr;
+		ISAMPLE_T *ptrR = (ISAMPLE_T *)inputptr + 1;
 		while (count--) {
 			*ptrL = gain(gainL, *ptrL);
 			*ptrR = gain(gainR, *ptrR);
@@ -50,8 +50,11 @@ typedef enum {
 	readiness_terminated,
 } pulse_readiness;
 
+// all callbacks run in the threaded mainloop thread with the mainloop lock held
+// other threads must take the mainloop lock before calling into pulse and wait for callbacks to signal
+// lock order is mainloop lock then outputbuf mutex, never the other way around
 typedef struct {
-	pa_mainloop *loop;
+	pa_threaded_mainloop *loop;
 	pa_context *ctx;
 	pulse_readiness readiness;
 } pulse_connection;
@@ -63,6 +66,7 @@ struct pulse {
 	pulse_connection conn;
 	pa_sample_spec sample_spec;
 	char *sink_name;
+	unsigned latency; // target latency in ms, 0 = server default
 };
 
 static struct pulse pulse;
@@ -73,10 +77,14 @@ extern struct outputstate output;
 extern struct buffer *outputbuf;
 
 #define OUTPUT_STATE_TIMER_INTERVAL_USEC   100000
+#define MAX_EMPTY_CALLS 4 // calls of _output_frames returning no frames before a write request is padded with silence
 
 #define LOCK   mutex_lock(outputbuf->mutex)
 #define UNLOCK mutex_unlock(outputbuf->mutex)
 
+#define PULSE_LOCK(conn)   pa_threaded_mainloop_lock((conn)->loop)
+#define PULSE_UNLOCK(conn) pa_threaded_mainloop_unlock((conn)->loop)
+
 extern u8_t *silencebuf;
 
 static void pulse_state_cb(pa_context *c, void *userdata) {
@@ -100,6 +108,8 @@ static void pulse_state_cb(pa_context *c, void *userdata) {
 			conn->readiness = readiness_ready;
 			break;
 	}
+
+	pa_threaded_mainloop_signal(conn->loop, 0);
 }
 
 static inline bool pulse_connection_is_ready(pulse_connection *conn) {
@@ -114,8 +124,9 @@ static inline bool pulse_connection_check_ready(pulse_connection *conn) {
 	return true;
 }
 
-static inline void pulse_connection_iterate(pulse_connection *conn) {
-	pa_mainloop_iterate(conn->loop, 1, NULL);
+// called with mainloop lock held, releases it until a callback signals
+static inline void pulse_connection_wait(pulse_connection *conn) {
+	pa_threaded_mainloop_wait(conn->loop);
 }
 
 static inline pa_context * pulse_connection_get_context(pulse_connection *conn) {
@@ -125,8 +136,8 @@ static inline pa_context * pulse_connection_get_context(pulse_connection *conn)
 static bool pulse_connection_init(pulse_connection *conn) {
 	bool ret;
 	
-	conn->loop = pa_mainloop_new();
-	pa_mainloop_api *api = pa_mainloop_get_api(conn->loop);
+	conn->loop = pa_threaded_mainloop_new();
+	pa_mainloop_api *api = pa_threaded_mainloop_get_api(conn->loop);
 	pa_proplist *proplist = pa_proplist_new();
 	pa_proplist_sets(proplist, PA_PROP_APPLICATION_VERSION, VERSION);
 	conn->ctx = pa_context_new_with_proplist(api, MODEL_NAME_STRING, proplist);
@@ -135,35 +146,49 @@ static bool pulse_connection_init(pulse_connection *conn) {
 	conn->readiness = readiness_unknown;
 
 	bool connected = false;
+	bool started = false;
+
+	pa_context_set_state_callback(conn->ctx, pulse_state_cb, conn);
 
 	if (pa_context_connect(conn->ctx, (const char *)NULL, PA_CONTEXT_NOFLAGS, (const pa_spawn_api *)NULL) < 0) {
 		LOG_ERROR("failed to connect to PulseAudio server: %s", pa_strerror(pa_context_errno(conn->ctx)));
 		ret = false;
+	} else if (pa_threaded_mainloop_start(conn->loop) < 0) {
+		LOG_ERROR("failed to start PulseAudio mainloop");
+		connected = true;
+		ret = false;
 	} else {
 		connected = true;
-		pa_context_set_state_callback(conn->ctx, pulse_state_cb, conn);
+		started = true;
+		PULSE_LOCK(conn);
 		while (conn->readiness == readiness_unknown) {
-			pa_mainloop_iterate(conn->loop, 1, NULL);
+			pulse_connection_wait(conn);
 		}
+		PULSE_UNLOCK(conn);
 
 		ret = pulse_connection_is_ready(conn);
 	}
 
 	if (!ret) {
+		if (started) pa_threaded_mainloop_stop(conn->loop);
 		if (connected) pa_context_disconnect(conn->ctx);
 		pa_context_unref(conn->ctx);
-		pa_mainloop_free(conn->loop);
+		pa_threaded_mainloop_free(conn->loop);
 	}
 
 	return ret;
 }
 
 static void pulse_connection_destroy(pulse_connection *conn) {
+	PULSE_LOCK(conn);
 	pa_context_disconnect(conn->ctx);
+	PULSE_UNLOCK(conn);
+	pa_threaded_mainloop_stop(conn->loop);
 	pa_context_unref(conn->ctx);
-	pa_mainloop_free(conn->loop);
+	pa_threaded_mainloop_free(conn->loop);
 }
 
+// called with mainloop lock held, the operation callback must signal the mainloop
 static bool pulse_operation_wait(pulse_connection *conn, pa_operation *op) {
 	if (op == NULL) {
 		LOG_ERROR("PulseAudio operation failed: %s", pa_strerror(pa_context_errno(conn->ctx)));
@@ -172,7 +197,7 @@ static bool pulse_operation_wait(pulse_connection *conn, pa_operation *op) {
 
 	pa_operation_state_t op_state;
 	while (pulse_connection_check_ready(conn) && (op_state = pa_operation_get_state(op)) == PA_OPERATION_RUNNING) {
-		pulse_connection_iterate(conn);
+		pulse_connection_wait(conn);
 	}
 
 	pa_operation_unref(op);
@@ -198,11 +223,68 @@ static void pulse_stream_state_cb(pa_stream *stream, void *userdata) {
 			p->stream_readiness = readiness_terminated;
 			break;
 	}
+
+	pa_threaded_mainloop_signal(p->conn.loop, 0);
 }
 
-static void pulse_stream_success_noop_cb(pa_stream *s, int success, void *userdata) {
+static u8_t *optr;
+// pulse requests more data - fill pulse's own buffer directly rather than copying via pa_stream_write's internal buffer
+static void pulse_stream_write_cb(pa_stream *stream, size_t nbytes, void *userdata) {
+	while (nbytes >= BYTES_PER_FRAME) {
+		void *data;
+		size_t bytes = nbytes;
+		frames_t frames, wanted, written = 0;
+		unsigned retries = 0;
+
+		if (pa_stream_begin_write(stream, &data, &bytes) < 0 || data == NULL) {
+			LOG_WARN("begin write failed: %s", pa_strerror(pa_context_errno(pulse_connection_get_context(&pulse.conn))));
+			return;
+		}
+
+		wanted = bytes / BYTES_PER_FRAME;
+		optr = data;
+
+		LOCK;
+
+		// no frames are returned by the call reaching a track start or the start of a rate change delay, the
+		// next call returns the track or the delay silence so keep going rather than give up on pulse's request
+		do {
+			frames = _output_frames(wanted - written);
+			written += frames;
+		} while (written < wanted && (frames != 0 || ++retries < MAX_EMPTY_CALLS));
+
+		UNLOCK;
+
+		// pulse will not ask again for bytes already requested, so complete the request with silence
+		if (written < wanted) {
+			memset((u8_t *)data + written * BYTES_PER_FRAME, 0, (wanted - written) * BYTES_PER_FRAME);
+			written = wanted;
+		}
+
+		pa_stream_write(stream, data, written * BYTES_PER_FRAME, (pa_free_cb_t)NULL, 0, PA_SEEK_RELATIVE);
+
+		nbytes -= min(nbytes, written * BYTES_PER_FRAME);
+	}
 }
 
+#if PULSEAUDIO_TIMING > 0
+// timing info has been updated by the server, record delay against frames written so far
+static void pulse_stream_latency_cb(pa_stream *stream, void *userdata) {
+	pa_usec_t usec;
+	int negative;
+
+	if (pa_stream_get_latency(stream, &usec, &negative) == 0) {
+		LOCK;
+		output.device_frames = negative ? 0 : (unsigned)((usec * output.current_sample_rate) / PA_USEC_PER_SEC);
+		output.updated = gettime_ms();
+		output.updated_us = gettime_us();
+		output.frames_played_dmp = output.frames_played;
+		UNLOCK;
+	}
+}
+#endif
+
+// called with mainloop lock held
 static bool pulse_stream_create(struct pulse *p) {
 	p->sample_spec.rate = output.current_sample_rate;
 	p->sample_spec.format = PA_SAMPLE_S32LE; // SqueezeLite internally always uses this format, let PulseAudio deal with eventual resampling.
@@ -219,14 +301,29 @@ static bool pulse_stream_create(struct pulse *p) {
 
 	p->stream_readiness = readiness_unknown;
 	pa_stream_set_state_callback(p->stream, pulse_stream_state_cb, p);
+	pa_stream_set_write_callback(p->stream, pulse_stream_write_cb, p);
+#if PULSEAUDIO_TIMING > 0
+	pa_stream_set_latency_update_callback(p->stream, pulse_stream_latency_cb, p);
+#endif
 
-	if (pa_stream_connect_playback(p->stream, p->sink_name, (const pa_buffer_attr *)NULL,
+	// negotiate buffering from the latency target, server will deliver write callbacks each minreq
+	pa_buffer_attr attr = { 0, };
+	pa_stream_flags_t flags = PA_STREAM_VARIABLE_RATE;
+	attr.maxlength = (uint32_t)(-1);
+	attr.prebuf = (uint32_t)(-1);
+	if (p->latency) {
+		attr.tlength = (uint32_t)pa_usec_to_bytes((pa_usec_t)p->latency * PA_USEC_PER_MSEC, &p->sample_spec);
+		attr.minreq = attr.tlength / 4;
+		flags |= PA_STREAM_ADJUST_LATENCY;
+	} else {
+		attr.tlength = (uint32_t)(-1);
+		attr.minreq = (uint32_t)(-1);
+	}
 #if PULSEAUDIO_TIMING == 2
-		PA_STREAM_VARIABLE_RATE | PA_STREAM_AUTO_TIMING_UPDATE | PA_STREAM_INTERPOLATE_TIMING,
-#else
-		PA_STREAM_VARIABLE_RATE,
+	flags |= PA_STREAM_AUTO_TIMING_UPDATE | PA_STREAM_INTERPOLATE_TIMING;
 #endif
-		(const pa_cvolume *)NULL, (pa_stream *)NULL) < 0) {
+
+	if (pa_stream_connect_playback(p->stream, p->sink_name, &attr, flags, (const pa_cvolume *)NULL, (pa_stream *)NULL) < 0) {
 		pa_stream_unref(p->stream);
 		p->stream = NULL;
 		return false;
@@ -234,19 +331,16 @@ static bool pulse_stream_create(struct pulse *p) {
 
 	bool ok;
 	while ((ok = pulse_connection_check_ready(&p->conn) && p->running) && p->stream_readiness == readiness_unknown) {
-		pulse_connection_iterate(&p->conn);
+		pulse_connection_wait(&p->conn);
 	}
 
 	ok = ok && p->stream_readiness == readiness_ready;
 
 	if (ok) {
-		pa_buffer_attr attr = { 0, };
-		attr.maxlength = (uint32_t)(-1);
-		attr.tlength = (uint32_t)(-1);
-		attr.prebuf = (uint32_t)(-1);
-		attr.minreq = (uint32_t)(-1);
-		pa_operation *op = pa_stream_set_buffer_attr(p->stream, &attr, pulse_stream_success_noop_cb, NULL);
-		ok = pulse_operation_wait(&p->conn, op);
+		const pa_buffer_attr *a = pa_stream_get_buffer_attr(p->stream);
+		if (a) {
+			LOG_INFO("buffer tlength: %u minreq: %u latency target: %u ms", a->tlength, a->minreq, p->latency);
+		}
 	}
 
 	if (!ok) {
@@ -258,8 +352,13 @@ static bool pulse_stream_create(struct pulse *p) {
 	return ok;
 }
 
+// called with mainloop lock held
 static void pulse_stream_destroy(struct pulse *p) {
 	if (p->stream) {
+		pa_stream_set_write_callback(p->stream, NULL, NULL);
+#if PULSEAUDIO_TIMING > 0
+		pa_stream_set_latency_update_callback(p->stream, NULL, NULL);
+#endif
 		pa_stream_disconnect(p->stream);
 		pa_stream_unref(p->stream);
 		p->stream = NULL;
@@ -267,10 +366,14 @@ static void pulse_stream_destroy(struct pulse *p) {
 }
 
 static void pulse_sinklist_cb(pa_context *c, const pa_sink_info *l, int eol, void *userdata) {
+	pulse_connection *conn = userdata;
 	if (eol == 0) {
 		printf("  %-50s %s\n", l->name, l->description);
-	} else if (eol < 0) {
-		LOG_WARN("error while listing PulseAudio sinks");
+	} else {
+		if (eol < 0) {
+			LOG_WARN("error while listing PulseAudio sinks");
+		}
+		pa_threaded_mainloop_signal(conn->loop, 0);
 	}
 }
 
@@ -279,25 +382,17 @@ void list_devices(void) {
 	if (!pulse_connection_init(&conn))
 		return;
 
-	int state = 0;
-	pa_operation *op;
+	PULSE_LOCK(&conn);
 
-	while (pulse_connection_check_ready(&conn)) {
-		if (state == 0)	 {
-			printf("Output devices:\n");
-			op = pa_context_get_sink_info_list(pulse_connection_get_context(&conn), pulse_sinklist_cb, NULL);
-			++state;
-		} else if (pa_operation_get_state(op) == PA_OPERATION_DONE) {
-			pa_operation_unref(op);
-			break;
-		}
+	printf("Output devices:\n");
+	pulse_operation_wait(&conn, pa_context_get_sink_info_list(pulse_connection_get_context(&conn), pulse_sinklist_cb, &conn));
 
-		pulse_connection_iterate(&conn);
-	}
+	PULSE_UNLOCK(&conn);
 
 	pulse_connection_destroy(&conn);
 }
 
+// called with mainloop lock held
 static void pulse_set_volume(struct pulse *p, unsigned left, unsigned right) {
 	uint32_t sink_input_idx = pa_stream_get_index(p->stream);
 	pa_cvolume volume;
@@ -325,11 +420,16 @@ void set_volume(unsigned left, unsigned right) {
 	output.gainR = right;
 	UNLOCK;
 
-	if (adjust_sink_input && pulse.stream != NULL) {
-		pulse_set_volume(&pulse, left, right);
+	if (adjust_sink_input) {
+		PULSE_LOCK(&pulse.conn);
+		if (pulse.stream != NULL) {
+			pulse_set_volume(&pulse, left, right);
+		}
+		PULSE_UNLOCK(&pulse.conn);
 	}
 }
 
+// called from _output_frames within the write callback so mainloop lock is already held
 void set_sample_rate(uint32_t sample_rate) {
 	pa_operation *op = pa_stream_update_sample_rate(pulse.stream, sample_rate, NULL, NULL);
 	if (op != NULL) {
@@ -353,7 +453,10 @@ struct test_open_data {
 };
 
 static void pulse_sinkinfo_cb(pa_context *c, const pa_sink_info *l, int eol, void *userdata) {
-	if (eol) return;
+	if (eol) {
+		pa_threaded_mainloop_signal(pulse.conn.loop, 0);
+		return;
+	}
 
 	struct test_open_data *d = userdata;
 	d->got_device = true;
@@ -371,13 +474,17 @@ static void pulse_sinkinfo_cb(pa_context *c, const pa_sink_info *l, int eol, voi
 
 bool test_open(const char *device, unsigned rates[], bool userdef_rates) {
 	struct test_open_data d = {0, };
+	bool ok;
 	d.rates = rates;
 	d.userdef_rates = userdef_rates;
 	d.sample_spec = &pulse.sample_spec;
 	d.is_default_device = strcmp(device, "default") == 0;
 	const char *sink_name = d.is_default_device ? NULL : device;
+	PULSE_LOCK(&pulse.conn);
 	pa_operation *op = pa_context_get_sink_info_by_name(pulse_connection_get_context(&pulse.conn), sink_name, pulse_sinkinfo_cb, &d);
-	if (!pulse_operation_wait(&pulse.conn, op))
+	ok = pulse_operation_wait(&pulse.conn, op);
+	PULSE_UNLOCK(&pulse.conn);
+	if (!ok)
 		return false;
 	if (!d.got_device)
 		return false;
@@ -389,35 +496,18 @@ bool test_open(const char *device, unsigned rates[], bool userdef_rates) {
 
 static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t gainR, u8_t flags,
 						 s32_t cross_gain_in, s32_t cross_gain_out, s32_t **cross_ptr) {
-	pa_stream_write(pulse.stream, silence ? silencebuf : outputbuf->readp, out_frames * BYTES_PER_FRAME, (pa_free_cb_t)NULL, 0, PA_SEEK_RELATIVE);
+	memcpy(optr, silence ? silencebuf : output.playp, out_frames * BYTES_PER_FRAME);
+	optr += out_frames * BYTES_PER_FRAME;
 	return (int)out_frames;
 }
 
-void output_state_timer_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv_, void *userdata) {
-	struct pulse *p = userdata;
-	pa_context_rttime_restart(pulse_connection_get_context(&p->conn), e, pa_rtclock_now() + OUTPUT_STATE_TIMER_INTERVAL_USEC);
-}
-
-#if PULSEAUDIO_TIMING == 0
-#	define DECLARE_LATENCY(n)			(void)0
-#	define pulse_retrieve_latency(n)	true
-#	define pulse_get_latency(n)			0
-#elif PULSEAUDIO_TIMING == 2
-#	define DECLARE_LATENCY(n)			pa_usec_t n
-	static inline bool pulse_retrieve_latency(pa_usec_t *usec) {
-		return pa_stream_get_latency(pulse.stream, usec, NULL) == 0;
-	}
-#endif
-
-#if PULSEAUDIO_TIMING > 0
-static inline unsigned pulse_get_latency(pa_usec_t usec) {
-	return (unsigned)((usec * output.current_sample_rate) / PA_USEC_PER_SEC);
-}
-#endif
-
+// control thread - opens and closes the stream as output state changes, audio is driven by the write callback
 static void * output_thread(void *arg) {
 	bool output_off = (output.state == OUTPUT_OFF);
-	pa_time_event *output_state_timer = NULL;
+
+	metrics_thread("output");
+
+	PULSE_LOCK(&pulse.conn);
 
 	while (pulse.running) {
 		if (output_off) {
@@ -434,18 +524,7 @@ static void * output_thread(void *arg) {
 				LOG_DEBUG("destroying PulseAudio playback stream");
 				pulse_stream_destroy(&pulse);
 			}
-			
-			if (output_state_timer == NULL) {
-				output_state_timer = pa_context_rttime_new(pulse_connection_get_context(&pulse.conn),
-					pa_rtclock_now() + OUTPUT_STATE_TIMER_INTERVAL_USEC, output_state_timer_cb, &pulse);
-			}
 		} else {
-			if (output_state_timer != NULL) {
-				pa_mainloop_api *api = pa_mainloop_get_api(pulse.conn.loop);
-				api->time_free(output_state_timer);
-				output_state_timer = NULL;
-			}
-			
 			if (pulse.stream == NULL) {
 #if GPIO
 				// Wake up amp
@@ -470,38 +549,24 @@ static void * output_thread(void *arg) {
 						break;
 					output.error_opening = true;
 				}
+			} else if (pulse.stream_readiness == readiness_terminated) {
+				LOG_WARN("PulseAudio playback stream terminated");
+				pulse_stream_destroy(&pulse);
 			}
+		}
 
-			if (pulse.stream != NULL) {
-				size_t writable = pa_stream_writable_size(pulse.stream);
-				if (writable > 0) {
-
-					DECLARE_LATENCY(latency);
-					bool latency_ok = pulse_retrieve_latency(&latency);
-
-					frames_t frame_count = writable / pa_sample_size(pa_stream_get_sample_spec(pulse.stream));
-
-					LOCK;
-
-					if (latency_ok) {
-						output.device_frames = pulse_get_latency(latency);
-						output.updated = gettime_ms();
-						output.frames_played_dmp = output.frames_played;
-					}
-
-					_output_frames(frame_count);
+		PULSE_UNLOCK(&pulse.conn);
 
-					UNLOCK;
-				}
-			}
-		}
+		usleep(OUTPUT_STATE_TIMER_INTERVAL_USEC);
 
-		pulse_connection_iterate(&pulse.conn);
+		PULSE_LOCK(&pulse.conn);
 
 		output_off = (output.state == OUTPUT_OFF);
 	}
 
 	pulse_stream_destroy(&pulse);
+
+	PULSE_UNLOCK(&pulse.conn);
 	
 	return NULL;
 }
@@ -509,6 +574,8 @@ static void * output_thread(void *arg) {
 static pthread_t thread;
 
 void output_init_pulse(log_level level, const char *device, unsigned output_buf_size, char *params, unsigned rates[], unsigned rate_delay, unsigned idle) {
+	char *l = next_param(params, ':');
+
 	loglevel = level;
 
 	LOG_INFO("init output");
@@ -518,6 +585,10 @@ void output_init_pulse(log_level level, const char *device, unsigned output_buf_
 	output.write_cb = &_write_frames;
 	output.rate_delay = rate_delay;
 
+	if (l) pulse.latency = (unsigned)atoi(l);
+
+	LOG_INFO("requested latency: %u", pulse.latency);
+
 	if (!pulse_connection_init(&pulse.conn)) {
 		// In case of an error, the message is logged by the pulse_connection_init itself.
 		exit(1);
@@ -537,8 +608,10 @@ void output_init_pulse(log_level level, const char *device, unsigned output_buf_
 void output_close_pulse(void) {
 	LOG_INFO("close output");
 
+	PULSE_LOCK(&pulse.conn);
 	pulse.running = false;
-	pa_mainloop_wakeup(pulse.conn.loop);
+	pa_threaded_mainloop_signal(pulse.conn.loop, 0);
+	PULSE_UNLOCK(&pulse.conn);
 	pthread_join(thread, NULL);
 
 	if (output.device != pulse.sink_name)
@@ -56,7 +56,7 @@ static int _stdout_write_frames(frames_t out_frames, bool silence, s32_t gainL,
 			_apply_cross(outputbuf, out_frames, cross_gain_in, cross_gain_out, cross_ptr);
 		}
 
-		obuf = outputbuf->readp;
+		obuf = output.playp;
 
 	} else {
 
@@ -100,12 +100,15 @@ static void *output_thread(void *vargp) {
 
 	UNLOCK;
 
+	metrics_thread("output");
+
 	while (running) {
 
-		LOCK;
+		mutex_lock_timed(outputbuf->mutex, MET_WAIT_OUTPUT_O);
 
 		output.device_frames = 0;
 		output.updated = gettime_ms();
+		output.updated_us = gettime_us();
 		output.frames_played_dmp = output.frames_played;
 
 		_output_frames(FRAME_BLOCK);
@@ -96,7 +96,7 @@ void _vis_export(struct buffer *outputbuf, struct outputstate *output, frames_t
 				vis_mmap->running = false;
 			} else {
 				frames_t vis_cnt = out_frames;
-				s32_t *ptr = (s32_t *) outputbuf->readp;
+				s32_t *ptr = (s32_t *) output->playp;
 				unsigned i = vis_mmap->buf_index;
 				
 				if (!output->current_replay_gain) {
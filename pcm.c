@@ -216,7 +216,7 @@ static decode_state pcm_decode(void) {
 		output.track_start = outputbuf->writep;
 		decode.new_stream = false;
 #if DSD
-		if (sample_size == 3 &&
+		if (sample_size == 3 && output.frame_bytes == BYTES_PER_FRAME &&
 			is_stream_dop(((u8_t *)streambuf->readp) + (bigendian?0:2),
 						  ((u8_t *)streambuf->readp) + (bigendian?0:2) + sample_size,
 						  sample_size * channels, bytes / (sample_size * channels))) {
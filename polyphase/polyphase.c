@@ -0,0 +1,406 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// polyphase fir resampler - used when libsoxr is not available
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "polyphase.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define POLYPHASE_SSE 1
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__ARM_NEON)
+#define POLYPHASE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define MAX_TAPS 2048 /* taps per phase, the transition band is widened for larger decimation ratios */
+#define PASSBAND 0.91 /* passband edge as a fraction of the lower nyquist, the transition band runs up to nyquist */
+
+static const struct {
+	double atten;   /* stopband attenuation in dB */
+	double beta;    /* kaiser window parameter */
+} qualities[] = {
+	{  60,  5.65 },
+	{  80,  7.86 },
+	{ 100, 10.06 },
+	{ 120, 12.27 },
+};
+
+struct polyphase_ctx_s {
+	unsigned L, M;          /* interpolation and decimation factors, in:out = M:L */
+	unsigned taps;          /* taps per phase, multiple of 8 */
+	unsigned step_div;      /* M / L */
+	unsigned step_mod;      /* M % L */
+	float *bank;            /* L phases of taps, each coefficient duplicated for l/r */
+	float *hist;            /* interleaved stereo input history */
+	size_t hist_frames;
+	size_t hist_size;
+	size_t index;           /* first history frame of the next output's window */
+	unsigned phase;         /* phase of the next output */
+	unsigned long long in_total;
+	unsigned long long out_total;
+	unsigned long long out_expected;
+	int draining;
+	unsigned long clips;
+};
+
+typedef void (*dot_fn)(const float *c, const float *x, unsigned taps, float *acc);
+
+static dot_fn kernel;
+
+static void dot_c(const float *c, const float *x, unsigned taps, float *acc)
+{
+	float l = 0, r = 0;
+	unsigned j;
+	for (j = 0; j < taps; ++j) {
+		l += c[2*j] * x[2*j];
+		r += c[2*j+1] * x[2*j+1];
+	}
+	acc[0] = l;
+	acc[1] = r;
+}
+
+#if POLYPHASE_SSE
+static void dot_sse(const float *c, const float *x, unsigned taps, float *acc)
+{
+	__m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+	unsigned j;
+	for (j = 0; j < taps * 2; j += 8) {
+		a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(c + j), _mm_loadu_ps(x + j)));
+		a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(c + j + 4), _mm_loadu_ps(x + j + 4)));
+	}
+	a0 = _mm_add_ps(a0, a1);
+	a0 = _mm_add_ps(a0, _mm_movehl_ps(a0, a0));
+	acc[0] = _mm_cvtss_f32(a0);
+	acc[1] = _mm_cvtss_f32(_mm_shuffle_ps(a0, a0, _MM_SHUFFLE(1, 1, 1, 1)));
+}
+
+__attribute__((target("avx")))
+static void dot_avx(const float *c, const float *x, unsigned taps, float *acc)
+{
+	__m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+	__m128 s;
+	unsigned j;
+	for (j = 0; j < taps * 2; j += 16) {
+		a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(c + j), _mm256_loadu_ps(x + j)));
+		a1 = _mm256_add_ps(a1, _mm256_mul_ps(_mm256_loadu_ps(c + j + 8), _mm256_loadu_ps(x + j + 8)));
+	}
+	a0 = _mm256_add_ps(a0, a1);
+	s = _mm_add_ps(_mm256_castps256_ps128(a0), _mm256_extractf128_ps(a0, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	acc[0] = _mm_cvtss_f32(s);
+	acc[1] = _mm_cvtss_f32(_mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));
+}
+#endif
+
+#if POLYPHASE_NEON
+static void dot_neon(const float *c, const float *x, unsigned taps, float *acc)
+{
+	float32x4_t a0 = vdupq_n_f32(0), a1 = vdupq_n_f32(0);
+	float32x2_t s;
+	unsigned j;
+	for (j = 0; j < taps * 2; j += 8) {
+		a0 = vmlaq_f32(a0, vld1q_f32(c + j), vld1q_f32(x + j));
+		a1 = vmlaq_f32(a1, vld1q_f32(c + j + 4), vld1q_f32(x + j + 4));
+	}
+	a0 = vaddq_f32(a0, a1);
+	s = vadd_f32(vget_low_f32(a0), vget_high_f32(a0));
+	acc[0] = vget_lane_f32(s, 0);
+	acc[1] = vget_lane_f32(s, 1);
+}
+#endif
+
+static void select_kernel(void)
+{
+	if (kernel) return;
+	kernel = dot_c;
+#if POLYPHASE_SSE
+	kernel = dot_sse;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx")) kernel = dot_avx;
+#endif
+#if POLYPHASE_NEON
+	kernel = dot_neon;
+#endif
+}
+
+const char *polyphase_kernel_name(void)
+{
+	select_kernel();
+#if POLYPHASE_SSE
+	if (kernel == dot_avx) return "avx";
+	if (kernel == dot_sse) return "sse";
+#endif
+#if POLYPHASE_NEON
+	if (kernel == dot_neon) return "neon";
+#endif
+	return "c";
+}
+
+static unsigned gcd(unsigned a, unsigned b)
+{
+	while (b) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* zeroth order modified bessel function of the first kind */
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	int k;
+	for (k = 1; k < 50; ++k) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < sum * 1e-12) break;
+	}
+	return sum;
+}
+
+/*
+ * kaiser windowed sinc prototype at L * in_rate split into the phase bank
+ * cutoff is placed half a transition band below the lower nyquist so the stopband starts at nyquist,
+ * the transition band is the width the taps allow, from the passband edge unless taps were limited
+ */
+static int design(polyphase_ctx *ctx, unsigned in_rate, unsigned out_rate, double atten, double beta, double scale)
+{
+	unsigned total = ctx->taps * ctx->L;
+	double f_low = in_rate < out_rate ? in_rate : out_rate;
+	double transition = (atten - 8) / (14.36 * ctx->taps) * in_rate;
+	double fc = (f_low - transition) / 2;
+	double fcn = fc / ((double)ctx->L * in_rate);
+	double center = (total - 1) / 2.0;
+	double i0beta = bessel_i0(beta);
+	double *h = malloc(total * sizeof(double));
+	double sum = 0;
+	unsigned k, p, j;
+
+	if (!h) return 0;
+
+	if (fc < f_low * 0.35) {
+		fc = f_low * 0.35;
+		fcn = fc / ((double)ctx->L * in_rate);
+	}
+
+	for (k = 0; k < total; ++k) {
+		double t = k - center;
+		double w = 2 * k / (double)(total - 1) - 1;
+		double sinc = t == 0 ? 1 : sin(2 * M_PI * fcn * t) / (2 * M_PI * fcn * t);
+		h[k] = 2 * fcn * sinc * bessel_i0(beta * sqrt(1 - w * w)) / i0beta;
+		sum += h[k];
+	}
+
+	/* unity gain for each phase, scale folded into the coefficients */
+	for (p = 0; p < ctx->L; ++p) {
+		for (j = 0; j < ctx->taps; ++j) {
+			float c = (float)(h[p + (ctx->taps - 1 - j) * ctx->L] * ctx->L / sum * scale);
+			ctx->bank[(p * ctx->taps + j) * 2] = c;
+			ctx->bank[(p * ctx->taps + j) * 2 + 1] = c;
+		}
+	}
+
+	free(h);
+	return 1;
+}
+
+static int hist_reserve(polyphase_ctx *ctx, size_t frames)
+{
+	if (frames > ctx->hist_size) {
+		size_t size = frames + frames / 2;
+		float *hist = realloc(ctx->hist, size * 2 * sizeof(float));
+		if (!hist) return 0;
+		ctx->hist = hist;
+		ctx->hist_size = size;
+	}
+	return 1;
+}
+
+polyphase_ctx* polyphase_init(unsigned in_rate, unsigned out_rate, int quality, double scale)
+{
+	polyphase_ctx *ctx;
+	unsigned g, taps;
+
+	if (!in_rate || !out_rate) return NULL;
+	if (quality < POLYPHASE_LOW) quality = POLYPHASE_LOW;
+	if (quality > POLYPHASE_VERY_HIGH) quality = POLYPHASE_VERY_HIGH;
+
+	select_kernel();
+
+	g = gcd(in_rate, out_rate);
+
+	/* taps per phase for a transition band from the passband edge to the lower nyquist, kaiser's estimate */
+	taps = (unsigned)ceil((qualities[quality].atten - 8) * in_rate /
+						  (14.36 * (1 - PASSBAND) * (in_rate < out_rate ? in_rate : out_rate) / 2));
+	taps = (taps + 7) & ~7u;
+	if (taps > MAX_TAPS) taps = MAX_TAPS;
+
+	if (out_rate / g > POLYPHASE_MAX_PHASES) return NULL;
+
+	ctx = calloc(1, sizeof(polyphase_ctx));
+	if (!ctx) return NULL;
+
+	ctx->L = out_rate / g;
+	ctx->M = in_rate / g;
+	ctx->taps = taps;
+	ctx->step_div = ctx->M / ctx->L;
+	ctx->step_mod = ctx->M % ctx->L;
+
+	ctx->bank = malloc((size_t)ctx->L * taps * 2 * sizeof(float));
+	if (!ctx->bank || !hist_reserve(ctx, taps * 2 + 4096) ||
+		!design(ctx, in_rate, out_rate, qualities[quality].atten, qualities[quality].beta, scale)) {
+		polyphase_destroy(ctx);
+		return NULL;
+	}
+
+	polyphase_reset(ctx);
+
+	return ctx;
+}
+
+void polyphase_destroy(polyphase_ctx *ctx)
+{
+	free(ctx->bank);
+	free(ctx->hist);
+	free(ctx);
+}
+
+void polyphase_reset(polyphase_ctx *ctx)
+{
+	/* half a filter of leading zeros and starting phase align the output with the input */
+	ctx->hist_frames = ctx->taps / 2;
+	memset(ctx->hist, 0, ctx->hist_frames * 2 * sizeof(float));
+	ctx->index = 0;
+	ctx->phase = ctx->L - 1;
+	ctx->in_total = 0;
+	ctx->out_total = 0;
+	ctx->out_expected = 0;
+	ctx->draining = 0;
+	ctx->clips = 0;
+}
+
+static inline int32_t to_s32(polyphase_ctx *ctx, float f)
+{
+	double v = f;
+	if (v >= 2147483647.0) {
+		ctx->clips++;
+		return 0x7fffffff;
+	}
+	if (v <= -2147483648.0) {
+		ctx->clips++;
+		return -0x7fffffff - 1;
+	}
+	return (int32_t)(v >= 0 ? v + 0.5 : v - 0.5);
+}
+
+static size_t run(polyphase_ctx *ctx, int32_t *out, size_t max_out)
+{
+	size_t n = 0, drop;
+
+	while (n < max_out && ctx->index + ctx->taps <= ctx->hist_frames) {
+		float acc[2];
+
+		if (ctx->draining && ctx->out_total >= ctx->out_expected) break;
+
+		kernel(ctx->bank + (size_t)ctx->phase * ctx->taps * 2, ctx->hist + ctx->index * 2, ctx->taps, acc);
+		*out++ = to_s32(ctx, acc[0]);
+		*out++ = to_s32(ctx, acc[1]);
+		n++;
+		ctx->out_total++;
+
+		ctx->index += ctx->step_div;
+		ctx->phase += ctx->step_mod;
+		if (ctx->phase >= ctx->L) {
+			ctx->phase -= ctx->L;
+			ctx->index++;
+		}
+	}
+
+	/* discard history no longer needed */
+	drop = ctx->index < ctx->hist_frames ? ctx->index : ctx->hist_frames;
+	if (drop) {
+		memmove(ctx->hist, ctx->hist + drop * 2, (ctx->hist_frames - drop) * 2 * sizeof(float));
+		ctx->hist_frames -= drop;
+		ctx->index -= drop;
+	}
+
+	return n;
+}
+
+size_t polyphase_process(polyphase_ctx *ctx, const int32_t *in, size_t in_frames, int32_t *out, size_t max_out)
+{
+	float *h;
+	size_t i;
+
+	if (!hist_reserve(ctx, ctx->hist_frames + in_frames)) {
+		return 0;
+	}
+
+	h = ctx->hist + ctx->hist_frames * 2;
+	for (i = 0; i < in_frames * 2; ++i) {
+		h[i] = (float)in[i];
+	}
+	ctx->hist_frames += in_frames;
+	ctx->in_total += in_frames;
+
+	return run(ctx, out, max_out);
+}
+
+size_t polyphase_drain(polyphase_ctx *ctx, int32_t *out, size_t max_out)
+{
+	if (!ctx->draining) {
+		/* pad with zeros to flush the filter, output is limited to the length of the input */
+		if (!hist_reserve(ctx, ctx->hist_frames + ctx->taps)) {
+			return 0;
+		}
+		memset(ctx->hist + ctx->hist_frames * 2, 0, ctx->taps * 2 * sizeof(float));
+		ctx->hist_frames += ctx->taps;
+		ctx->out_expected = (ctx->in_total * ctx->L + ctx->M - 1) / ctx->M;
+		ctx->draining = 1;
+	}
+
+	return run(ctx, out, max_out);
+}
+
+unsigned long polyphase_clips(polyphase_ctx *ctx)
+{
+	return ctx->clips;
+}
+
+unsigned polyphase_taps(polyphase_ctx *ctx)
+{
+	return ctx->taps;
+}
+
+unsigned polyphase_phases(polyphase_ctx *ctx)
+{
+	return ctx->L;
+}
@@ -0,0 +1,97 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef POLYPHASE_H_INCLUDED
+#define POLYPHASE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Rational ratio polyphase FIR resampler for interleaved stereo 32 bit samples.
+ * The in:out ratio is reduced to L/M and a Kaiser windowed sinc prototype is
+ * split into L phases which are precomputed when the context is created.
+ */
+
+/* passband to 91% of the lower nyquist for all qualities, as soxr, taps depend on the ratio */
+#define POLYPHASE_LOW       0 /* ~ 60dB stopband */
+#define POLYPHASE_MEDIUM    1 /* ~ 80dB stopband */
+#define POLYPHASE_HIGH      2 /* ~ 100dB stopband */
+#define POLYPHASE_VERY_HIGH 3 /* ~ 120dB stopband */
+
+#define POLYPHASE_MAX_PHASES 2048 /* larger L (unusual rate pairs) are not supported */
+
+struct polyphase_ctx_s;
+
+typedef struct polyphase_ctx_s polyphase_ctx;
+
+/**
+ * creates a resampler for in_rate -> out_rate with the given quality, scale is applied
+ * to the output (eg for attenuation), returns NULL if the ratio is not supported or out of memory
+ */
+extern polyphase_ctx* polyphase_init(unsigned in_rate, unsigned out_rate, int quality, double scale);
+
+/**
+ * deinitializes and destroys a polyphase context
+ */
+extern void polyphase_destroy(polyphase_ctx *ctx);
+
+/**
+ * clears history so the context can be used for a new stream, filter bank is kept
+ */
+extern void polyphase_reset(polyphase_ctx *ctx);
+
+/**
+ * resamples in_frames stereo frames into at most max_out frames, returns the number of
+ * frames written. All input is accepted, any not yet processed is held for the next call.
+ */
+extern size_t polyphase_process(polyphase_ctx *ctx, const int32_t *in, size_t in_frames, int32_t *out, size_t max_out);
+
+/**
+ * flushes the filter at the end of a stream, returns frames written, 0 once complete
+ */
+extern size_t polyphase_drain(polyphase_ctx *ctx, int32_t *out, size_t max_out);
+
+/**
+ * number of output samples clipped since the last reset
+ */
+extern unsigned long polyphase_clips(polyphase_ctx *ctx);
+
+/**
+ * taps per phase and number of phases of the filter bank
+ */
+extern unsigned polyphase_taps(polyphase_ctx *ctx);
+extern unsigned polyphase_phases(polyphase_ctx *ctx);
+
+/**
+ * name of the dot product kernel selected for this cpu
+ */
+extern const char *polyphase_kernel_name(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* include guard POLYPHASE_H_INCLUDED */
@@ -29,6 +29,7 @@ extern log_level loglevel;
 
 extern struct buffer *outputbuf;
 extern struct decodestate decode;
+extern struct outputstate output;
 struct processstate process;
 extern struct codec *codec;
 
@@ -37,9 +38,29 @@ extern struct codec *codec;
 #define LOCK_O   mutex_lock(outputbuf->mutex)
 #define UNLOCK_O mutex_unlock(outputbuf->mutex)
 
-// macros to map to processing functions - currently only resample.c
-// this can be made more generic when multiple processing mechanisms get added
+#define MAX_STAGES 8
+
+static struct process_stage *stages[MAX_STAGES];
+static unsigned nstages;
+
+// 16 bit outputbuf - streams with samples using more than 16 bits are dithered when narrowed, 16 bit streams are exact
+static bool narrow_dither;
+static u32_t dither_seed = 1;
+
+static inline s32_t dither_rand(void) {
+	dither_seed = dither_seed * 1664525 + 1013904223;
+	return (s32_t)(dither_seed >> 16);
+}
+
 #if RESAMPLE
+// the resampler is the stage which changes rate - resample.c or resample_fir.c
+#if NO_SOXR
+#define SAMPLES_FUNC fir_samples
+#define DRAIN_FUNC   fir_drain
+#define NEWSTREAM_FUNC fir_newstream
+#define FLUSH_FUNC   fir_flush
+#define INIT_FUNC    fir_init
+#else
 #define SAMPLES_FUNC resample_samples
 #define DRAIN_FUNC   resample_drain
 #define NEWSTREAM_FUNC resample_newstream
@@ -47,29 +68,80 @@ extern struct codec *codec;
 #define INIT_FUNC    resample_init
 #endif
 
+static bool resample_stage_newstream(struct process_stage *stage, struct processstate *process, unsigned supported_rates[]) {
+	return NEWSTREAM_FUNC(process, process->in_sample_rate, supported_rates);
+}
+
+static void resample_stage_samples(struct process_stage *stage, struct processstate *process) {
+	SAMPLES_FUNC(process);
+}
+
+static bool resample_stage_drain(struct process_stage *stage, struct processstate *process) {
+	return DRAIN_FUNC(process);
+}
+
+static void resample_stage_flush(struct process_stage *stage) {
+	FLUSH_FUNC();
+}
+
+static struct process_stage *register_resample(char *opt) {
+	static struct process_stage ret = {
+		"resample",                // name
+		false,                     // in_place
+		resample_stage_newstream,  // newstream
+		resample_stage_samples,    // samples
+		resample_stage_drain,      // drain
+		resample_stage_flush,      // flush
+	};
+
+	return INIT_FUNC(opt) ? &ret : NULL;
+}
+#endif
 
 // transfer all processed frames to the output buf
-static void _write_samples(void) {
-	frames_t frames = process.out_frames;
-	u32_t *iptr   = (u32_t *)process.outbuf;
+static void _write_samples(u8_t *buf, frames_t frames) {
+	u32_t *iptr   = (u32_t *)buf;
 	unsigned cnt  = 10;
 
 	LOCK_O;
 
 	while (frames > 0) {
 
-		frames_t f = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
+		frames_t f = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / output.frame_bytes;
 		u32_t *optr = (u32_t *)outputbuf->writep;
 
 		if (f > 0) {
 
 			f = min(f, frames);
 			
-			memcpy(optr, iptr, f * BYTES_PER_FRAME);
+			if (output.frame_bytes == BYTES_PER_FRAME) {
+				memcpy(optr, iptr, f * BYTES_PER_FRAME);
+			} else {
+				// outputbuf holds 16 bit samples
+				s16_t *optr16 = (s16_t *)(void *)optr;
+				s32_t *iptr32 = (s32_t *)iptr;
+				frames_t count = f * 2;
+				if (!narrow_dither) {
+					while (count && !(*iptr32 & 0xffff)) {
+						*(optr16++) = *(iptr32++) >> 16;
+						count--;
+					}
+					if (count) {
+						LOG_WARN("stream has more than 16 bits, narrowing to 16 bit outputbuf with tpdf dither");
+						narrow_dither = true;
+					}
+				}
+				// tpdf dither of +/- 1 lsb of the 16 bit sample
+				while (count--) {
+					s64_t sample = (s64_t)*(iptr32++) + dither_rand() + dither_rand() - 0xffff + 0x8000;
+					sample >>= 16;
+					*(optr16++) = sample > 32767 ? 32767 : sample < -32768 ? -32768 : (s16_t)sample;
+				}
+			}
 			
 			frames -= f;
 			
-			_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
+			_buf_inc_writep(outputbuf, f * output.frame_bytes);
 			iptr += f * BYTES_PER_FRAME / sizeof(*iptr);
 
 		} else if (cnt--) {
@@ -91,55 +163,153 @@ static void _write_samples(void) {
 	UNLOCK_O;
 }
 
+// buffer which an in place stage works on - output of the previous rate changing stage or the input buffer
+static u8_t *_stage_buf(unsigned i, unsigned *max_frames) {
+	while (i-- > 0) {
+		if (stages[i]->active && !stages[i]->in_place) {
+			*max_frames = stages[i]->max_frames;
+			return stages[i]->buf;
+		}
+	}
+	*max_frames = process.max_in_frames;
+	return process.inbuf;
+}
+
+// run active stages from first onwards over frames in buf and transfer the result to the output buf
+static void _run_stages(unsigned first, u8_t *buf, frames_t frames) {
+	struct processstate p = process;
+	unsigned i;
+
+	for (i = first; i < nstages; i++) {
+		struct process_stage *s = stages[i];
+
+		if (!s->active) continue;
+
+		p.inbuf = buf;
+		p.in_frames = frames;
+
+		if (s->in_place) {
+			s->samples(s, &p);
+		} else {
+			p.outbuf = s->buf;
+			p.max_out_frames = s->max_frames;
+			p.out_frames = 0;
+			s->samples(s, &p);
+			buf = s->buf;
+			frames = p.out_frames;
+		}
+	}
+
+	process.total_in = p.total_in;
+	process.total_out = p.total_out;
+
+	_write_samples(buf, frames);
+}
+
 // process samples - called with decode mutex set
 void process_samples(void) {
 
-	SAMPLES_FUNC(&process);
-
-	_write_samples();
+	_run_stages(0, process.inbuf, process.in_frames);
 
 	process.in_frames = 0;
 }
 
 // drain at end of track - called with decode mutex set
+// each stage with a drain function is drained in turn, its output passing through the following stages
 void process_drain(void) {
-	bool done;
+	unsigned i;
+
+	for (i = 0; i < nstages; i++) {
+		struct process_stage *s = stages[i];
+		bool done;
+
+		if (!s->active || !s->drain) continue;
+
+		do {
+
+			struct processstate p = process;
 
-	do {
+			if (s->in_place) {
+				p.outbuf = _stage_buf(i, &p.max_out_frames);
+			} else {
+				p.outbuf = s->buf;
+				p.max_out_frames = s->max_frames;
+			}
+			p.out_frames = 0;
 
-		done = DRAIN_FUNC(&process);
+			done = s->drain(s, &p);
 
-		_write_samples();
+			process.total_out = p.total_out;
 
-	} while (!done);
+			_run_stages(i + 1, p.outbuf, p.out_frames);
+
+		} while (!done);
+	}
 
 	LOG_DEBUG("processing track complete - frames in: %lu out: %lu", process.total_in, process.total_out);
 }	
 
 // new stream - called with decode mutex set
 unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supported_rates[]) {
+	unsigned rate = raw_sample_rate;
+	unsigned max_in_frames = codec->min_space / BYTES_PER_FRAME;
+	unsigned max_frames = max_in_frames;
+	bool active = false;
+	unsigned i;
 
-	bool active = NEWSTREAM_FUNC(&process, raw_sample_rate, supported_rates);
+	process.in_frames = process.out_frames = 0;
+	narrow_dither = false;
+	process.total_in = process.total_out = 0;
 
-	LOG_INFO("processing: %s", active ? "active" : "inactive");
+	for (i = 0; i < nstages; i++) {
+		struct process_stage *s = stages[i];
 
-	*direct = !active;
+		process.in_sample_rate = process.out_sample_rate = rate;
 
-	if (active) {
+		s->active = s->newstream(s, &process, supported_rates);
 
-		unsigned max_in_frames, max_out_frames;
+		LOG_DEBUG("stage %s: %s", s->name, s->active ? "active" : "inactive");
 
-		process.in_frames = process.out_frames = 0;
-		process.total_in = process.total_out = 0;
+		if (!s->active) continue;
 
-		max_in_frames = codec->min_space / BYTES_PER_FRAME ;
+		active = true;
 
-		// increase size of output buffer by 10% as output rate is not an exact multiple of input rate
-		if (process.out_sample_rate % process.in_sample_rate == 0) {
-			max_out_frames = max_in_frames * (process.out_sample_rate / process.in_sample_rate);
-		} else {
-			max_out_frames = (int)(1.1 * (float)max_in_frames * (float)process.out_sample_rate / (float)process.in_sample_rate);
+		if (!s->in_place) {
+
+			unsigned out_rate = process.out_sample_rate;
+
+			// increase size of output buffer by 10% as output rate is not an exact multiple of input rate
+			// or the stage varies its rate around the input rate
+			if (out_rate % rate == 0 && out_rate != rate) {
+				max_frames = max_frames * (out_rate / rate);
+			} else {
+				max_frames = (int)(1.1 * (float)max_frames * (float)out_rate / (float)rate);
+			}
+
+			if (s->max_frames != max_frames) {
+				LOG_DEBUG("creating %s buf frames: %u", s->name, max_frames);
+				if (s->buf) free(s->buf);
+				s->buf = malloc(max_frames * BYTES_PER_FRAME);
+				s->max_frames = max_frames;
+			}
+
+			if (!s->buf) {
+				LOG_ERROR("malloc fail creating process buffers");
+				s->max_frames = 0;
+				*direct = true;
+				return raw_sample_rate;
+			}
+
+			rate = out_rate;
 		}
+	}
+
+	LOG_INFO("processing: %s", active ? "active" : "inactive");
+
+	// a 16 bit outputbuf is always written via process buffers so the decoders only produce 32 bit samples
+	*direct = !active && output.frame_bytes == BYTES_PER_FRAME;
+
+	if (!*direct) {
 
 		if (process.max_in_frames != max_in_frames) {
 			LOG_DEBUG("creating process buf in frames: %u", max_in_frames);
@@ -147,21 +317,20 @@ unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supp
 			process.inbuf = malloc(max_in_frames * BYTES_PER_FRAME);
 			process.max_in_frames = max_in_frames;
 		}
-		
-		if (process.max_out_frames != max_out_frames) {
-			LOG_DEBUG("creating process buf out frames: %u", max_out_frames);
-			if (process.outbuf) free(process.outbuf);
-			process.outbuf = malloc(max_out_frames * BYTES_PER_FRAME);
-			process.max_out_frames = max_out_frames;
-		}
-		
-		if (!process.inbuf || !process.outbuf) {
+
+		if (!process.inbuf) {
 			LOG_ERROR("malloc fail creating process buffers");
+			process.max_in_frames = 0;
 			*direct = true;
 			return raw_sample_rate;
 		}
-		
-		return process.out_sample_rate;
+
+		// space the decoder needs in the output buf for one call
+		process.max_out_frames = max_frames;
+		process.in_sample_rate = raw_sample_rate;
+		process.out_sample_rate = rate;
+
+		return rate;
 	}
 
 	return raw_sample_rate;
@@ -169,24 +338,136 @@ unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supp
 
 // process flush - called with decode mutex set
 void process_flush(void) {
+	unsigned i;
 
 	LOG_INFO("process flush");
 
-	FLUSH_FUNC();
+	for (i = 0; i < nstages; i++) {
+		stages[i]->flush(stages[i]);
+	}
 
 	process.in_frames = 0;
 }
 
-// init - called with no mutex
-void process_init(char *opt) {
+// choose output rate for resampling, shared by the resamplers
+// exception = only resample if the raw rate is not supported, max_rate = resample to max rate of device
+unsigned process_resample_rate(unsigned raw_sample_rate, unsigned supported_rates[], bool exception, bool max_rate) {
+	unsigned outrate = 0;
+	int i;
+
+	if (exception) {
+		// find direct match - avoid resampling
+		for (i = 0; supported_rates[i]; i++) {
+			if (raw_sample_rate == supported_rates[i]) {
+				outrate = raw_sample_rate;
+				break;
+			}
+		}
+		// else find next highest sync sample rate
+		while (!outrate && i >= 0) {
+			if (supported_rates[i] > raw_sample_rate && supported_rates[i] % raw_sample_rate == 0) {
+				outrate = supported_rates[i];
+				break;
+			}
+			i--;
+		}
+	}
+
+	if (!outrate) {
+		if (max_rate) {
+			// resample to max rate for device
+			outrate = supported_rates[0];
+		} else {
+			// resample to max sync sample rate
+			for (i = 0; supported_rates[i]; i++) {
+				if (supported_rates[i] % raw_sample_rate == 0 || raw_sample_rate % supported_rates[i] == 0) {
+					outrate = supported_rates[i];
+					break;
+				}
+			}
+		}
+		if (!outrate) {
+			outrate = supported_rates[0];
+		}
+	}
+
+	return outrate;
+}
+
+static void add_stage(struct process_stage *s) {
+	if (s && nstages < MAX_STAGES) {
+		LOG_INFO("adding stage: %s", s->name);
+		stages[nstages++] = s;
+	} else if (s) {
+		LOG_WARN("too many stages, ignoring: %s", s->name);
+	}
+}
 
-	bool enabled = INIT_FUNC(opt);
+// init - called with no mutex
+// stage_opts are <name>=<params> in processing order, the resampler is first unless positioned by "resample"
+void process_init(char *resample_opt, char *stage_opts[], unsigned n) {
+#if RESAMPLE
+	bool resample_placed = false;
+	bool fade_resample = false;
+#endif
+	unsigned i;
 
 	memset(&process, 0, sizeof(process));
 
-	if (enabled) {
+#if RESAMPLE
+	// C in recipe = resample to allow crossfade between tracks at different rates
+	if (resample_opt) {
+		char *c = strchr(resample_opt, 'C');
+		fade_resample = c && c < resample_opt + strcspn(resample_opt, ":");
+	}
+	for (i = 0; i < n; i++) {
+		if (!strcmp(stage_opts[i], "resample")) resample_placed = true;
+	}
+	if (resample_opt && !resample_placed) {
+		add_stage(register_resample(resample_opt));
+	}
+#endif
+
+	for (i = 0; i < n; i++) {
+		char *name = stage_opts[i];
+		char *opt = strchr(name, '=');
+
+		if (opt) {
+			*opt++ = '\0';
+		}
+
+		if (!strcmp(name, "resample")) {
+#if RESAMPLE
+			if (resample_opt) {
+				add_stage(register_resample(resample_opt));
+			}
+#endif
+#if DSP
+		} else if (!strcmp(name, "eq") || !strcmp(name, "eql") || !strcmp(name, "eqr")) {
+			add_stage(register_eq(name, opt));
+		} else if (!strcmp(name, "delay") || !strcmp(name, "gain")) {
+			add_stage(register_delay(name, opt));
+		} else if (!strcmp(name, "conv")) {
+			add_stage(register_conv(name, opt));
+		} else if (!strcmp(name, "drift")) {
+			add_stage(register_drift(name, opt));
+#endif
+		} else {
+			LOG_WARN("unknown processing stage: %s", name);
+		}
+	}
+
+	if (nstages || output.frame_bytes != BYTES_PER_FRAME) {
 		LOCK_D;
 		decode.process = true;
+#if RESAMPLE
+		for (i = 0; i < nstages; i++) {
+			if (!strcmp(stages[i]->name, "resample")) decode.fade_resample = fade_resample;
+		}
+		if (decode.fade_resample) {
+			LOG_INFO("resampling for crossfade between rates");
+		}
+#endif
 		UNLOCK_D;
 	}
 }
@@ -19,19 +19,61 @@
  *
  */
 
-// upsampling using libsoxr - only included if RESAMPLE set
+// upsampling using libsoxr - only included if RESAMPLE set and not NO_SOXR
+// falls back to the built in resampler in resample_fir.c if libsoxr cannot be loaded
 
 #include "squeezelite.h"
 
-#if RESAMPLE
+#if RESAMPLE && !NO_SOXR
 
 #include <math.h>
 #include <soxr.h>
 
 extern log_level loglevel;
 
+#define CACHE_SIZE 4 // soxr instances kept for reuse at track boundaries
+#define RESAMPLE_THREAD_STACK_SIZE 128 * 1024
+
+// cached resampler, key is everything passed to soxr_create
+struct soxr_cache {
+	soxr_t resampler[2];        // stereo instance, or one mono instance per channel if parallel
+	unsigned in_rate;
+	unsigned out_rate;
+	unsigned long q_recipe;
+	unsigned long q_flags;
+	double q_precision;
+	double q_phase_response;
+	u32_t last_used;
+	u32_t setup_us;             // soxr_create plus the first soxr_process, measured when the entry is created
+	unsigned hits;
+};
+
+// per channel state for parallel resampling
+struct soxr_channel {
+	s32_t *in;
+	s32_t *out;
+	size_t in_size;
+	size_t out_size;
+	size_t odone;
+	soxr_error_t error;
+};
+
 struct soxr {
-	soxr_t resampler;
+	soxr_t resampler[2];
+	struct soxr_cache cache[CACHE_SIZE];
+	struct soxr_cache *timing;  // entry whose set up is being timed until the first soxr_process completes
+	u32_t timing_us;            // soxr_create or soxr_clear time, the first soxr_process is added to it
+	bool timing_reused;
+	bool parallel;              // resample each channel with its own mono instance, second channel on a worker thread
+	struct soxr_channel chan[2];
+#if LINUX || OSX || FREEBSD
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct processstate *job;   // block for worker, drain if inbuf is NULL
+	unsigned long posted, done;
+	bool threaded;
+#endif
 	size_t old_clips;
 	unsigned long q_recipe;
 	unsigned long q_flags;
@@ -42,6 +84,7 @@ struct soxr {
 	double scale;
 	bool max_rate;
 	bool exception;
+	bool fir;                   // libsoxr not available, using resample_fir.c
 #if !LINKALL
 	// soxr symbols to be dynamically loaded
 	soxr_io_spec_t (* soxr_io_spec)(soxr_datatype_t itype, soxr_datatype_t otype);
@@ -49,6 +92,7 @@ struct soxr {
 	soxr_t (* soxr_create)(double, double, unsigned, soxr_error_t *, 
 						   soxr_io_spec_t const *, soxr_quality_spec_t const *, soxr_runtime_spec_t const *);
 	void (* soxr_delete)(soxr_t);
+	soxr_error_t (* soxr_clear)(soxr_t);
 	soxr_error_t (* soxr_process)(soxr_t, soxr_in_t, size_t, size_t *, soxr_out_t, size_t olen, size_t *);
 	size_t *(* soxr_num_clips)(soxr_t);
 #if RESAMPLE_MP
@@ -67,16 +111,157 @@ static struct soxr *r;
 #endif
 
 
+// resample one channel of the block with its mono instance, de-interleaving input and re-interleaving output
+// drain if process->inbuf is NULL
+static void channel_process(int c, struct processstate *process) {
+	struct soxr_channel *ch = &r->chan[c];
+	frames_t in_frames = process->inbuf ? process->in_frames : 0;
+	size_t idone, i;
+	s32_t *ptr;
+
+	if (ch->in_size < in_frames || ch->out_size < process->max_out_frames) {
+		free(ch->in);
+		free(ch->out);
+		ch->in_size = in_frames > ch->in_size ? in_frames : ch->in_size;
+		ch->out_size = process->max_out_frames > ch->out_size ? process->max_out_frames : ch->out_size;
+		ch->in = malloc(ch->in_size * sizeof(s32_t));
+		ch->out = malloc(ch->out_size * sizeof(s32_t));
+		if (!ch->in || !ch->out) {
+			LOG_ERROR("malloc fail creating resample channel buffers");
+			exit(1);
+		}
+	}
+
+	ptr = (s32_t *)process->inbuf + c;
+	for (i = 0; i < in_frames; i++) {
+		ch->in[i] = *ptr;
+		ptr += 2;
+	}
+
+	ch->error = SOXR(r, process, r->resampler[c], in_frames ? ch->in : NULL, in_frames, &idone, ch->out,
+					 process->max_out_frames, &ch->odone);
+	if (ch->error) {
+		ch->odone = 0;
+		return;
+	}
+
+	ptr = (s32_t *)process->outbuf + c;
+	for (i = 0; i < ch->odone; i++) {
+		*ptr = ch->out[i];
+		ptr += 2;
+	}
+}
+
+#if LINUX || OSX || FREEBSD
+static void *resample_thread(void *arg) {
+	pthread_mutex_lock(&r->mutex);
+
+	while (r->threaded) {
+		if (r->posted > r->done) {
+			struct processstate *job = r->job;
+			pthread_mutex_unlock(&r->mutex);
+			channel_process(1, job);
+			pthread_mutex_lock(&r->mutex);
+			r->done++;
+			pthread_cond_broadcast(&r->cond);
+		} else {
+			pthread_cond_wait(&r->cond, &r->mutex);
+		}
+	}
+
+	pthread_mutex_unlock(&r->mutex);
+
+	return NULL;
+}
+#endif
+
+// left channel in the calling thread and right on the worker, both complete before returning
+static size_t parallel_process(struct processstate *process, soxr_error_t *error) {
+#if LINUX || OSX || FREEBSD
+	if (r->threaded) {
+		pthread_mutex_lock(&r->mutex);
+		r->job = process;
+		r->posted++;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->mutex);
+
+		channel_process(0, process);
+
+		pthread_mutex_lock(&r->mutex);
+		while (r->done < r->posted) {
+			pthread_cond_wait(&r->cond, &r->mutex);
+		}
+		pthread_mutex_unlock(&r->mutex);
+	} else
+#endif
+	{
+		channel_process(0, process);
+		channel_process(1, process);
+	}
+
+	*error = r->chan[0].error ? r->chan[0].error : r->chan[1].error;
+
+	if (r->chan[0].odone != r->chan[1].odone) {
+		LOG_WARN("channel output mismatch: %u %u", (unsigned)r->chan[0].odone, (unsigned)r->chan[1].odone);
+	}
+
+	return min(r->chan[0].odone, r->chan[1].odone);
+}
+
+static size_t clips(void) {
+	size_t clip_cnt = *(SOXR(r, num_clips, r->resampler[0]));
+	if (r->resampler[1]) {
+		clip_cnt += *(SOXR(r, num_clips, r->resampler[1]));
+	}
+	return clip_cnt;
+}
+
+// soxr may defer part of its set up to the first soxr_process, so time both create and clear up to the end of it
+static void timing_done(u32_t process_us) {
+	struct soxr_cache *c = r->timing;
+	u32_t setup_us = r->timing_us + process_us;
+
+	r->timing = NULL;
+
+	if (r->timing_reused) {
+		LOG_INFO("reused resampler %u -> %u, hits: %u, set up: %u us, created: %u us, saved: %d us", c->in_rate,
+				 c->out_rate, c->hits, setup_us, c->setup_us, (int)c->setup_us - (int)setup_us);
+	} else {
+		c->setup_us = setup_us;
+		LOG_INFO("created resampler %u -> %u, set up: %u us", c->in_rate, c->out_rate, setup_us);
+	}
+}
+
 void resample_samples(struct processstate *process) {
 	size_t idone, odone;
 	size_t clip_cnt;
-	
-	soxr_error_t error =
-		SOXR(r, process, r->resampler, process->inbuf, process->in_frames, &idone, process->outbuf, process->max_out_frames, &odone);
+	soxr_error_t error;
+	u64_t start = 0;
+
+	if (r->fir) {
+		fir_samples(process);
+		return;
+	}
+
+	if (r->timing) {
+		start = gettime_us();
+	}
+
+	if (r->parallel) {
+		odone = parallel_process(process, &error);
+		idone = process->in_frames;
+	} else {
+		error = SOXR(r, process, r->resampler[0], process->inbuf, process->in_frames, &idone, process->outbuf,
+					 process->max_out_frames, &odone);
+	}
 	if (error) {
 		LOG_INFO("soxr_process error: %s", soxr_strerror(error));
 		return;
 	}
+
+	if (r->timing) {
+		timing_done((u32_t)(gettime_us() - start));
+	}
 	
 	if (idone != process->in_frames) {
 		// should not get here if buffers are big enough...
@@ -88,7 +273,7 @@ void resample_samples(struct processstate *process) {
 	process->total_in  += idone;
 	process->total_out += odone;
 	
-	clip_cnt = *(SOXR(r, num_clips, r->resampler));
+	clip_cnt = clips();
 	if (clip_cnt - r->old_clips) {
 		LOG_SDEBUG("resampling clips: %u", (unsigned)(clip_cnt - r->old_clips));
 		r->old_clips = clip_cnt;
@@ -98,8 +283,20 @@ void resample_samples(struct processstate *process) {
 bool resample_drain(struct processstate *process) {
 	size_t odone;
 	size_t clip_cnt;
+	soxr_error_t error;
+
+	if (r->fir) {
+		return fir_drain(process);
+	}
 		
-	soxr_error_t error = SOXR(r, process, r->resampler, NULL, 0, NULL, process->outbuf, process->max_out_frames, &odone);
+	if (r->parallel) {
+		u8_t *inbuf = process->inbuf;
+		process->inbuf = NULL;
+		odone = parallel_process(process, &error);
+		process->inbuf = inbuf;
+	} else {
+		error = SOXR(r, process, r->resampler[0], NULL, 0, NULL, process->outbuf, process->max_out_frames, &odone);
+	}
 	if (error) {
 		LOG_INFO("soxr_process error: %s", soxr_strerror(error));
 		return true;
@@ -108,7 +305,7 @@ bool resample_drain(struct processstate *process) {
 	process->out_frames = odone;
 	process->total_out += odone;
 	
-	clip_cnt = *(SOXR(r, num_clips, r->resampler));
+	clip_cnt = clips();
 	if (clip_cnt - r->old_clips) {
 		LOG_DEBUG("resampling clips: %u", (unsigned)(clip_cnt - r->old_clips));
 		r->old_clips = clip_cnt;
@@ -118,8 +315,8 @@ bool resample_drain(struct processstate *process) {
 
 		LOG_INFO("resample track complete - total track clips: %u", r->old_clips);
 
-		SOXR(r, delete, r->resampler);
-		r->resampler = NULL;
+		// instance stays in the cache and is cleared if used again
+		r->resampler[0] = r->resampler[1] = NULL;
 
 		return true;
 
@@ -129,98 +326,164 @@ bool resample_drain(struct processstate *process) {
 	}
 }
 
-bool resample_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]) {
-	unsigned outrate = 0;
-	int i;
+static soxr_t cache_create(unsigned in_rate, unsigned out_rate, unsigned channels) {
+	soxr_io_spec_t io_spec;
+	soxr_quality_spec_t q_spec;
+	soxr_error_t error;
+	soxr_t resampler;
+#if RESAMPLE_MP
+	soxr_runtime_spec_t r_spec;
+#endif
 
-	if (r->exception) {
-		// find direct match - avoid resampling
-		for (i = 0; supported_rates[i]; i++) {
-			if (raw_sample_rate == supported_rates[i]) {
-				outrate = raw_sample_rate;
-				break;
-			}
+	io_spec = SOXR(r, io_spec, SOXR_INT32_I, SOXR_INT32_I);
+	io_spec.scale = r->scale;
+
+	q_spec = SOXR(r, quality_spec, r->q_recipe, r->q_flags);
+	if (r->q_precision > 0) {
+		q_spec.precision = r->q_precision;
+	}
+	if (r->q_passband_end > 0) {
+		q_spec.passband_end = r->q_passband_end;
+	}
+	if (r->q_stopband_begin > 0) {
+		q_spec.stopband_begin = r->q_stopband_begin;
+	}
+	if (r->q_phase_response > -1) {
+		q_spec.phase_response = r->q_phase_response;
+	}
+
+#if RESAMPLE_MP
+	r_spec = SOXR(r, runtime_spec, 0); // make use of libsoxr OpenMP support allowing parallel execution if multiple cores
+#endif		   
+
+	LOG_DEBUG("resampling with soxr_quality_spec_t[precision: %03.1f, passband_end: %03.6f, stopband_begin: %03.6f, "
+			  "phase_response: %03.1f, flags: 0x%02x], soxr_io_spec_t[scale: %03.2f], channels: %u", q_spec.precision,
+			  q_spec.passband_end, q_spec.stopband_begin, q_spec.phase_response, q_spec.flags, io_spec.scale, channels);
+
+#if RESAMPLE_MP
+	resampler = SOXR(r, create, in_rate, out_rate, channels, &error, &io_spec, &q_spec, &r_spec);
+#else
+	resampler = SOXR(r, create, in_rate, out_rate, channels, &error, &io_spec, &q_spec, NULL);
+#endif
+
+	if (error) {
+		LOG_INFO("soxr_create error: %s", soxr_strerror(error));
+		if (resampler) {
+			SOXR(r, delete, resampler);
 		}
-		// else find next highest sync sample rate
-		while (!outrate && i >= 0) {
-			if (supported_rates[i] > raw_sample_rate && supported_rates[i] % raw_sample_rate == 0) {
-				outrate = supported_rates[i];
-				break;
-			}
-			i--;
+		return NULL;
+	}
+
+	return resampler;
+}
+
+static void cache_delete(struct soxr_cache *c) {
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (c->resampler[i]) {
+			SOXR(r, delete, c->resampler[i]);
+			c->resampler[i] = NULL;
 		}
 	}
+}
 
-	if (!outrate) {
-		if (r->max_rate) {
-			// resample to max rate for device
-			outrate = supported_rates[0];
-		} else {
-			// resample to max sync sample rate
-			for (i = 0; supported_rates[i]; i++) {
-				if (supported_rates[i] % raw_sample_rate == 0 || raw_sample_rate % supported_rates[i] == 0) {
-					outrate = supported_rates[i];
-					break;
-				}
+// set r->resampler to cleared resamplers for the rate pair and current quality settings, reusing a cached entry if possible
+// the least recently used entry is replaced when full, set up time of both paths is logged after the first soxr_process
+static bool cache_get(unsigned in_rate, unsigned out_rate) {
+	struct soxr_cache *c, *slot = &r->cache[0];
+	u32_t now = gettime_ms();
+	u64_t start = gettime_us();
+	int i;
+
+	r->timing = NULL;
+
+	for (i = 0; i < CACHE_SIZE; i++) {
+		c = &r->cache[i];
+		if (c->resampler[0] && c->in_rate == in_rate && c->out_rate == out_rate && c->q_recipe == r->q_recipe &&
+			c->q_flags == r->q_flags && c->q_precision == r->q_precision && c->q_phase_response == r->q_phase_response) {
+			soxr_error_t error = SOXR(r, clear, c->resampler[0]);
+			if (!error && c->resampler[1]) {
+				error = SOXR(r, clear, c->resampler[1]);
 			}
+			if (!error) {
+				c->hits++;
+				c->last_used = now;
+				r->timing = c;
+				r->timing_us = (u32_t)(gettime_us() - start);
+				r->timing_reused = true;
+				r->resampler[0] = c->resampler[0];
+				r->resampler[1] = c->resampler[1];
+				return true;
+			}
+			LOG_INFO("soxr_clear error: %s", soxr_strerror(error));
+			cache_delete(c);
 		}
-		if (!outrate) {
-			outrate = supported_rates[0];
+		if (!c->resampler[0]) {
+			slot = c;
+		} else if (slot->resampler[0] && now - c->last_used > now - slot->last_used) {
+			slot = c;
 		}
 	}
 
-	process->in_sample_rate = raw_sample_rate;
-	process->out_sample_rate = outrate;
+	if (slot->resampler[0]) {
+		LOG_DEBUG("evicting resampler %u -> %u, hits: %u", slot->in_rate, slot->out_rate, slot->hits);
+		cache_delete(slot);
+	}
+
+	if (r->parallel) {
+		slot->resampler[0] = cache_create(in_rate, out_rate, 1);
+		slot->resampler[1] = slot->resampler[0] ? cache_create(in_rate, out_rate, 1) : NULL;
+		if (!slot->resampler[1]) {
+			cache_delete(slot);
+		}
+	} else {
+		slot->resampler[0] = cache_create(in_rate, out_rate, 2);
+	}
 
-	if (r->resampler) {
-		SOXR(r, delete, r->resampler);
-		r->resampler = NULL;
+	if (!slot->resampler[0]) {
+		return false;
 	}
 
-	if (raw_sample_rate != outrate) {
+	slot->in_rate = in_rate;
+	slot->out_rate = out_rate;
+	slot->q_recipe = r->q_recipe;
+	slot->q_flags = r->q_flags;
+	slot->q_precision = r->q_precision;
+	slot->q_phase_response = r->q_phase_response;
+	slot->hits = 0;
+	slot->last_used = now;
+	slot->setup_us = 0;
 
-		soxr_io_spec_t io_spec;
-		soxr_quality_spec_t q_spec;
-		soxr_error_t error;
-#if RESAMPLE_MP
-		soxr_runtime_spec_t r_spec;
-#endif
+	r->timing = slot;
+	r->timing_us = (u32_t)(gettime_us() - start);
+	r->timing_reused = false;
 
-		LOG_INFO("resampling from %u -> %u", raw_sample_rate, outrate);
+	r->resampler[0] = slot->resampler[0];
+	r->resampler[1] = slot->resampler[1];
 
-		io_spec = SOXR(r, io_spec, SOXR_INT32_I, SOXR_INT32_I);
-		io_spec.scale = r->scale;
+	return true;
+}
 
-		q_spec = SOXR(r, quality_spec, r->q_recipe, r->q_flags);
-		if (r->q_precision > 0) {
-			q_spec.precision = r->q_precision;
-		}
-		if (r->q_passband_end > 0) {
-			q_spec.passband_end = r->q_passband_end;
-		}
-		if (r->q_stopband_begin > 0) {
-			q_spec.stopband_begin = r->q_stopband_begin;
-		}
-		if (r->q_phase_response > -1) {
-			q_spec.phase_response = r->q_phase_response;
-		}
+bool resample_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]) {
+	unsigned outrate;
 
-#if RESAMPLE_MP
-		r_spec = SOXR(r, runtime_spec, 0); // make use of libsoxr OpenMP support allowing parallel execution if multiple cores
-#endif		   
+	if (r->fir) {
+		return fir_newstream(process, raw_sample_rate, supported_rates);
+	}
 
-		LOG_DEBUG("resampling with soxr_quality_spec_t[precision: %03.1f, passband_end: %03.6f, stopband_begin: %03.6f, "
-				  "phase_response: %03.1f, flags: 0x%02x], soxr_io_spec_t[scale: %03.2f]", q_spec.precision,
-				  q_spec.passband_end, q_spec.stopband_begin, q_spec.phase_response, q_spec.flags, io_spec.scale);
+	outrate = process_resample_rate(raw_sample_rate, supported_rates, r->exception, r->max_rate);
 
-#if RESAMPLE_MP
-		r->resampler = SOXR(r, create, raw_sample_rate, outrate, 2, &error, &io_spec, &q_spec, &r_spec);
-#else
-		r->resampler = SOXR(r, create, raw_sample_rate, outrate, 2, &error, &io_spec, &q_spec, NULL);
-#endif
+	process->in_sample_rate = raw_sample_rate;
+	process->out_sample_rate = outrate;
+
+	r->resampler[0] = r->resampler[1] = NULL;
+	r->timing = NULL;
+
+	if (raw_sample_rate != outrate) {
+
+		LOG_INFO("resampling from %u -> %u%s", raw_sample_rate, outrate, r->parallel ? " channels in parallel" : "");
 
-		if (error) {
-			LOG_INFO("soxr_create error: %s", soxr_strerror(error));
+		if (!cache_get(raw_sample_rate, outrate)) {
 			return false;
 		}
 
@@ -235,10 +498,13 @@ bool resample_newstream(struct processstate *process, unsigned raw_sample_rate,
 }
 
 void resample_flush(void) {
-	if (r->resampler) {
-		SOXR(r, delete, r->resampler);
-		r->resampler = NULL;
+	if (r->fir) {
+		fir_flush();
+		return;
 	}
+	// instance stays in the cache and is cleared if used again
+	r->resampler[0] = r->resampler[1] = NULL;
+	r->timing = NULL;
 }
 
 static bool load_soxr(void) {
@@ -255,6 +521,7 @@ static bool load_soxr(void) {
 	r->soxr_quality_spec = dlsym(handle, "soxr_quality_spec");
 	r->soxr_create = dlsym(handle, "soxr_create");
 	r->soxr_delete = dlsym(handle, "soxr_delete");
+	r->soxr_clear = dlsym(handle, "soxr_clear");
 	r->soxr_process = dlsym(handle, "soxr_process");
 	r->soxr_num_clips = dlsym(handle, "soxr_num_clips");
 #if RESAMPLE_MP
@@ -283,14 +550,23 @@ bool resample_init(char *opt) {
 		return false;
 	}
 
-	r->resampler = NULL;
+	r->resampler[0] = r->resampler[1] = NULL;
+	memset(r->cache, 0, sizeof(r->cache));
+	r->timing = NULL;
+	memset(r->chan, 0, sizeof(r->chan));
+	r->parallel = false;
+#if LINUX || OSX || FREEBSD
+	r->threaded = false;
+#endif
 	r->old_clips = 0;
 	r->max_rate = false;
 	r->exception = false;
+	r->fir = false;
 
 	if (!load_soxr()) {
-		LOG_WARN("resampling disabled");
-		return false;
+		LOG_WARN("libsoxr not available, using built in resampler");
+		r->fir = true;
+		return fir_init(opt);
 	}
 
 	if (opt) {
@@ -328,6 +604,8 @@ bool resample_init(char *opt) {
 		if (strchr(recipe, 'X')) r->max_rate = true;
 		// E = exception, only resample if native rate is not supported
 		if (strchr(recipe, 'E')) r->exception = true;
+		// P = resample channels in parallel with a mono instance each
+		if (strchr(recipe, 'P')) r->parallel = true;
 	}
 
 	if (flags) {
@@ -361,7 +639,24 @@ bool resample_init(char *opt) {
 			r->max_rate ? "async" : "sync",
 			r->q_recipe, r->q_flags, r->scale, r->q_precision, r->q_passband_end, r->q_stopband_begin, r->q_phase_response);
 
+#if LINUX || OSX || FREEBSD
+	if (r->parallel) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + RESAMPLE_THREAD_STACK_SIZE);
+		pthread_mutex_init(&r->mutex, NULL);
+		pthread_cond_init(&r->cond, NULL);
+		r->posted = r->done = 0;
+		r->threaded = true;
+		if (pthread_create(&r->thread, &attr, resample_thread, NULL) != 0) {
+			LOG_WARN("unable to create resample thread, channels resampled in turn");
+			r->threaded = false;
+		}
+		pthread_attr_destroy(&attr);
+	}
+#endif
+
 	return true;
 }
 
-#endif // #if RESAMPLE
+#endif // #if RESAMPLE && !NO_SOXR
@@ -0,0 +1,147 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// resampling using the built in polyphase resampler - only included if RESAMPLE set
+// used directly when built with NO_SOXR, otherwise by resample.c if libsoxr cannot be loaded
+
+#include "squeezelite.h"
+
+#if RESAMPLE
+
+#include <math.h>
+#include "./polyphase/polyphase.h"
+
+extern log_level loglevel;
+
+static struct {
+	polyphase_ctx *ctx;
+	unsigned in_rate;   // rates of ctx, reused for the next stream if unchanged
+	unsigned out_rate;
+	int quality;
+	double scale;
+	bool max_rate;
+	bool exception;
+} f;
+
+void fir_samples(struct processstate *process) {
+	size_t odone = polyphase_process(f.ctx, (int32_t *)process->inbuf, process->in_frames, (int32_t *)process->outbuf,
+									 process->max_out_frames);
+
+	process->out_frames = odone;
+	process->total_in  += process->in_frames;
+	process->total_out += odone;
+}
+
+bool fir_drain(struct processstate *process) {
+	size_t odone = polyphase_drain(f.ctx, (int32_t *)process->outbuf, process->max_out_frames);
+
+	process->out_frames = odone;
+	process->total_out += odone;
+
+	if (odone == 0) {
+		LOG_INFO("resample track complete - total track clips: %lu", polyphase_clips(f.ctx));
+		return true;
+	}
+
+	return false;
+}
+
+bool fir_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]) {
+	unsigned outrate = process_resample_rate(raw_sample_rate, supported_rates, f.exception, f.max_rate);
+
+	process->in_sample_rate = raw_sample_rate;
+	process->out_sample_rate = outrate;
+
+	if (raw_sample_rate == outrate) {
+		LOG_INFO("disable resampling - rates match");
+		return false;
+	}
+
+	LOG_INFO("resampling from %u -> %u", raw_sample_rate, outrate);
+
+	if (f.ctx && f.in_rate == raw_sample_rate && f.out_rate == outrate) {
+		polyphase_reset(f.ctx);
+		return true;
+	}
+
+	if (f.ctx) {
+		polyphase_destroy(f.ctx);
+	}
+
+	f.ctx = polyphase_init(raw_sample_rate, outrate, f.quality, f.scale);
+	if (!f.ctx) {
+		LOG_WARN("resampling %u -> %u not supported by built in resampler", raw_sample_rate, outrate);
+		return false;
+	}
+
+	f.in_rate = raw_sample_rate;
+	f.out_rate = outrate;
+
+	LOG_DEBUG("polyphase filter: %u phases of %u taps, kernel: %s", polyphase_phases(f.ctx), polyphase_taps(f.ctx),
+			  polyphase_kernel_name());
+
+	return true;
+}
+
+void fir_flush(void) {
+	// filter bank is kept, history is reset by the next fir_newstream
+}
+
+// accepts the same parameters as libsoxr resampling, only recipe quality, E, X and attenuation are used
+bool fir_init(char *opt) {
+	char *recipe = NULL, *atten = NULL;
+
+	f.ctx = NULL;
+	f.quality = POLYPHASE_HIGH;
+	f.scale = pow(10, -1.0 / 20);
+	f.max_rate = false;
+	f.exception = false;
+
+	if (opt) {
+		recipe = next_param(opt, ':');
+		next_param(NULL, ':');
+		atten = next_param(NULL, ':');
+	}
+
+	if (recipe && recipe[0] != '\0') {
+		if (strchr(recipe, 'v')) f.quality = POLYPHASE_VERY_HIGH;
+		if (strchr(recipe, 'h')) f.quality = POLYPHASE_HIGH;
+		if (strchr(recipe, 'm')) f.quality = POLYPHASE_MEDIUM;
+		if (strchr(recipe, 'l')) f.quality = POLYPHASE_LOW;
+		if (strchr(recipe, 'q')) f.quality = POLYPHASE_LOW;
+		if (strchr(recipe, 'X')) f.max_rate = true;
+		if (strchr(recipe, 'E')) f.exception = true;
+	}
+
+	if (atten) {
+		double scale = pow(10, -atof(atten) / 20);
+		if (scale > 0 && scale <= 1.0) {
+			f.scale = scale;
+		}
+	}
+
+	LOG_INFO("resampling %s with built in polyphase resampler, quality: %d, scale: %03.2f, kernel: %s",
+			 f.max_rate ? "async" : "sync", f.quality, f.scale, polyphase_kernel_name());
+
+	return true;
+}
+
+#endif // #if RESAMPLE
@@ -32,6 +32,9 @@ static log_level loglevel;
 #define PORT 3483
 
 #define MAXBUF 4096
+#define RECVBUF (2 * (MAXBUF + 2)) // allows a burst of server packets to be read together
+
+#define STATUS_INTERVAL 1000 // ms between STMt updates while playing
 
 #if SL_LITTLE_ENDIAN
 #define LOCAL_PLAYER_IP   0x0100007f // 127.0.0.1
@@ -57,6 +60,7 @@ extern struct irstate ir;
 #endif
 
 event_event wake_e;
+static u32_t wake_events = 0;
 
 #define LOCK_S   mutex_lock(streambuf->mutex)
 #define UNLOCK_S mutex_unlock(streambuf->mutex)
@@ -71,6 +75,7 @@ event_event wake_e;
 
 static struct {
 	u32_t updated;
+	u64_t updated_us;
 	u32_t stream_start;
 	u32_t stream_full;
 	u32_t stream_size;
@@ -92,8 +97,11 @@ char *new_server_cap;
 char player_name[PLAYER_NAME_LEN + 1] = "";
 const char *name_file = NULL;
 
-void send_packet(u8_t *packet, size_t len) {
-	u8_t *ptr = packet;
+// packets are queued and sent together by send_flush once each pass of slimproto_run has generated its replies
+static u8_t sendbuf[MAXBUF];
+static size_t sendbuf_len = 0;
+
+static void send_data(u8_t *ptr, size_t len) {
 	unsigned try = 0;
 	ssize_t n;
 	int error;
@@ -107,8 +115,12 @@ void send_packet(u8_t *packet, size_t len) {
 #else
 			if (n < 0 && error == ERROR_WOULDBLOCK && try < 10) {
 #endif
+				// wait for the socket to drain rather than sleeping a fixed time
+				struct pollfd pollinfo;
+				pollinfo.fd = sock;
+				pollinfo.events = POLLOUT;
 				LOG_DEBUG("retrying (%d) writing to socket", ++try);
-				usleep(1000);
+				poll(&pollinfo, 1, 100);
 				continue;
 			}
 			LOG_WARN("failed writing to socket: %s", strerror(last_error()));
@@ -119,6 +131,25 @@ void send_packet(u8_t *packet, size_t len) {
 	}
 }
 
+static void send_flush(void) {
+	if (sendbuf_len) {
+		send_data(sendbuf, sendbuf_len);
+		sendbuf_len = 0;
+	}
+}
+
+void send_packet(u8_t *packet, size_t len) {
+	if (sendbuf_len + len > sizeof(sendbuf)) {
+		send_flush();
+		if (len > sizeof(sendbuf)) {
+			send_data(packet, len);
+			return;
+		}
+	}
+	memcpy(sendbuf + sendbuf_len, packet, len);
+	sendbuf_len += len;
+}
+
 static void sendHELO(bool reconnect, const char *fixed_cap, const char *var_cap, u8_t mac[6]) {
 	#define BASE_CAP "Model=squeezelite,AccuratePlayPoints=1,HasDigitalOut=1,HasPolarityInversion=1,Balance=1,Firmware=" VERSION
 	#define SSL_CAP "CanHTTPS=1"
@@ -158,11 +189,28 @@ static void sendHELO(bool reconnect, const char *fixed_cap, const char *var_cap,
 static void sendSTAT(const char *event, u32_t server_timestamp) {
 	struct STAT_packet pkt;
 	u32_t now = gettime_ms();
+	u64_t now_us = gettime_us();
 	u32_t ms_played;
+	struct output_status out;
+
+	// refresh from the output snapshot as the last sweep may be up to STATUS_INTERVAL old, eg when replying to strm t
+	output_status(&out);
+	status.output_full = out.output_full;
+	status.output_size = out.output_size;
+	status.frames_played = out.frames_played;
+	status.current_sample_rate = out.current_sample_rate;
+	status.updated = out.updated;
+	status.updated_us = out.updated_us;
+	status.device_frames = out.device_frames;
 
 	if (status.current_sample_rate && status.frames_played && status.frames_played > status.device_frames) {
-		ms_played = (u32_t)(((u64_t)(status.frames_played - status.device_frames) * (u64_t)1000) / (u64_t)status.current_sample_rate);
-		if (now > status.updated) ms_played += (now - status.updated);
+		// interpolate from when the device delay was measured to the moment the packet is built
+		u64_t us_played = (u64_t)(status.frames_played - status.device_frames) * 1000000 / status.current_sample_rate;
+		if (now_us > status.updated_us) us_played += now_us - status.updated_us;
+		ms_played = (u32_t)((us_played + 500) / 1000);
+#if DSP
+		ms_played = drift_elapsed(ms_played, status.current_sample_rate);
+#endif
 		LOG_SDEBUG("ms_played: %u (frames_played: %u device_frames: %u)", ms_played, status.frames_played, status.device_frames);
 	} else if (status.frames_played && now > status.stream_start) {
 		ms_played = now - status.stream_start;
@@ -410,7 +458,7 @@ static void process_cont(u8_t *pkt, int len) {
 			stream.meta_interval = stream.meta_next = cont->metaint;
 		}
 		UNLOCK_S;
-		wake_controller();
+		wake_controller(WAKE_STREAM);
 	}
 }
 
@@ -541,61 +589,71 @@ static void process(u8_t *pack, int len) {
 static bool running;
 
 static void slimproto_run() {
-	static u8_t buffer[MAXBUF];
-	int  expect = 0;
+	static u8_t buffer[RECVBUF + 1];
 	int  got    = 0;
-	u32_t now;
-	static u32_t last = 0;
+	u32_t now = gettime_ms();
+	u32_t next = now;
+	u32_t last_msg = now;
 	event_handle ehandles[2];
-	int timeouts = 0;
 
 	set_readwake_handles(ehandles, sock, wake_e);
 
 	while (running && !new_server) {
 
 		bool wake = false;
+		bool processed = false;
 		event_type ev;
+		int wait;
+
+		// send replies queued by the last pass together
+		send_flush();
 
-		if ((ev = wait_readwake(ehandles, 1000)) != EVENT_TIMEOUT) {
+		// sleep until a socket read, an event from another thread or the next status update is due
+		now = gettime_ms();
+		wait = (s32_t)(next - now) > 0 ? next - now : 0;
+		wait = min(wait, STATUS_INTERVAL);
+
+		if ((ev = wait_readwake(ehandles, wait)) != EVENT_TIMEOUT) {
 	
 			if (ev == EVENT_READ) {
 
-				if (expect > 0) {
-					int n = recv(sock, buffer + got, expect, 0);
-					if (n <= 0) {
-						if (n < 0 && last_error() == ERROR_WOULDBLOCK) {
-							continue;
-						}
-						LOG_INFO("error reading from socket: %s", n ? strerror(last_error()) : "closed");
-						return;
+				int pos = 0;
+				int n = recv(sock, buffer + got, RECVBUF - got, 0);
+				if (n <= 0) {
+					if (n < 0 && last_error() == ERROR_WOULDBLOCK) {
+						continue;
 					}
-					expect -= n;
-					got += n;
-					if (expect == 0) {
-						process(buffer, got);
-						got = 0;
-					}
-				} else if (expect == 0) {
-					int n = recv(sock, buffer + got, 2 - got, 0);
-					if (n <= 0) {
-						if (n < 0 && last_error() == ERROR_WOULDBLOCK) {
-							continue;
-						}
-						LOG_INFO("error reading from socket: %s", n ? strerror(last_error()) : "closed");
+					LOG_INFO("error reading from socket: %s", n ? strerror(last_error()) : "closed");
+					return;
+				}
+				got += n;
+
+				// dispatch every complete packet read, keeping any partial packet at the start of the buffer
+				while (got - pos >= 2) {
+					int expect = buffer[pos] << 8 | buffer[pos + 1]; // length pack 'n'
+					u8_t *pkt = buffer + pos + 2;
+					u8_t next_byte;
+					if (expect > MAXBUF) {
+						LOG_ERROR("FATAL: slimproto packet too big: %d > %d", expect, MAXBUF);
 						return;
 					}
-					got += n;
-					if (got == 2) {
-						expect = buffer[0] << 8 | buffer[1]; // length pack 'n'
-						got = 0;
-						if (expect > MAXBUF) {
-							LOG_ERROR("FATAL: slimproto packet too big: %d > %d", expect, MAXBUF);
-							return;
-						}
+					if (got - pos - 2 < expect) {
+						break;
+					}
+					// terminate packet while it is processed as handlers treat trailing data as a string
+					next_byte = pkt[expect];
+					pkt[expect] = '\0';
+					process(pkt, expect);
+					pkt[expect] = next_byte;
+					processed = true;
+					pos += 2 + expect;
+					if (new_server) {
+						break;
 					}
-				} else {
-					LOG_ERROR("FATAL: negative expect");
-					return;
+				}
+				if (pos) {
+					got -= pos;
+					memmove(buffer, buffer + pos, got);
 				}
 
 			}
@@ -604,19 +662,21 @@ static void slimproto_run() {
 				wake = true;
 			}
 
-			timeouts = 0;
+			last_msg = gettime_ms();
 
-		} else if (++timeouts > 35) {
+		} else if (gettime_ms() - last_msg > 35000) {
 
 			// expect message from server every 5 seconds, but 30 seconds on mysb.com so timeout after 35 seconds
 			LOG_INFO("No messages from server - connection dead");
 			return;
 		}
 
-		// update playback state when woken or every 100ms
+		// update playback state on events from other threads, after server messages and when a status update is due
 		now = gettime_ms();
 
-		if (wake || now - last > 100 || last > now) {
+		if (wake || processed || (s32_t)(now - next) >= 0) {
+			u32_t events = exchange(wake_events, 0);
+			struct output_status out;
 			bool _sendSTMs = false;
 			bool _sendDSCO = false;
 			bool _sendRESP = false;
@@ -637,9 +697,6 @@ static void slimproto_run() {
 			bool _sendIR   = false;
 			u32_t ir_code, ir_ts;
 #endif
-			last = now;
-
-
 			LOCK_S;
 			status.stream_full = _buf_used(streambuf);
 			status.stream_size = streambuf->size;
@@ -691,51 +748,79 @@ static void slimproto_run() {
 			_decode_state = decode.state;
 			UNLOCK_D;
 			
-			LOCK_O;
-			status.output_full = _buf_used(outputbuf);
-			status.output_size = outputbuf->size;
-			status.frames_played = output.frames_played_dmp;
-			status.current_sample_rate = output.current_sample_rate;
-			status.updated = output.updated;
-			status.device_frames = output.device_frames;
+			output_status(&out);
+			status.output_full = out.output_full;
+			status.output_size = out.output_size;
+			status.frames_played = out.frames_played;
+			status.current_sample_rate = out.current_sample_rate;
+			status.updated = out.updated;
+			status.updated_us = out.updated_us;
+			status.device_frames = out.device_frames;
+#if DSP
+			drift_measure(out.frames_played - out.device_frames, out.updated, out.current_sample_rate,
+						  out.state == OUTPUT_RUNNING);
+#endif
+
+			// only take the output mutex when output signalled an event or its state may need changing
+			if ((events & WAKE_OUTPUT) || processed || _start_output ||
+				(out.state == OUTPUT_RUNNING && out.output_full == 0 && (!sentSTMu || !sentSTMo)) ||
+				(out.state == OUTPUT_STOPPED && output.idle_to)) {
+
+				LOCK_O;
+				status.output_full = _buf_used(outputbuf);
+				status.output_size = outputbuf->size;
+				status.frames_played = output.frames_played_dmp;
+				status.current_sample_rate = output.current_sample_rate;
+				status.updated = output.updated;
+				status.updated_us = output.updated_us;
+				status.device_frames = output.device_frames;
 			
-			if (output.track_started) {
-				_sendSTMs = true;
-				output.track_started = false;
-				status.stream_start = output.track_start_time;
-			}
+				if (output.track_started) {
+					_sendSTMs = true;
+					output.track_started = false;
+					status.stream_start = output.track_start_time;
+				}
 #if PORTAUDIO
-			if (output.pa_reopen) {
-				_pa_open();
-				output.pa_reopen = false;
-			}
+				if (output.pa_reopen) {
+					_pa_open();
+					output.pa_reopen = false;
+				}
 #endif
-			if (_start_output && (output.state == OUTPUT_STOPPED || output.state == OUTPUT_OFF)) {
-				output.state = OUTPUT_BUFFER;
-			}
-			if (output.state == OUTPUT_RUNNING && !sentSTMu && status.output_full == 0 && status.stream_state <= DISCONNECT &&
-				_decode_state == DECODE_STOPPED) {
+				if (_start_output && (output.state == OUTPUT_STOPPED || output.state == OUTPUT_OFF)) {
+					output.state = OUTPUT_BUFFER;
+				}
+				if (output.state == OUTPUT_RUNNING && !sentSTMu && status.output_full == 0 && status.stream_state <= DISCONNECT &&
+					_decode_state == DECODE_STOPPED) {
+
+					_sendSTMu = true;
+					sentSTMu = true;
+					flight_record(FR_UNDERRUN, 'u', 0, 0, 0);
+					LOG_DEBUG("output underrun");
+					output.state = OUTPUT_STOPPED;
+					output.stop_time = now;
+				}
+				if (output.state == OUTPUT_RUNNING && !sentSTMo && status.output_full == 0 && status.stream_state == STREAMING_HTTP) {
 
-				_sendSTMu = true;
-				sentSTMu = true;
-				LOG_DEBUG("output underrun");
-				output.state = OUTPUT_STOPPED;
-				output.stop_time = now;
+					_sendSTMo = true;
+					sentSTMo = true;
+					flight_trigger(FR_UNDERRUN, 'o');
+				}
+				if (output.state == OUTPUT_STOPPED && output.idle_to && (now - output.stop_time > output.idle_to)) {
+					output.state = OUTPUT_OFF;
+					LOG_DEBUG("output timeout");
+				}
+				_output_publish();
+				out.state = output.state;
+				UNLOCK_O;
 			}
-			if (output.state == OUTPUT_RUNNING && !sentSTMo && status.output_full == 0 && status.stream_state == STREAMING_HTTP) {
 
-				_sendSTMo = true;
-				sentSTMo = true;
-			}
-			if (output.state == OUTPUT_STOPPED && output.idle_to && (now - output.stop_time > output.idle_to)) {
-				output.state = OUTPUT_OFF;
-				LOG_DEBUG("output timeout");
-			}
-			if (output.state == OUTPUT_RUNNING && now - status.last > 1000) {
+			if (out.state == OUTPUT_RUNNING && now - status.last >= STATUS_INTERVAL) {
 				_sendSTMt = true;
 				status.last = now;
 			}
-			UNLOCK_O;
+
+			// next update when STMt is due while running, otherwise to check for idle timeout and dead connection
+			next = out.state == OUTPUT_RUNNING ? status.last + STATUS_INTERVAL : now + STATUS_INTERVAL;
 
 #if IR
 			LOCK_I;
@@ -764,12 +849,15 @@ static void slimproto_run() {
 #if IR
 			if (_sendIR)   sendIR(ir_code, ir_ts);
 #endif
+
+			flight_dump();
 		}
 	}
 }
 
-// called from other threads to wake state machine above
-void wake_controller(void) {
+// called from other threads to wake state machine above, events are accumulated until it runs
+void wake_controller(u32_t events) {
+	fetch_or(wake_events, events);
 	wake_signal(wake_e);
 }
 
@@ -836,6 +924,8 @@ void slimproto(log_level level, char *server, u8_t mac[6], const char *name, con
 
 	memset(&status, 0, sizeof(status));
 
+	metrics_thread("slimproto");
+
 	wake_create(wake_e);
 
 	loglevel = level;
@@ -965,6 +1055,9 @@ void slimproto(log_level level, char *server, u8_t mac[6], const char *name, con
 
 			slimproto_run();
 
+			// discard anything queued for the closed connection
+			sendbuf_len = 0;
+
 			if (!reconnect) {
 				reconnect = true;
 			}
@@ -22,7 +22,8 @@
  *   -Launch script on power status change from LMS
  */
 
-// make may define: PORTAUDIO, SELFPIPE, RESAMPLE, RESAMPLE_MP, VISEXPORT, GPIO, IR, DSD, LINKALL to influence build
+// make may define: PORTAUDIO, SELFPIPE, RESAMPLE, RESAMPLE_MP, DSP, VISEXPORT, METRICS, LOCKPROF, NO_FLIGHTREC, NO_ASYNCLOG, GPIO, IR, DSD, LINKALL
+// to influence build
 
 #define MAJOR_VERSION "2.0"
 #define MINOR_VERSION "0"
@@ -107,9 +108,18 @@
 #if defined(RESAMPLE) || defined(RESAMPLE_MP)
 #undef  RESAMPLE
 #define RESAMPLE  1 // resampling
-#define PROCESS   1 // any sample processing (only resampling at present)
 #else
 #define RESAMPLE  0
+#endif
+#if defined(DSP)
+#undef  DSP
+#define DSP       1 // dsp stages - parametric eq, delay and gain
+#else
+#define DSP       0
+#endif
+#if RESAMPLE || DSP
+#define PROCESS   1 // any sample processing
+#else
 #define PROCESS   0
 #endif
 #if defined(RESAMPLE_MP)
@@ -118,6 +128,12 @@
 #else
 #define RESAMPLE_MP 0
 #endif
+#if defined(NO_SOXR)
+#undef NO_SOXR
+#define NO_SOXR 1 // resample with built in polyphase resampler only
+#else
+#define NO_SOXR 0
+#endif
 
 #if defined(ALAC)
 #undef ALAC
@@ -147,6 +163,32 @@
 #define VISEXPORT 0
 #endif
 
+#if (LINUX || OSX || FREEBSD) && defined(METRICS)
+#undef METRICS
+#define METRICS 1 // metrics endpoint for monitoring
+#else
+#define METRICS 0
+#endif
+
+#if (LINUX || OSX || FREEBSD) && !defined(NO_FLIGHTREC)
+#define FLIGHTREC 1 // flight recorder of pipeline events dumped on underrun
+#else
+#define FLIGHTREC 0
+#endif
+
+#if !WIN && !defined(NO_ASYNCLOG)
+#define ASYNCLOG 1 // log records are queued and written by a background thread
+#else
+#define ASYNCLOG 0
+#endif
+
+#if !WIN && defined(LOCKPROF)
+#undef LOCKPROF
+#define LOCKPROF 1 // mutex contention profiling per call site
+#else
+#define LOCKPROF 0
+#endif
+
 #if LINUX && defined(IR)
 #undef IR
 #define IR 1
@@ -265,6 +307,8 @@
 #define STREAMBUF_SIZE (2 * 1024 * 1024)
 #define OUTPUTBUF_SIZE (44100 * 8 * 10)
 #define OUTPUTBUF_SIZE_CROSSFADE (OUTPUTBUF_SIZE * 12 / 10)
+#define OUTPUTBUF_SIZE_MIN (OUTPUTBUF_SIZE / 4)
+#define OUTPUTBUF_SIZE_MAX (OUTPUTBUF_SIZE * 16)
 
 #define MAX_HEADER 4096 // do not reduce as icy-meta max is 4080
 
@@ -333,14 +377,50 @@ typedef int16_t   s16_t;
 typedef int32_t   s32_t;
 typedef int64_t   s64_t;
 
+#if LOCKPROF
+// statistics for each mutex_lock call site, a static instance is created by each expansion of mutex_lock
+struct lock_site {
+	const char *file;
+	int line;
+	u64_t count;
+	u64_t contended;
+	u64_t wait_us, max_wait_us;
+	u64_t hold_us, max_hold_us;
+	struct lock_site *next;
+	u8_t listed;
+};
+typedef struct {
+	pthread_mutex_t mutex;
+	struct lock_site *site; // call site of the current holder
+	u64_t since;
+} lockprof_mutex;
+void lockprof_lock(lockprof_mutex *m, struct lock_site *site);
+void lockprof_unlock(lockprof_mutex *m);
+#define mutex_type lockprof_mutex
+#define mutex_create(m) pthread_mutex_init(&m.mutex, NULL)
+#define mutex_create_p(m) pthread_mutexattr_t attr; pthread_mutexattr_init(&attr); pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT); pthread_mutex_init(&m.mutex, &attr); pthread_mutexattr_destroy(&attr)
+#define mutex_lock(m) do { static struct lock_site _site = { __FILE__, __LINE__ }; lockprof_lock(&m, &_site); } while (0)
+#define mutex_unlock(m) lockprof_unlock(&m)
+#define mutex_destroy(m) pthread_mutex_destroy(&m.mutex)
+#else
 #define mutex_type pthread_mutex_t
 #define mutex_create(m) pthread_mutex_init(&m, NULL)
 #define mutex_create_p(m) pthread_mutexattr_t attr; pthread_mutexattr_init(&attr); pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT); pthread_mutex_init(&m, &attr); pthread_mutexattr_destroy(&attr)
 #define mutex_lock(m) pthread_mutex_lock(&m)
 #define mutex_unlock(m) pthread_mutex_unlock(&m)
 #define mutex_destroy(m) pthread_mutex_destroy(&m)
+#endif
 #define thread_type pthread_t
 
+// lock free access to 32 bit values shared between threads without holding a mutex
+#define load_acquire(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define store_release(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define fetch_add(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#define fetch_or(x, v) __atomic_fetch_or(&(x), (v), __ATOMIC_ACQ_REL)
+#define exchange(x, v) __atomic_exchange_n(&(x), (v), __ATOMIC_ACQ_REL)
+#define read_fence() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define write_fence() __atomic_thread_fence(__ATOMIC_RELEASE)
+
 #endif
 
 #if WIN
@@ -375,6 +455,14 @@ typedef BOOL bool;
 #define mutex_destroy(m) CloseHandle(m)
 #define thread_type HANDLE
 
+#define load_acquire(x) InterlockedCompareExchange((volatile LONG *)&(x), 0, 0)
+#define store_release(x, v) InterlockedExchange((volatile LONG *)&(x), (LONG)(v))
+#define fetch_add(x, v) InterlockedExchangeAdd((volatile LONG *)&(x), (LONG)(v))
+#define fetch_or(x, v) InterlockedOr((volatile LONG *)&(x), (LONG)(v))
+#define exchange(x, v) InterlockedExchange((volatile LONG *)&(x), (LONG)(v))
+#define read_fence() MemoryBarrier()
+#define write_fence() MemoryBarrier()
+
 #define usleep(x) Sleep(x/1000)
 #define sleep(x) Sleep(x*1000)
 #define last_error() WSAGetLastError()
@@ -462,6 +550,10 @@ typedef enum { lERROR = 0, lWARN, lINFO, lDEBUG, lSDEBUG } log_level;
 
 const char *logtime(void);
 void logprint(const char *fmt, ...);
+#if ASYNCLOG
+void log_async_init(void);
+void log_async_close(void);
+#endif
 
 #define LOG_ERROR(fmt, ...) logprint("%s %s:%d " fmt "\n", logtime(), __FUNCTION__, __LINE__, ##__VA_ARGS__)
 #define LOG_WARN(fmt, ...)  if (loglevel >= lWARN)  logprint("%s %s:%d " fmt "\n", logtime(), __FUNCTION__, __LINE__, ##__VA_ARGS__)
@@ -477,6 +569,7 @@ char* strcasestr(const char *haystack, const char *needle);
 
 char *next_param(char *src, char c);
 u32_t gettime_ms(void);
+u64_t gettime_us(void);
 void get_mac(u8_t *mac);
 void set_nonblock(sockfd s);
 void set_recvbufsize(sockfd s);
@@ -511,6 +604,11 @@ void touch_memory(u8_t *buf, size_t size);
 #endif
 
 // buffer.c
+#define BUF_ALIGN  0x01 // 64 byte aligned for simd kernels
+#define BUF_HUGE   0x02 // huge pages for buffers of 2MB or more - explicit if reserved, otherwise transparent
+#define BUF_LOCK   0x04 // lock buffer in memory rather than locking the whole process
+#define BUF_NODUMP 0x08 // exclude buffer from core dumps
+
 struct buffer {
 	u8_t *buf;
 	u8_t *readp;
@@ -518,6 +616,7 @@ struct buffer {
 	u8_t *wrap;
 	size_t size;
 	size_t base_size;
+	size_t mapped;      // length of mapping when allocated with mmap, 0 if from malloc
 	mutex_type mutex;
 };
 
@@ -532,13 +631,21 @@ void buf_flush(struct buffer *buf);
 void _buf_unwrap(struct buffer *buf, size_t cont);
 void buf_adjust(struct buffer *buf, size_t mod);
 void _buf_resize(struct buffer *buf, size_t size);
+u8_t *buf_mem_alloc(size_t size, size_t *mapped);
+void buf_mem_free(u8_t *mem, size_t mapped);
+bool _buf_swap(struct buffer *buf, u8_t **mem, size_t *mapped, size_t size, u8_t **ptrs[], unsigned n);
 void buf_init(struct buffer *buf, size_t size);
 void buf_destroy(struct buffer *buf);
 
 // slimproto.c
 void slimproto(log_level level, char *server, u8_t mac[6], const char *name, const char *namefile, const char *modelname, int maxSampleRate);
 void slimproto_stop(void);
-void wake_controller(void);
+// events from other threads, coalesced until the slimproto thread next runs
+#define WAKE_STREAM 0x01
+#define WAKE_DECODE 0x02
+#define WAKE_OUTPUT 0x04
+#define WAKE_IR     0x08
+void wake_controller(u32_t events);
 
 // stream.c
 typedef enum { STOPPED = 0, DISCONNECT, STREAMING_WAIT,
@@ -576,6 +683,7 @@ struct decodestate {
 #if PROCESS
 	bool direct;
 	bool process;
+	bool fade_resample;   // resample a track crossfaded from a track at a different rate to the rate of that track
 #endif
 };
 
@@ -587,6 +695,23 @@ struct processstate {
 	unsigned in_sample_rate, out_sample_rate;
 	unsigned long total_in, total_out;
 };
+
+// processing stage, run in the order given on the command line
+// stages see interleaved s32 stereo at process->inbuf, in place stages modify it, others write to process->outbuf
+struct process_stage {
+	const char *name;
+	bool in_place;
+	// in_sample_rate is set to the stage input rate, stages changing rate set out_sample_rate, returns true if active
+	bool (*newstream)(struct process_stage *stage, struct processstate *process, unsigned supported_rates[]);
+	void (*samples)(struct process_stage *stage, struct processstate *process);
+	bool (*drain)(struct process_stage *stage, struct processstate *process); // optional, returns true when complete
+	void (*flush)(struct process_stage *stage);
+	void *priv;
+	// managed by process.c
+	bool active;
+	u8_t *buf;
+	unsigned max_frames;
+};
 #endif
 
 struct codec {
@@ -600,6 +725,7 @@ struct codec {
 };
 
 void decode_init(log_level level, const char *include_codecs, const char *exclude_codecs);
+void decode_preload(log_level level);
 void decode_close(void);
 void decode_flush(void);
 unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]);
@@ -611,7 +737,8 @@ void process_samples(void);
 void process_drain(void);
 void process_flush(void);
 unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supported_rates[]);
-void process_init(char *opt);
+void process_init(char *resample_opt, char *stage_opts[], unsigned stages);
+unsigned process_resample_rate(unsigned raw_sample_rate, unsigned supported_rates[], bool exception, bool max_rate);
 #endif
 
 #if RESAMPLE
@@ -621,6 +748,37 @@ bool resample_drain(struct processstate *process);
 bool resample_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]);
 void resample_flush(void);
 bool resample_init(char *opt);
+
+// resample_fir.c
+void fir_samples(struct processstate *process);
+bool fir_drain(struct processstate *process);
+bool fir_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]);
+void fir_flush(void);
+bool fir_init(char *opt);
+#endif
+
+#if DSP
+// dsp_eq.c
+struct process_stage *register_eq(const char *name, char *opt);
+// dsp_delay.c
+struct process_stage *register_delay(const char *name, char *opt);
+// dsp_conv.c
+struct process_stage *register_conv(const char *name, char *opt);
+// dsp_drift.c
+struct drift_stats {
+	double measured_ppm;
+	double applied_ppm;
+	double window_secs;
+	double residual_frames;
+	unsigned discontinuities;
+	u64_t frames_in;
+	u64_t frames_out;
+};
+struct process_stage *register_drift(const char *name, char *opt);
+void drift_measure(u32_t played, u32_t updated, unsigned rate, bool running);
+u32_t drift_elapsed(u32_t ms, unsigned rate);
+void drift_track_start(void);
+bool drift_stats(struct drift_stats *stats, unsigned rate);
 #endif
 
 // output.c output_alsa.c output_pa.c output_pack.c
@@ -668,6 +826,7 @@ struct outputstate {
 	bool error_opening;
 	unsigned device_frames;
 	u32_t updated;
+	u64_t updated_us;          // time device_frames was measured, from the device timestamp where available
 	u32_t track_start_time;
 	u32_t current_replay_gain;
 	union {
@@ -677,6 +836,9 @@ struct outputstate {
 	};
 	unsigned next_sample_rate; // set in decode thread
 	u8_t  *track_start;        // set in decode thread
+	size_t buf_target;         // set in decode thread - pending outputbuf shrink
+	unsigned frame_bytes;      // bytes per frame held in outputbuf - BYTES_PER_FRAME, or half with 16 bit samples
+	u8_t  *playp;              // frames passed to write_cb - outputbuf->readp, or widened from 16 bit samples
 	u32_t gainL;               // set by slimproto
 	u32_t gainR;               // set by slimproto
 	bool  invert;              // set by slimproto
@@ -707,6 +869,23 @@ bool output_flush_streaming(void);
 // _* called with mutex locked
 frames_t _output_frames(frames_t avail);
 void _checkfade(bool);
+void _output_buf_target(unsigned rate);
+size_t _output_buf_space(void);
+
+// output status published by threads holding the output mutex, read lock free by slimproto
+struct output_status {
+	output_state state;
+	unsigned output_full;
+	unsigned output_size;
+	unsigned frames_played;    // frames_played_dmp
+	unsigned device_frames;
+	unsigned current_sample_rate;
+	u32_t updated;
+	u64_t updated_us;
+};
+
+void _output_publish(void);
+void output_status(struct output_status *s);
 
 // output_alsa.c
 #if ALSA
@@ -745,7 +924,8 @@ void output_close_stdout(void);
 // output_pack.c
 void _scale_and_pack_frames(void *outputptr, s32_t *inputptr, frames_t cnt, s32_t gainL, s32_t gainR, u8_t flags, output_format format);
 void _apply_cross(struct buffer *outputbuf, frames_t out_frames, s32_t cross_gain_in, s32_t cross_gain_out, s32_t **cross_ptr);
-void _apply_gain(struct buffer *outputbuf, frames_t count, s32_t gainL, s32_t gainR, u8_t flags);
+void _apply_gain(s32_t *inputptr, frames_t count, s32_t gainL, s32_t gainR, u8_t flags);
+void _widen_frames(s32_t *outptr, struct buffer *outputbuf, frames_t cnt, s32_t cross_gain_in, s32_t cross_gain_out, s32_t *cross_ptr);
 s32_t gain(s32_t gain, s32_t sample);
 s32_t to_gain(float f);
 
@@ -759,13 +939,80 @@ void vis_stop(void);
 #define vis_stop()
 #endif
 
+// metrics.c
+#if METRICS
+typedef enum { MET_OUTPUT_LATE = 0, MET_OUTPUT_FRAMES, MET_WAIT_OUTPUT_O, MET_WAIT_DECODE_O, MET_WAIT_DECODE_S, MET_WAIT_STREAM_S,
+			   MET_HISTS } metric_hist;
+typedef enum { MET_STREAMBUF = 0, MET_OUTPUTBUF, MET_FILLS } metric_fill;
+typedef enum { MET_XRUNS = 0, MET_STREAM_BYTES, MET_COUNTS } metric_count;
+
+void metrics_init(log_level level, char *opt);
+void metrics_close(void);
+void metrics_thread(const char *name);
+void metrics_observe(metric_hist m, u64_t us);
+void metrics_decode(const struct codec *codec, u64_t us);
+void metrics_fill(metric_fill f, size_t used, size_t size);
+void metrics_count(metric_count c, unsigned n);
+#define mutex_lock_timed(m, h) { u64_t _us = gettime_us(); mutex_lock(m); metrics_observe(h, gettime_us() - _us); }
+#else
+#define metrics_thread(...)
+#define metrics_observe(...)
+#define metrics_decode(...)
+#define metrics_fill(...)
+#define metrics_count(...)
+#define mutex_lock_timed(m, h) mutex_lock(m)
+#endif
+
+// flightrec.c - dump file layout is shared with tools/flight2trace.c
+#if FLIGHTREC
+#define FLIGHT_MAGIC   "SQFLIGHT"
+#define FLIGHT_VERSION 1
+
+typedef enum { FR_STREAM = 1, FR_DECODE, FR_OUTPUT, FR_RATE, FR_XRUN, FR_UNDERRUN } flight_type;
+
+struct flight_event {
+	u64_t us;       // gettime_us
+	u32_t seq;
+	u8_t  type;
+	u8_t  flag;     // FR_DECODE codec id, FR_OUTPUT silence, FR_UNDERRUN 'u' or 'o'
+	u16_t spare;
+	u32_t a, b, c;  // FR_STREAM: bytes, streambuf used; FR_DECODE: frames, streambuf bytes, us;
+	u32_t pad;      // FR_OUTPUT: avail, frames, outputbuf frames; FR_RATE: rate, previous rate
+};
+
+struct flight_header {
+	char  magic[8];
+	u32_t version;
+	u32_t reason;   // type of the event which caused the dump
+	u32_t rate;
+	u32_t count;    // events following the header
+	u64_t us;       // time of the dump
+};
+
+void flight_init(log_level level, const char *opt);
+void flight_record(flight_type type, u8_t flag, u32_t a, u32_t b, u32_t c);
+void flight_trigger(flight_type type, u8_t flag);
+void flight_dump(void);
+#else
+#define flight_record(...)
+#define flight_trigger(...)
+#define flight_dump()
+#endif
+
+// lockprof.c
+#if LOCKPROF
+void lockprof_init(void);
+void lockprof_close(void);
+#endif
+
 // dop.c
 #if DSD
 bool is_stream_dop(u8_t *lptr, u8_t *rptr, int step, frames_t frames);
 void update_dop(u32_t *ptr, frames_t frames, bool invert);
+const char *dop_init(void);
 void dsd_silence_frames(u32_t *ptr, frames_t frames);
 void dsd_invert(u32_t *ptr, frames_t frames);
-void dsd_init(dsd_format format, unsigned delay);
+void dsd_init(dsd_format format, unsigned delay, char *pcm_opt);
 #endif
 
 // codecs
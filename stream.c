@@ -189,7 +189,7 @@ static bool send_header(void) {
 			LOG_WARN("failed writing to socket: %s", strerror(last_error()));
 			stream.disconnect = LOCAL_DISCONNECT;
 			stream.state = DISCONNECT;
-			wake_controller();
+			wake_controller(WAKE_STREAM);
 			return false;
 		}
 		LOG_SDEBUG("wrote %d bytes to socket", n);
@@ -223,7 +223,7 @@ static void _disconnect(stream_state state, disconnect_code disconnect) {
 #endif
 	closesocket(fd);
 	fd = -1;
-	wake_controller();
+	wake_controller(WAKE_STREAM);
 }
 
 static int connect_socket(bool use_ssl) {
@@ -414,7 +414,7 @@ static void stream_ogg(size_t n) {
 				ogg.flac = false;
 				ogg.serial = ULLONG_MAX;
 				stream.meta_send = true;
-				wake_controller();
+				wake_controller(WAKE_STREAM);
 				LOG_INFO("metadata length: %u", stream.header_len - 3);
 			}
 
@@ -500,7 +500,7 @@ static void stream_ogg(size_t n) {
 			ogg.flac = false;
 			ogg.serial = ULLONG_MAX;
 			stream.meta_send = true;
-			wake_controller();
+			wake_controller(WAKE_STREAM);
 			LOG_INFO("metadata length: %u", stream.header_len - 3);
 
 			// return as we might have more than one metadata set but we want the first one
@@ -511,12 +511,14 @@ static void stream_ogg(size_t n) {
 #endif
 
 static void *stream_thread(void *vargp) {
+	metrics_thread("stream");
+
 	while (running) {
 
 		struct pollfd pollinfo;
 		size_t space;
 
-		LOCK;
+		mutex_lock_timed(streambuf->mutex, MET_WAIT_STREAM_S);
 
 		space = min(_buf_space(streambuf), _buf_cont_write(streambuf));
 
@@ -536,6 +538,8 @@ static void *stream_thread(void *vargp) {
 			if (n > 0) {
 				_buf_inc_writep(streambuf, n);
 				stream.bytes += n;
+				metrics_count(MET_STREAM_BYTES, n);
+				flight_record(FR_STREAM, 0, n, _buf_used(streambuf), 0);
 				LOG_SDEBUG("streambuf read %d bytes", n);
 			}
 			if (n < 0) {
@@ -629,7 +633,7 @@ static void *stream_thread(void *vargp) {
 							*(stream.header + stream.header_len) = '\0';
 							LOG_INFO("headers: len: %d\n%s", stream.header_len, stream.header);
 							stream.state = stream.cont_wait ? STREAMING_WAIT : STREAMING_BUFFERING;
-							wake_controller();
+							wake_controller(WAKE_STREAM);
 						}
 					} else {
 						endtok = 0;
@@ -682,7 +686,7 @@ static void *stream_thread(void *vargp) {
 							*(stream.header + stream.header_len) = '\0';
 							LOG_INFO("icy meta: len: %u\n%s", stream.header_len, stream.header);
 							stream.meta_send = true;
-							wake_controller();
+							wake_controller(WAKE_STREAM);
 						}
 						stream.meta_next = stream.meta_interval;
 						UNLOCK;
@@ -716,6 +720,8 @@ static void *stream_thread(void *vargp) {
 						stream_ogg(n);
 						_buf_inc_writep(streambuf, n);
 						stream.bytes += n;
+						metrics_count(MET_STREAM_BYTES, n);
+						flight_record(FR_STREAM, 0, n, _buf_used(streambuf), 0);
 						if (stream.meta_interval) {
 							stream.meta_next -= n;
 						}
@@ -726,7 +732,7 @@ static void *stream_thread(void *vargp) {
 
 					if (stream.state == STREAMING_BUFFERING && stream.bytes > stream.threshold) {
 						stream.state = STREAMING_HTTP;
-						wake_controller();
+						wake_controller(WAKE_STREAM);
 					}
 				
 					LOG_SDEBUG("streambuf read %d bytes", n);
@@ -861,7 +867,7 @@ void stream_file(const char *header, size_t header_len, unsigned threshold) {
 		LOG_INFO("can't open file: %s", stream.header);
 		stream.state = DISCONNECT;
 	}
-	wake_controller();
+	wake_controller(WAKE_STREAM);
 	
 	stream.cont_wait = false;
 	stream.meta_interval = 0;
@@ -0,0 +1,214 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Benchmark for the dsd to pcm converter and decimation presets used by dsd.c
+ *
+ * Converts DSD64..DSD512 with each decimation ratio and quality preset, reporting speed as
+ * a multiple of real time for a stereo stream and the alias rejection of the decimation
+ * stages: tones placed 10kHz and 45% of the output rate below the output rate of each stage
+ * are measured where they fold back into the passband, reporting the worst relative to the
+ * input level.  The test modulator puts its noise zero at the measured frequency so the
+ * figures are those of the filters rather than of its own noise.
+ *
+ * First checks the packing and polarity inversion kernels selected for this cpu against the
+ * scalar versions for every output format, exiting with an error if they differ.
+ *
+ * Compile: gcc -O2 -o dsdbench tools/dsdbench.c dsd2pcm/dsd2pcm.c -lm
+ * Usage:   dsdbench [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../dsd2pcm/dsd2pcm.h"
+
+#define ALIAS 10000.0
+#define EDGE  0.45
+#define LEVEL 0.5
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// simple 2nd order modulator, its noise zero moved from dc to notch so the measured frequency sees only
+// the test tone and what folds onto it - adequate as a test signal, not a reference modulator
+static void modulate(unsigned char *out, size_t bytes, double rate, double freq, double notch) {
+	double g = 2 - 2 * cos(2 * M_PI * notch / rate);
+	double s1 = 0, s2 = 0;
+	size_t i;
+	int j, fb = 1;
+
+	for (i = 0; i < bytes; ++i) {
+		unsigned char byte = 0;
+		for (j = 0; j < 8; ++j) {
+			double x = LEVEL * sin(2 * M_PI * freq * (i * 8 + j) / rate);
+			s1 += x - fb - g * s2;
+			s2 += s1 - fb;
+			fb = s2 >= 0 ? 1 : -1;
+			byte = (byte << 1) | (fb > 0);
+		}
+		out[i] = byte;
+	}
+}
+
+// least squares fit of a tone at freq, ignoring the start up, returns amplitude
+static double amplitude(const int32_t *pcm, size_t n, double rate, double freq) {
+	double ss = 0, sc = 0, cc = 0, ys = 0, yc = 0, a, b;
+	size_t i;
+
+	for (i = n / 4; i < n; ++i) {
+		double w = 2 * M_PI * freq * i / rate;
+		double y = pcm[i] / 2147483648.0;
+		ss += sin(w) * sin(w); cc += cos(w) * cos(w); sc += sin(w) * cos(w);
+		ys += y * sin(w); yc += y * cos(w);
+	}
+	a = (ys * cc - yc * sc) / (ss * cc - sc * sc);
+	b = (yc * ss - ys * sc) / (ss * cc - sc * sc);
+
+	return sqrt(a * a + b * b);
+}
+
+// vector kernels must match the scalar versions exactly, frame counts give whole vectors and a scalar tail
+static int check_kernels(void) {
+	unsigned char l[67], r[67];
+	uint32_t ref[2 * 67], buf[2 * 67];
+	unsigned i, bytes, shift, lsbf, mono;
+	int fail = 0;
+
+	for (i = 0; i < sizeof(l); ++i) {
+		l[i] = (i * 0x9E3779B9) >> 24;
+		r[i] = (i * 0x85EBCA6B) >> 24;
+	}
+
+	for (bytes = 1; bytes <= 4; bytes *= 2) {
+		size_t frames = sizeof(l) / bytes;
+		for (shift = 0; shift <= 8; shift += 8) {
+			for (lsbf = 0; lsbf < 2; ++lsbf) {
+				for (mono = 0; mono < 2; ++mono) {
+					dsd2pcm_pack_c(ref, l, mono ? NULL : r, frames, bytes, shift, lsbf);
+					dsd2pcm_pack(buf, l, mono ? NULL : r, frames, bytes, shift, lsbf);
+					if (memcmp(ref, buf, frames * 2 * sizeof(uint32_t))) {
+						printf("pack mismatch: bytes %u shift %u lsb first %u mono %u\n", bytes, shift, lsbf, mono);
+						fail = 1;
+					}
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < 2 * 67; ++i) {
+		ref[i] = buf[i] = i * 0x9E3779B9;
+	}
+	dsd2pcm_invert_c(ref, 67);
+	dsd2pcm_invert(buf, 67);
+	if (memcmp(ref, buf, sizeof(ref))) {
+		printf("invert mismatch\n");
+		fail = 1;
+	}
+
+	printf("packing kernel: %s %s\n", dsd2pcm_pack_name(), fail ? "FAILED check" : "matches scalar");
+	return fail;
+}
+
+int main(int argc, char *argv[]) {
+	const char *qname[] = { "low", "balanced", "high" };
+	double secs = argc > 1 ? atof(argv[1]) : 2.0;
+	unsigned mult;
+
+	dsd2pcm_precalc();
+	if (check_kernels()) {
+		return 1;
+	}
+	printf("kernel: %s, %.1f seconds per run\n\n", dsd2pcm_kernel_name(), secs);
+	printf("%-7s %-9s %6s %9s %9s %9s\n", "input", "quality", "ratio", "rate", "x rt", "alias dB");
+
+	for (mult = 64; mult <= 512; mult *= 2) {
+		double dsd_rate = 44100.0 * mult;
+		size_t bytes = (size_t)(secs * dsd_rate / 8);
+		unsigned char *in = malloc(bytes);
+		int32_t *out = malloc(bytes * sizeof(int32_t));
+		unsigned ratio;
+		int q;
+
+		if (!in || !out) {
+			fprintf(stderr, "unable to malloc\n");
+			return 1;
+		}
+
+		for (ratio = 1; ratio <= 16; ratio *= 2) {
+			double out_rate = dsd_rate / 8 / ratio;
+			double alias[3] = { -INFINITY, -INFINITY, -INFINITY };
+			double speed[3];
+			unsigned stage, edge;
+			if (out_rate < 44100) break;
+
+			// the output of each stage folds the tone at its rate less a back to a
+			for (stage = 1; stage < ratio || stage == 1; stage *= 2) {
+				// the band edge of ratio 1 is set by the fixed first stage, not a preset
+				for (edge = 0; edge < (ratio > 1 ? 2u : 1u); ++edge) {
+					double a = edge ? EDGE * out_rate : ALIAS;
+
+					modulate(in, bytes, dsd_rate, out_rate * stage - a, a);
+
+					// presets only apply to the decimation stages
+					for (q = ratio == 1 ? DSD2PCM_HIGH_PRECISION : DSD2PCM_LOW_CPU; q <= DSD2PCM_HIGH_PRECISION; ++q) {
+						dsd2pcm_ctx *ctx = dsd2pcm_init();
+						double t0, t1, db;
+						size_t n;
+
+						dsd2pcm_set_decimation(ctx, ratio, q);
+
+						t0 = now();
+						// convert twice to represent a stereo stream
+						n = dsd2pcm_translate_s32(ctx, bytes, in, 1, 0, out, 1);
+						dsd2pcm_reset(ctx);
+						n = dsd2pcm_translate_s32(ctx, bytes, in, 1, 0, out, 1);
+						t1 = now();
+
+						if (stage == 1 && !edge) {
+							speed[q] = secs / (t1 - t0);
+						}
+						db = 20 * log10(amplitude(out, n, out_rate, a) / LEVEL);
+						if (db > alias[q]) alias[q] = db;
+
+						dsd2pcm_destroy(ctx);
+					}
+				}
+			}
+
+			for (q = ratio == 1 ? DSD2PCM_HIGH_PRECISION : DSD2PCM_LOW_CPU; q <= DSD2PCM_HIGH_PRECISION; ++q) {
+				printf("DSD%-4u %-9s %6u %9.0f %9.1f %9.1f\n", mult, ratio == 1 ? "-" : qname[q], ratio, out_rate,
+					   speed[q], alias[q]);
+			}
+		}
+
+		free(in);
+		free(out);
+	}
+
+	return 0;
+}
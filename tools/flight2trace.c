@@ -0,0 +1,177 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Convert a flight recorder dump written by flightrec.c to chrome trace json
+ *
+ * Decode calls become slices on the decode track, stream reads and _output_frames calls instants on the
+ * stream and output tracks with their sizes as arguments, buffer levels are counters and rate switches,
+ * xruns and underruns are global markers.  Open the output in chrome://tracing or ui.perfetto.dev.
+ * Dumps are read in the byte order of the host, convert on a machine of the same endianness as the player.
+ *
+ * Compile: gcc -O2 -o flight2trace tools/flight2trace.c
+ * Usage:   flight2trace <dump> [<json>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+
+// must match struct flight_header, struct flight_event and flight_type in squeezelite.h
+#define FLIGHT_MAGIC   "SQFLIGHT"
+#define FLIGHT_VERSION 1
+
+enum { FR_STREAM = 1, FR_DECODE, FR_OUTPUT, FR_RATE, FR_XRUN, FR_UNDERRUN };
+
+struct flight_event {
+	uint64_t us;
+	uint32_t seq;
+	uint8_t  type;
+	uint8_t  flag;
+	uint16_t spare;
+	uint32_t a, b, c;
+	uint32_t pad;
+};
+
+struct flight_header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t reason;
+	uint32_t rate;
+	uint32_t count;
+	uint64_t us;
+};
+
+enum { TID_STREAM = 1, TID_DECODE, TID_OUTPUT, TID_CONTROL };
+
+static const char *reasons[] = { "", "stream", "decode", "output", "rate", "xrun", "underrun" };
+
+static FILE *out;
+static const char *sep = "";
+
+static void event(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void event(const char *fmt, ...) {
+	va_list args;
+	fprintf(out, "%s\n{", sep);
+	va_start(args, fmt);
+	vfprintf(out, fmt, args);
+	va_end(args);
+	fprintf(out, "}");
+	sep = ",";
+}
+
+static void thread_name(int tid, const char *name) {
+	event("\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}", tid, name);
+	event("\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"sort_index\":%d}", tid, tid);
+}
+
+int main(int argc, char **argv) {
+	struct flight_header hdr;
+	struct flight_event e;
+	uint64_t base = 0;
+	unsigned n;
+	FILE *in;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <dump> [<json>]\n", argv[0]);
+		return 1;
+	}
+
+	if (!(in = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, FLIGHT_MAGIC, sizeof(hdr.magic))) {
+		fprintf(stderr, "%s: not a flight recorder dump\n", argv[1]);
+		return 1;
+	}
+
+	if (hdr.version != FLIGHT_VERSION) {
+		fprintf(stderr, "%s: unsupported version %u\n", argv[1], hdr.version);
+		return 1;
+	}
+
+	out = argc > 2 ? fopen(argv[2], "w") : stdout;
+	if (!out) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"reason\":\"%s\",\"rate\":%u,\"events\":%u},\"traceEvents\":[",
+			hdr.reason < sizeof(reasons) / sizeof(reasons[0]) ? reasons[hdr.reason] : "", hdr.rate, hdr.count);
+
+	event("\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"squeezelite\"}");
+	thread_name(TID_STREAM, "stream");
+	thread_name(TID_DECODE, "decode");
+	thread_name(TID_OUTPUT, "output");
+	thread_name(TID_CONTROL, "slimproto");
+
+	for (n = 0; n < hdr.count && fread(&e, sizeof(e), 1, in) == 1; ++n) {
+		double ts;
+
+		if (!base) base = e.us;
+		ts = (double)(int64_t)(e.us - base);
+
+		switch (e.type) {
+		case FR_STREAM:
+			event("\"name\":\"recv\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.0f,\"pid\":1,\"tid\":%d,\"args\":{\"bytes\":%u,\"streambuf\":%u}",
+				  ts, TID_STREAM, e.a, e.b);
+			event("\"name\":\"streambuf\",\"ph\":\"C\",\"ts\":%.0f,\"pid\":1,\"args\":{\"bytes\":%u}", ts, e.b);
+			break;
+		case FR_DECODE:
+			event("\"name\":\"decode %c\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%u,\"pid\":1,\"tid\":%d,\"args\":{\"frames\":%u,\"streambuf\":%u}",
+				  e.flag, ts - e.c, e.c, TID_DECODE, e.a, e.b);
+			break;
+		case FR_OUTPUT:
+			event("\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.0f,\"pid\":1,\"tid\":%d,\"args\":{\"avail\":%u,\"frames\":%u,\"outputbuf\":%u}",
+				  e.flag ? "output silence" : "output", ts, TID_OUTPUT, e.a, e.b, e.c);
+			event("\"name\":\"outputbuf\",\"ph\":\"C\",\"ts\":%.0f,\"pid\":1,\"args\":{\"frames\":%u}", ts, e.c);
+			break;
+		case FR_RATE:
+			event("\"name\":\"rate %u\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.0f,\"pid\":1,\"tid\":%d,\"args\":{\"rate\":%u,\"previous\":%u}",
+				  e.a, ts, TID_OUTPUT, e.a, e.b);
+			break;
+		case FR_XRUN:
+			event("\"name\":\"XRUN\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.0f,\"pid\":1,\"tid\":%d", ts, TID_OUTPUT);
+			break;
+		case FR_UNDERRUN:
+			event("\"name\":\"STM%c\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.0f,\"pid\":1,\"tid\":%d", e.flag, ts, TID_CONTROL);
+			break;
+		default:
+			break;
+		}
+	}
+
+	fprintf(out, "\n]}\n");
+
+	if (n != hdr.count) {
+		fprintf(stderr, "%s: truncated, %u of %u events\n", argv[1], n, hdr.count);
+	}
+
+	fclose(in);
+	if (out != stdout) fclose(out);
+
+	return 0;
+}
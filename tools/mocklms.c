@@ -0,0 +1,638 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Mock server for end to end latency benchmarks without a real LMS
+ *
+ * Serves slimproto and a http stream of generated 16 bit pcm on the local host, drives one or two
+ * players through each scenario and reports the time between commands and the status events they
+ * produce.  Players are started by the harness when -x is given, with -s, -m and -n appended.  Their
+ * stdout is read at the real time rate so "-o -" acts as a null output device with a pipe sized
+ * buffer.  Otherwise start them against the ports shown.
+ *
+ * Scenarios:
+ *   play      strm s (autostart 0) -> STMc -> STMl, strm u -> STMs, underruns while playing to the end
+ *   skip      strm q -> STMf while playing, then strm s (autostart 1) -> STMs
+ *   pause     strm p -> STMp, position drift while paused, unpause at jiffies and start error
+ *   sync      two players started at the same jiffies, difference in reported position
+ *   crossfade next track sent on STMd, start of next track relative to end of current
+ *   stall     http stream stops mid track, STMo count and position lost
+ *
+ * Compile: gcc -O2 -o mocklms tools/mocklms.c -lpthread -lm
+ * Usage:   mocklms [-x "<squeezelite> -o - -b 256:512"] [-s scenario[,scenario..]] [-r runs] [-p port] [-S stall ms]
+ *                 [-F bytes per frame] [-v]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_PLAYERS 2
+#define MAX_RUNS    100
+#define MAX_METRICS 32
+#define TIMEOUT     10000 // ms to wait for any expected event
+#define RATE        44100
+#define FREQ        1000
+
+#pragma pack(push, 1)
+struct strm_packet {
+	char     opcode[4];
+	char     command;
+	uint8_t  autostart;
+	uint8_t  format;
+	uint8_t  pcm_sample_size;
+	uint8_t  pcm_sample_rate;
+	uint8_t  pcm_channels;
+	uint8_t  pcm_endianness;
+	uint8_t  threshold;
+	uint8_t  spdif_enable;
+	uint8_t  transition_period;
+	uint8_t  transition_type;
+	uint8_t  flags;
+	uint8_t  output_threshold;
+	uint8_t  slaves;
+	uint32_t replay_gain;
+	uint16_t server_port;
+	uint32_t server_ip;
+};
+
+struct stat_packet {
+	uint32_t event;
+	uint8_t  num_crlf;
+	uint8_t  mas_initialized;
+	uint8_t  mas_mode;
+	uint32_t stream_buffer_size;
+	uint32_t stream_buffer_fullness;
+	uint32_t bytes_received_H;
+	uint32_t bytes_received_L;
+	uint16_t signal_strength;
+	uint32_t jiffies;
+	uint32_t output_buffer_size;
+	uint32_t output_buffer_fullness;
+	uint32_t elapsed_seconds;
+	uint16_t voltage;
+	uint32_t elapsed_milliseconds;
+	uint32_t server_timestamp;
+	uint16_t error_code;
+};
+#pragma pack(pop)
+
+struct player {
+	int fd;
+	pid_t pid;
+	char event[5];        // last status event
+	uint32_t jiffies;     // and its player timestamp and position
+	uint32_t elapsed;
+	uint32_t server_ts;   // echoed from strm t, zero for periodic STMt
+	unsigned stmo, stmu;
+};
+
+struct metric {
+	const char *name;
+	double v[MAX_RUNS];
+	int n;
+};
+
+static struct player players[MAX_PLAYERS];
+static struct metric metrics[MAX_METRICS];
+static int slim_fd, http_fd;
+static unsigned slim_port = 3483, http_port;
+static unsigned stall_ms = 4000;
+static unsigned frame_bytes = 8;     // squeezelite stdout default is 32 bit stereo
+static const char *command = NULL;
+static bool verbose = false;
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void sleep_ms(unsigned ms) {
+	usleep(ms * 1000);
+}
+
+static void add_metric(const char *name, double v) {
+	int i;
+	for (i = 0; i < MAX_METRICS && metrics[i].name && strcmp(metrics[i].name, name); i++);
+	if (i == MAX_METRICS) return;
+	metrics[i].name = name;
+	if (metrics[i].n < MAX_RUNS) metrics[i].v[metrics[i].n++] = v;
+	if (verbose) printf("  %-28s %10.1f\n", name, v);
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double d = *(const double *)a - *(const double *)b;
+	return d < 0 ? -1 : d > 0;
+}
+
+// http stream of a stereo sine, pace is a multiple of real time (0 = as fast as the socket allows)
+// request: GET /tone?secs=<s>&pace=<x>&stall_at=<s>&stall_ms=<ms>
+static void *http_conn(void *arg) {
+	int fd = (int)(intptr_t)arg;
+	char req[1024], *p;
+	int len = 0, n;
+	double secs = 10, pace = 0, stall_at = -1;
+	unsigned stall = 0;
+	int16_t buf[RATE / 10 * 2];
+	uint64_t frame = 0, total;
+	double start;
+
+	while (len < (int)sizeof(req) - 1 && (n = recv(fd, req + len, sizeof(req) - 1 - len, 0)) > 0) {
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n")) break;
+	}
+
+	if ((p = strstr(req, "secs="))) secs = atof(p + 5);
+	if ((p = strstr(req, "pace="))) pace = atof(p + 5);
+	if ((p = strstr(req, "stall_at="))) stall_at = atof(p + 9);
+	if ((p = strstr(req, "stall_ms="))) stall = atoi(p + 9);
+
+	p = "HTTP/1.0 200 OK\r\nContent-Type: audio/L16;rate=44100;channels=2\r\n\r\n";
+	send(fd, p, strlen(p), MSG_NOSIGNAL);
+
+	total = (uint64_t)(secs * RATE);
+	start = now_ms();
+
+	while (frame < total) {
+		unsigned i, frames = total - frame < RATE / 10 ? total - frame : RATE / 10;
+		for (i = 0; i < frames; i++) {
+			int16_t s = (int16_t)(8000 * sin(2 * M_PI * FREQ * (double)(frame + i) / RATE));
+			buf[2 * i] = buf[2 * i + 1] = s;
+		}
+		if (stall_at >= 0 && frame <= stall_at * RATE && frame + frames > stall_at * RATE) {
+			if (verbose) printf("  http stall %u ms\n", stall);
+			sleep_ms(stall);
+			start += stall;
+		}
+		if (send(fd, buf, frames * 4, MSG_NOSIGNAL) != (ssize_t)(frames * 4)) break;
+		frame += frames;
+		if (pace > 0) {
+			double due = start + frame * 1000.0 / RATE / pace;
+			double t = now_ms();
+			if (due > t) sleep_ms((unsigned)(due - t));
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+// consume player output at the real time rate, anything not available in time is lost as a device would
+// runs until the player exits and owns the read end of its stdout pipe
+static void *sink_thread(void *arg) {
+	int fd = (int)(intptr_t)arg;
+	char buf[RATE / 100 * 8 * 2];
+	size_t due = (size_t)RATE * frame_bytes / 100;
+
+	while (read(fd, buf, due < sizeof(buf) ? due : sizeof(buf)) != 0) {
+		sleep_ms(10);
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void *http_thread(void *arg) {
+	while (1) {
+		int fd = accept(http_fd, NULL, NULL);
+		pthread_t t;
+		if (fd < 0) continue;
+		pthread_create(&t, NULL, http_conn, (void *)(intptr_t)fd);
+		pthread_detach(t);
+	}
+	return NULL;
+}
+
+static int listen_on(unsigned port) {
+	struct sockaddr_in addr;
+	int on = 1, fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+		fprintf(stderr, "unable to listen on port %u: %s\n", port, strerror(errno));
+		exit(1);
+	}
+
+	return fd;
+}
+
+static void send_server(struct player *p, const char *opcode, const void *data, size_t len) {
+	uint8_t buf[2048];
+	buf[0] = (len + 4) >> 8;
+	buf[1] = (len + 4) & 0xff;
+	memcpy(buf + 2, opcode, 4);
+	memcpy(buf + 6, data, len);
+	send(p->fd, buf, len + 6, MSG_NOSIGNAL);
+}
+
+// strm s also carries the http request, other commands use replay_gain for their interval or jiffies
+static void send_strm(struct player *p, char cmd, char autostart, uint32_t arg, uint8_t trans_secs, char trans_type,
+					  const char *request) {
+	uint8_t buf[1024];
+	struct strm_packet *s = (struct strm_packet *)buf;
+	size_t len = sizeof(*s);
+
+	memset(s, 0, sizeof(*s));
+	memcpy(s->opcode, "strm", 4);
+	s->command = cmd;
+	s->autostart = autostart;
+	s->format = 'p';
+	s->pcm_sample_size = '1';
+	s->pcm_sample_rate = '3';
+	s->pcm_channels = '2';
+	s->pcm_endianness = '1';
+	s->threshold = 64;
+	s->spdif_enable = '0';
+	s->transition_period = trans_secs;
+	s->transition_type = trans_type;
+	s->output_threshold = 1;
+	s->replay_gain = htonl(arg);
+	s->server_port = htons(http_port);
+	s->server_ip = 0;
+
+	if (request) {
+		len += snprintf((char *)buf + len, sizeof(buf) - len, "GET %s HTTP/1.0\r\n\r\n", request);
+	}
+
+	if (verbose) printf("  -> strm %c\n", cmd);
+	send_server(p, "strm", buf + 4, len - 4);
+}
+
+// read client packets until a status event matching want (or any event if want is NULL), returns time received or -1
+static double wait_event(struct player *p, const char *want, int timeout) {
+	double end = now_ms() + timeout;
+
+	while (now_ms() < end) {
+		struct pollfd pfd = { p->fd, POLLIN, 0 };
+		uint8_t hdr[8], body[4096];
+		uint32_t len;
+
+		if (poll(&pfd, 1, (int)(end - now_ms()) + 1) <= 0) continue;
+
+		if (recv(p->fd, hdr, 8, MSG_WAITALL) != 8) return -1;
+		len = (uint32_t)hdr[4] << 24 | hdr[5] << 16 | hdr[6] << 8 | hdr[7];
+		if (len > sizeof(body) || recv(p->fd, body, len, MSG_WAITALL) != (ssize_t)len) return -1;
+
+		if (!memcmp(hdr, "STAT", 4) && len >= sizeof(struct stat_packet)) {
+			struct stat_packet *s = (struct stat_packet *)body;
+			double t = now_ms();
+			memcpy(p->event, &s->event, 4);
+			p->event[4] = '\0';
+			p->jiffies = ntohl(s->jiffies);
+			p->elapsed = ntohl(s->elapsed_milliseconds);
+			p->server_ts = ntohl(s->server_timestamp);
+			if (!strcmp(p->event, "STMo")) p->stmo++;
+			if (!strcmp(p->event, "STMu")) p->stmu++;
+			if (verbose && strcmp(p->event, "STMt")) printf("  <- %s elapsed: %u\n", p->event, p->elapsed);
+			if (!want || !strcmp(p->event, want)) return t;
+		}
+	}
+
+	if (verbose) printf("  timeout waiting for %s\n", want ? want : "status");
+	return -1;
+}
+
+// position in ms reported by the player in response to strm t, with its jiffies
+// the reply is told apart from periodic STMt by the timestamp it echoes, events queued before it are counted on the way
+static bool query_position(struct player *p, uint32_t *elapsed, uint32_t *jiffies) {
+	static uint32_t tag = 0;
+	if (++tag == 0) tag = 1;
+	send_strm(p, 't', '0', tag, 0, '0', NULL);
+	do {
+		if (wait_event(p, "STMt", TIMEOUT) < 0) return false;
+	} while (p->server_ts != tag);
+	if (verbose) printf("  <- STMt elapsed: %u jiffies: %u\n", p->elapsed, p->jiffies);
+	*elapsed = p->elapsed;
+	*jiffies = p->jiffies;
+	return true;
+}
+
+static void player_stop(struct player *p) {
+	send_strm(p, 'q', '0', 0, 0, '0', NULL);
+	wait_event(p, "STMf", TIMEOUT);
+	sleep_ms(200);
+}
+
+static void connect_players(int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct player *p = &players[i];
+		uint8_t aude[2] = { 1, 1 };
+		uint8_t audg[18];
+		uint32_t gain = htonl(0x10000);
+
+		if (command) {
+			char cmd[1024];
+			int fds[2];
+			pthread_t t;
+			snprintf(cmd, sizeof(cmd), "exec %s -s 127.0.0.1:%u -m 00:04:20:00:00:%02x -n mock%d", command, slim_port, i + 1, i + 1);
+			if (pipe(fds) < 0) {
+				fprintf(stderr, "unable to create pipe: %s\n", strerror(errno));
+				exit(1);
+			}
+			if ((p->pid = fork()) == 0) {
+				dup2(fds[1], 1);
+				close(fds[0]);
+				close(fds[1]);
+				execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+				_exit(1);
+			}
+			close(fds[1]);
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
+			pthread_create(&t, NULL, sink_thread, (void *)(intptr_t)fds[0]);
+			pthread_detach(t);
+		}
+
+		p->fd = accept(slim_fd, NULL, NULL);
+
+		memset(audg, 0, sizeof(audg));
+		audg[8] = 1;
+		memcpy(audg + 10, &gain, 4);
+		memcpy(audg + 14, &gain, 4);
+
+		// HELO is read and ignored while waiting for the flush to be acknowledged
+		player_stop(p);
+		send_server(p, "aude", aude, sizeof(aude));
+		send_server(p, "audg", audg, sizeof(audg));
+		if (verbose) printf("player %d connected\n", i + 1);
+	}
+}
+
+static void disconnect_players(int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		close(players[i].fd);
+		if (players[i].pid > 0) {
+			kill(players[i].pid, SIGTERM);
+			waitpid(players[i].pid, NULL, 0);
+			players[i].pid = 0;
+		}
+	}
+}
+
+static void scenario_play(void) {
+	struct player *p = &players[0];
+	double t0, tc, tl, tu, ts;
+
+	p->stmo = p->stmu = 0;
+	t0 = now_ms();
+	send_strm(p, 's', '0', 0, 0, '0', "/tone?secs=4");
+	if ((tc = wait_event(p, "STMc", TIMEOUT)) < 0) return;
+	if ((tl = wait_event(p, "STMl", TIMEOUT)) < 0) return;
+	tu = now_ms();
+	send_strm(p, 'u', '0', 0, 0, '0', NULL);
+	if ((ts = wait_event(p, "STMs", TIMEOUT)) < 0) return;
+
+	add_metric("play strm->STMc", tc - t0);
+	add_metric("play STMc->STMl", tl - tc);
+	add_metric("play strm u->STMs", ts - tu);
+
+	wait_event(p, "STMu", TIMEOUT);
+	add_metric("play underruns (STMo)", p->stmo);
+}
+
+static void scenario_skip(void) {
+	struct player *p = &players[0];
+	double t0, t1;
+
+	send_strm(p, 's', '1', 0, 0, '0', "/tone?secs=20");
+	if (wait_event(p, "STMs", TIMEOUT) < 0) return;
+	sleep_ms(1500);
+
+	t0 = now_ms();
+	send_strm(p, 'q', '0', 0, 0, '0', NULL);
+	if ((t1 = wait_event(p, "STMf", TIMEOUT)) < 0) return;
+	add_metric("skip strm q->STMf", t1 - t0);
+
+	t0 = now_ms();
+	send_strm(p, 's', '1', 0, 0, '0', "/tone?secs=20");
+	if ((t1 = wait_event(p, "STMs", TIMEOUT)) < 0) return;
+	add_metric("skip strm s->STMs", t1 - t0);
+
+	player_stop(p);
+}
+
+static void scenario_pause(void) {
+	struct player *p = &players[0];
+	uint32_t e0, j0, e1, j1, start_at;
+	double t0, t1;
+
+	send_strm(p, 's', '1', 0, 0, '0', "/tone?secs=20");
+	if (wait_event(p, "STMs", TIMEOUT) < 0) return;
+	sleep_ms(1500);
+
+	t0 = now_ms();
+	send_strm(p, 'p', '0', 0, 0, '0', NULL);
+	if ((t1 = wait_event(p, "STMp", TIMEOUT)) < 0) return;
+	add_metric("pause strm p->STMp", t1 - t0);
+
+	sleep_ms(200);
+	if (!query_position(p, &e0, &j0)) return;
+	sleep_ms(500);
+	if (!query_position(p, &e1, &j1)) return;
+	add_metric("pause position drift", (double)(int32_t)(e1 - e0));
+
+	// unpause 500ms ahead in the player's clock, position should then advance with its jiffies
+	start_at = j1 + 500;
+	send_strm(p, 'u', '0', start_at, 0, '0', NULL);
+	if (wait_event(p, "STMr", TIMEOUT) < 0) return;
+	sleep_ms(1500);
+	if (!query_position(p, &e0, &j0)) return;
+	add_metric("unpause at jiffies error", (double)(int32_t)(e0 - e1) - (double)(int32_t)(j0 - start_at));
+
+	player_stop(p);
+}
+
+static void scenario_sync(void) {
+	uint32_t e[2], j[2], start_at;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		send_strm(&players[i], 's', '0', 0, 0, '0', "/tone?secs=10");
+	}
+	for (i = 0; i < 2; i++) {
+		if (wait_event(&players[i], "STMl", TIMEOUT) < 0) return;
+	}
+
+	// both players are on this host so share the jiffies clock
+	if (!query_position(&players[0], &e[0], &j[0])) return;
+	start_at = j[0] + 500;
+	for (i = 0; i < 2; i++) {
+		send_strm(&players[i], 'u', '0', start_at, 0, '0', NULL);
+	}
+	sleep_ms(3000);
+
+	for (i = 0; i < 2; i++) {
+		if (!query_position(&players[i], &e[i], &j[i])) return;
+	}
+	// positions projected to the same jiffies
+	add_metric("sync position difference", fabs((double)(int32_t)(e[1] - e[0]) + (double)(int32_t)(j[0] - j[1])));
+
+	for (i = 0; i < 2; i++) {
+		player_stop(&players[i]);
+	}
+}
+
+static void scenario_crossfade(void) {
+	struct player *p = &players[0];
+	double ts, td, ts2;
+
+	send_strm(p, 's', '1', 0, 2, '1', "/tone?secs=5");
+	if ((ts = wait_event(p, "STMs", TIMEOUT)) < 0) return;
+	if ((td = wait_event(p, "STMd", TIMEOUT)) < 0) return;
+	send_strm(p, 's', '1', 0, 2, '1', "/tone?secs=5");
+	if ((ts2 = wait_event(p, "STMs", TIMEOUT)) < 0) return;
+
+	add_metric("crossfade STMd->next STMs", ts2 - td);
+	add_metric("crossfade next start-end (ms)", ts2 - (ts + 5000));
+
+	player_stop(p);
+}
+
+static void scenario_stall(void) {
+	struct player *p = &players[0];
+	char req[128];
+	uint32_t e, j, j0;
+
+	p->stmo = p->stmu = 0;
+	snprintf(req, sizeof(req), "/tone?secs=12&pace=1.02&stall_at=3&stall_ms=%u", stall_ms);
+	send_strm(p, 's', '1', 0, 0, '0', req);
+	if (wait_event(p, "STMs", TIMEOUT) < 0) return;
+	j0 = p->jiffies;
+
+	sleep_ms(3000 + stall_ms + 2000);
+	if (!query_position(p, &e, &j)) return;
+
+	add_metric("stall underruns (STMo)", p->stmo);
+	add_metric("stall position lost (ms)", (double)(int32_t)(j - j0) - e);
+
+	player_stop(p);
+}
+
+static struct {
+	const char *name;
+	void (*run)(void);
+	int players;
+} scenarios[] = {
+	{ "play",      scenario_play,      1 },
+	{ "skip",      scenario_skip,      1 },
+	{ "pause",     scenario_pause,     1 },
+	{ "sync",      scenario_sync,      2 },
+	{ "crossfade", scenario_crossfade, 1 },
+	{ "stall",     scenario_stall,     1 },
+	{ NULL,        NULL,               0 },
+};
+
+static void usage(const char *argv0) {
+	printf("Usage: %s [options]\n"
+		   "  -x \"<command>\"\tStart players with this command, eg \"./squeezelite -o - -b 256:512\"\n"
+		   "  -s <list>\t\tComma separated scenarios (play,skip,pause,sync,crossfade,stall), default all\n"
+		   "  -r <runs>\t\tRepeat each scenario, default 5\n"
+		   "  -p <port>\t\tSlimproto port, http uses the next port, default 3483\n"
+		   "  -S <ms>\t\tHttp stall duration for the stall scenario, default 4000\n"
+		   "  -F <bytes>\t\tBytes per frame of player stdout, default 8 (32 bit stereo)\n"
+		   "  -v\t\t\tShow events as they happen\n",
+		   argv0);
+}
+
+int main(int argc, char *argv[]) {
+	const char *list = "play,skip,pause,sync,crossfade,stall";
+	unsigned runs = 5;
+	int i, r, connected = 0;
+	pthread_t t;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "x:s:r:p:S:F:vh")) != -1) {
+		switch (opt) {
+		case 'x': command = optarg; break;
+		case 's': list = optarg; break;
+		case 'r': runs = atoi(optarg) > MAX_RUNS ? MAX_RUNS : atoi(optarg); break;
+		case 'p': slim_port = atoi(optarg); break;
+		case 'S': stall_ms = atoi(optarg); break;
+		case 'F': frame_bytes = atoi(optarg) ? atoi(optarg) : 8; break;
+		case 'v': verbose = true; break;
+		default: usage(argv[0]); exit(0);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	http_port = slim_port + 1;
+	slim_fd = listen_on(slim_port);
+	http_fd = listen_on(http_port);
+	pthread_create(&t, NULL, http_thread, NULL);
+
+	if (!command) {
+		printf("waiting for players on 127.0.0.1:%u, http on %u\n", slim_port, http_port);
+	}
+
+	for (i = 0; scenarios[i].name; i++) {
+		if (!strstr(list, scenarios[i].name)) continue;
+
+		// connect players as needed, the two player scenario keeps them for any later scenarios
+		if (connected < scenarios[i].players) {
+			disconnect_players(connected);
+			connect_players(scenarios[i].players);
+			connected = scenarios[i].players;
+		}
+
+		printf("%s\n", scenarios[i].name);
+		for (r = 0; r < (int)runs; r++) {
+			scenarios[i].run();
+		}
+	}
+
+	disconnect_players(connected);
+
+	printf("\n%-30s %5s %10s %10s %10s\n", "metric (ms or count)", "n", "min", "median", "max");
+	for (i = 0; i < MAX_METRICS && metrics[i].name; i++) {
+		struct metric *m = &metrics[i];
+		qsort(m->v, m->n, sizeof(double), cmp_double);
+		printf("%-30s %5d %10.1f %10.1f %10.1f\n", m->name, m->n, m->v[0],
+			   m->n % 2 ? m->v[m->n / 2] : (m->v[m->n / 2 - 1] + m->v[m->n / 2]) / 2, m->v[m->n - 1]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,307 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2026, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Benchmark for the built in polyphase resampler, optionally against libsoxr
+ *
+ * For each rate pair and quality a stereo stream is resampled in blocks the size used by
+ * process.c, reporting speed as a multiple of real time, and for tones at 1kHz and 19kHz the
+ * level of everything other than the tone (aliases, images and noise) relative to the tone,
+ * plus the gain of the 19kHz tone to show passband droop.
+ *
+ * With soxr each recipe is also run as two mono instances on two threads with a barrier per block,
+ * as used by resample.c with the P recipe flag, to compare with a single stereo instance.
+ *
+ * Compile: gcc -O2 -o resamplebench tools/resamplebench.c polyphase/polyphase.c -lm
+ *    with soxr: gcc -O2 -DSOXR -o resamplebench tools/resamplebench.c polyphase/polyphase.c -lsoxr -lpthread -lm
+ * Usage:   resamplebench [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../polyphase/polyphase.h"
+#if SOXR
+#include <soxr.h>
+#include <pthread.h>
+#endif
+
+#define BLOCK 4096 // frames per call, as for pcm decode with process.c
+#define LEVEL 0.5
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void tone(int32_t *buf, size_t frames, double rate, double freq) {
+	size_t i;
+	for (i = 0; i < frames; ++i) {
+		buf[2*i] = buf[2*i+1] = (int32_t)(LEVEL * 2147483647.0 * sin(2 * M_PI * freq * i / rate));
+	}
+}
+
+// least squares fit of the tone over the middle of the output, returns level of residual relative to tone in dB
+static double residual(const int32_t *pcm, size_t n, double rate, double freq, double *gain) {
+	double ss = 0, sc = 0, cc = 0, ys = 0, yc = 0, a, b, err = 0, amp;
+	size_t i, start = n / 4, end = n - n / 8;
+
+	for (i = start; i < end; ++i) {
+		double w = 2 * M_PI * freq * i / rate;
+		double y = pcm[2*i] / 2147483648.0;
+		ss += sin(w) * sin(w); cc += cos(w) * cos(w); sc += sin(w) * cos(w);
+		ys += y * sin(w); yc += y * cos(w);
+	}
+	a = (ys * cc - yc * sc) / (ss * cc - sc * sc);
+	b = (yc * ss - ys * sc) / (ss * cc - sc * sc);
+	amp = sqrt(a * a + b * b);
+
+	for (i = start; i < end; ++i) {
+		double w = 2 * M_PI * freq * i / rate;
+		double e = pcm[2*i] / 2147483648.0 - a * sin(w) - b * cos(w);
+		err += e * e;
+	}
+
+	*gain = 20 * log10(amp / LEVEL);
+	return 10 * log10(err / (end - start) / (amp * amp / 2));
+}
+
+typedef size_t (*run_fn)(void *h, const int32_t *in, size_t frames, int32_t *out, size_t max_out);
+
+static size_t run_polyphase(void *h, const int32_t *in, size_t frames, int32_t *out, size_t max_out) {
+	return in ? polyphase_process(h, in, frames, out, max_out) : polyphase_drain(h, out, max_out);
+}
+
+#if SOXR
+static size_t run_soxr(void *h, const int32_t *in, size_t frames, int32_t *out, size_t max_out) {
+	size_t idone, odone;
+	soxr_process(h, in, frames, &idone, out, max_out, &odone);
+	return odone;
+}
+
+// two mono instances, right channel on a worker thread
+struct par {
+	soxr_t s[2];
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned long posted, done;
+	int quit;
+	const int32_t *in;
+	size_t frames, max_out, odone[2];
+	int32_t *out, *cin[2], *cout[2];
+};
+
+static void par_channel(struct par *p, int c) {
+	size_t i, idone;
+	for (i = 0; p->in && i < p->frames; ++i) {
+		p->cin[c][i] = p->in[2*i + c];
+	}
+	soxr_process(p->s[c], p->in ? p->cin[c] : NULL, p->in ? p->frames : 0, &idone, p->cout[c], p->max_out, &p->odone[c]);
+	for (i = 0; i < p->odone[c]; ++i) {
+		p->out[2*i + c] = p->cout[c][i];
+	}
+}
+
+static void *par_thread(void *arg) {
+	struct par *p = arg;
+	pthread_mutex_lock(&p->mutex);
+	while (!p->quit) {
+		if (p->posted > p->done) {
+			pthread_mutex_unlock(&p->mutex);
+			par_channel(p, 1);
+			pthread_mutex_lock(&p->mutex);
+			p->done++;
+			pthread_cond_broadcast(&p->cond);
+		} else {
+			pthread_cond_wait(&p->cond, &p->mutex);
+		}
+	}
+	pthread_mutex_unlock(&p->mutex);
+	return NULL;
+}
+
+static size_t run_par(void *h, const int32_t *in, size_t frames, int32_t *out, size_t max_out) {
+	struct par *p = h;
+	p->in = in; p->frames = frames; p->out = out; p->max_out = max_out;
+	pthread_mutex_lock(&p->mutex);
+	p->posted++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+	par_channel(p, 0);
+	pthread_mutex_lock(&p->mutex);
+	while (p->done < p->posted) {
+		pthread_cond_wait(&p->cond, &p->mutex);
+	}
+	pthread_mutex_unlock(&p->mutex);
+	return p->odone[0] < p->odone[1] ? p->odone[0] : p->odone[1];
+}
+
+static struct par *par_create(unsigned in_rate, unsigned out_rate, soxr_io_spec_t *io_spec, soxr_quality_spec_t *q_spec, size_t max_out) {
+	struct par *p = calloc(1, sizeof(struct par));
+	int c;
+	for (c = 0; c < 2; ++c) {
+		p->s[c] = soxr_create(in_rate, out_rate, 1, NULL, io_spec, q_spec, NULL);
+		p->cin[c] = malloc(BLOCK * sizeof(int32_t));
+		p->cout[c] = malloc(max_out * sizeof(int32_t));
+	}
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	pthread_create(&p->thread, NULL, par_thread, p);
+	return p;
+}
+
+static void par_delete(struct par *p) {
+	int c;
+	pthread_mutex_lock(&p->mutex);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+	pthread_join(p->thread, NULL);
+	for (c = 0; c < 2; ++c) {
+		soxr_delete(p->s[c]);
+		free(p->cin[c]);
+		free(p->cout[c]);
+	}
+	free(p);
+}
+#endif
+
+// resample whole input in blocks, returns output frames
+static size_t convert(run_fn fn, void *h, const int32_t *in, size_t in_frames, int32_t *out, size_t max_out) {
+	size_t done = 0, n, i;
+	for (i = 0; i < in_frames; i += BLOCK) {
+		size_t f = in_frames - i < BLOCK ? in_frames - i : BLOCK;
+		done += fn(h, in + 2 * i, f, out + 2 * done, max_out - done);
+	}
+	while (done < max_out && (n = fn(h, NULL, 0, out + 2 * done, max_out - done)) > 0) {
+		done += n;
+	}
+	return done;
+}
+
+static void report(const char *name, unsigned in_rate, unsigned out_rate, run_fn fn, void *h1, void *h2, void *h3,
+				   const int32_t *in, size_t in_frames, int32_t *out, size_t max_out, double secs) {
+	const int32_t *t1 = in, *t2 = in + 2 * in_frames;
+	double t0, t, g1, g19, r1, r19;
+	size_t n;
+
+	// speed measured on the 1kHz tone, converted twice to allow for warm up
+	convert(fn, h1, t1, in_frames, out, max_out);
+	t0 = now();
+	n = convert(fn, h2, t1, in_frames, out, max_out);
+	t = now() - t0;
+	r1 = residual(out, n, out_rate, 1000, &g1);
+	n = convert(fn, h3, t2, in_frames, out, max_out);
+	r19 = residual(out, n, out_rate, 19000, &g19);
+
+	printf("%6u %7u %-16s %8.1f %9.1f %9.1f %9.2f\n", in_rate, out_rate, name, secs / t, r1, r19, g19);
+}
+
+int main(int argc, char *argv[]) {
+	static const unsigned pairs[][2] = {
+		{ 44100, 48000 }, { 48000, 44100 }, { 44100, 88200 }, { 44100, 96000 }, { 96000, 44100 }, { 44100, 352800 },
+		{ 44100, 705600 }, { 48000, 768000 },
+	};
+	const char *qname[] = { "polyphase low", "polyphase med", "polyphase high", "polyphase vhigh" };
+	double secs = argc > 1 ? atof(argv[1]) : 2.0;
+	unsigned p;
+	int q;
+
+	printf("kernel: %s, %.1f seconds per run\n\n", polyphase_kernel_name(), secs);
+	printf("%6s %7s %-16s %8s %9s %9s %9s\n", "in", "out", "resampler", "x rt", "1k dB", "19k dB", "19k gain");
+
+	for (p = 0; p < sizeof(pairs) / sizeof(pairs[0]); ++p) {
+		unsigned in_rate = pairs[p][0], out_rate = pairs[p][1];
+		size_t in_frames = (size_t)(secs * in_rate);
+		size_t max_out = (size_t)((double)in_frames * out_rate / in_rate) + 1024;
+		int32_t *in = malloc(in_frames * 2 * 2 * sizeof(int32_t));
+		int32_t *out = malloc(max_out * 2 * sizeof(int32_t));
+
+		if (!in || !out) {
+			fprintf(stderr, "unable to malloc\n");
+			return 1;
+		}
+
+		tone(in, in_frames, in_rate, 1000);
+		tone(in + 2 * in_frames, in_frames, in_rate, 19000);
+
+		for (q = POLYPHASE_LOW; q <= POLYPHASE_VERY_HIGH; ++q) {
+			polyphase_ctx *h[3];
+			int i;
+			for (i = 0; i < 3; ++i) {
+				h[i] = polyphase_init(in_rate, out_rate, q, 1.0);
+			}
+			if (!h[0]) {
+				printf("%6u %7u %-16s not supported\n", in_rate, out_rate, qname[q]);
+				continue;
+			}
+			report(qname[q], in_rate, out_rate, run_polyphase, h[0], h[1], h[2], in, in_frames, out, max_out, secs);
+			for (i = 0; i < 3; ++i) {
+				polyphase_destroy(h[i]);
+			}
+		}
+
+#if SOXR
+		{
+			static const struct { unsigned long recipe; const char *name; } recipes[] = {
+				{ SOXR_LQ, "soxr lq" }, { SOXR_MQ, "soxr mq" }, { SOXR_HQ, "soxr hq" }, { SOXR_VHQ, "soxr vhq" },
+			};
+			unsigned i, j;
+			for (i = 0; i < sizeof(recipes) / sizeof(recipes[0]); ++i) {
+				soxr_io_spec_t io_spec = soxr_io_spec(SOXR_INT32_I, SOXR_INT32_I);
+				soxr_quality_spec_t q_spec = soxr_quality_spec(recipes[i].recipe, 0);
+				soxr_t h[3];
+				for (j = 0; j < 3; ++j) {
+					h[j] = soxr_create(in_rate, out_rate, 2, NULL, &io_spec, &q_spec, NULL);
+				}
+				report(recipes[i].name, in_rate, out_rate, run_soxr, h[0], h[1], h[2], in, in_frames, out, max_out, secs);
+				for (j = 0; j < 3; ++j) {
+					soxr_delete(h[j]);
+				}
+			}
+			for (i = 0; i < sizeof(recipes) / sizeof(recipes[0]); ++i) {
+				soxr_io_spec_t io_spec = soxr_io_spec(SOXR_INT32_I, SOXR_INT32_I);
+				soxr_quality_spec_t q_spec = soxr_quality_spec(recipes[i].recipe, 0);
+				char name[32];
+				struct par *h[3];
+				for (j = 0; j < 3; ++j) {
+					h[j] = par_create(in_rate, out_rate, &io_spec, &q_spec, max_out);
+				}
+				snprintf(name, sizeof(name), "%s P", recipes[i].name);
+				report(name, in_rate, out_rate, run_par, h[0], h[1], h[2], in, in_frames, out, max_out, secs);
+				for (j = 0; j < 3; ++j) {
+					par_delete(h[j]);
+				}
+			}
+		}
+#endif
+
+		free(in);
+		free(out);
+	}
+
+	return 0;
+}
@@ -60,22 +60,188 @@
 
 // logging functions
 const char *logtime(void) {
-	static char buf[100];
 #if WIN
+	static char buf[100];
 	SYSTEMTIME lt;
 	GetLocalTime(&lt);
 	sprintf(buf, "[%02d:%02d:%02d.%03d]", lt.wHour, lt.wMinute, lt.wSecond, lt.wMilliseconds);
 #else
+	// per thread as the result is used by the caller after return and several threads log at once
+	static __thread char buf[100];
 	struct timeval tv;
+	struct tm tm;
 	gettimeofday(&tv, NULL);
-	strftime(buf, sizeof(buf), "[%T.", localtime(&tv.tv_sec));
+	strftime(buf, sizeof(buf), "[%T.", localtime_r(&tv.tv_sec, &tm));
 	sprintf(buf+strlen(buf), "%06ld]", (long)tv.tv_usec);
 #endif
 	return buf;
 }
 
+#if ASYNCLOG
+// Asynchronous logging - callers format each record into a lock free ring of fixed size slots, a record longer than
+// one slot takes several consecutive slots, and a background thread writes them to stderr in batches
+// if the ring is full the record is dropped rather than blocking the caller, the writer reports how many were lost
+
+#define LOG_SLOTS      1024   // power of 2
+#define LOG_SLOT_TEXT  120
+#define LOG_LINE       4096   // longer records are truncated
+#define LOG_BATCH      16384
+#define LOG_FLUSH_MS   1000   // writer wakes at least this often in case a wake up was missed
+
+struct log_slot {
+	u32_t seq;                // position + 1 once the text is complete
+	u32_t len;
+	char text[LOG_SLOT_TEXT];
+};
+
+static struct log_slot *log_slots;
+static char *log_batch;
+static u32_t log_head = 0;    // next position to claim, advanced by callers
+static u32_t log_tail = 0;    // next position to write, advanced by the writer
+static u32_t log_dropped = 0;
+static u32_t log_sleeping = 0;
+static bool log_async = false;
+static bool log_running = false;
+static event_event log_e;
+static pthread_t log_thread;
+
+static void log_push(const char *line, u32_t len) {
+	u32_t n = (len + LOG_SLOT_TEXT - 1) / LOG_SLOT_TEXT;
+	u32_t pos, tail, i;
+
+	// tail is read first so pos can never be behind it
+	do {
+		tail = load_acquire(log_tail);
+		pos = load_acquire(log_head);
+		if (pos + n - tail > LOG_SLOTS) {
+			fetch_add(log_dropped, 1);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&log_head, &pos, pos + n, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	for (i = 0; i < n; ++i) {
+		struct log_slot *s = &log_slots[(pos + i) & (LOG_SLOTS - 1)];
+		s->len = min(len - i * LOG_SLOT_TEXT, LOG_SLOT_TEXT);
+		memcpy(s->text, line + i * LOG_SLOT_TEXT, s->len);
+		store_release(s->seq, pos + i + 1);
+	}
+
+	// only signal when the writer is waiting, so a burst of records costs one wake up
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (load_acquire(log_sleeping) && exchange(log_sleeping, 0)) {
+		wake_signal(log_e);
+	}
+}
+
+static bool log_ready(void) {
+	return load_acquire(log_slots[log_tail & (LOG_SLOTS - 1)].seq) == log_tail + 1;
+}
+
+// writer thread - copy complete records in order, stopping at one which is still being written
+static void log_write(void) {
+	u32_t dropped;
+	size_t len;
+
+	do {
+		len = 0;
+		while (len + LOG_SLOT_TEXT <= LOG_BATCH && log_ready()) {
+			struct log_slot *s = &log_slots[log_tail & (LOG_SLOTS - 1)];
+			memcpy(log_batch + len, s->text, s->len);
+			len += s->len;
+			store_release(log_tail, log_tail + 1);
+		}
+		if (len) {
+			fwrite(log_batch, 1, len, stderr);
+		}
+	} while (len);
+
+	if ((dropped = exchange(log_dropped, 0)) != 0) {
+		fprintf(stderr, "%s %s:%d %u log records dropped, queue full\n", logtime(), __FUNCTION__, __LINE__, dropped);
+	}
+
+	fflush(stderr);
+}
+
+static void *log_writer(void *arg) {
+	struct pollfd pollinfo = { 0, POLLIN, 0 };
+#if SELFPIPE
+	pollinfo.fd = log_e.fds[0];
+#else
+	pollinfo.fd = log_e;
+#endif
+
+	while (load_acquire(log_running)) {
+		log_write();
+
+		store_release(log_sleeping, 1);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!log_ready() && poll(&pollinfo, 1, LOG_FLUSH_MS) > 0) {
+			wake_clear(pollinfo.fd);
+		}
+		store_release(log_sleeping, 0);
+	}
+
+	log_write();
+
+	return 0;
+}
+
+// start after any fork as the writer thread is not inherited, until then and after close records are written directly
+void log_async_init(void) {
+	pthread_attr_t attr;
+
+	log_slots = calloc(LOG_SLOTS, sizeof(struct log_slot));
+	log_batch = malloc(LOG_BATCH);
+	if (!log_slots || !log_batch) {
+		fprintf(stderr, "unable to malloc log buffers\n");
+		exit(1);
+	}
+
+	wake_create(log_e);
+	log_running = true;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 32 * 1024);
+	pthread_create(&log_thread, &attr, log_writer, NULL);
+	pthread_attr_destroy(&attr);
+
+	store_release(log_async, true);
+
+	// flush queued records when exit is called on an error path
+	atexit(log_async_close);
+}
+
+void log_async_close(void) {
+	if (!exchange(log_async, false)) {
+		return;
+	}
+
+	store_release(log_running, false);
+	wake_signal(log_e);
+	pthread_join(log_thread, NULL);
+	wake_close(log_e);
+}
+#endif
+
 void logprint(const char *fmt, ...) {
 	va_list args;
+#if ASYNCLOG
+	if (load_acquire(log_async)) {
+		char line[LOG_LINE];
+		int len;
+		va_start(args, fmt);
+		len = vsnprintf(line, sizeof(line), fmt, args);
+		va_end(args);
+		if (len >= LOG_LINE) {
+			len = LOG_LINE - 1;
+			line[len - 1] = '\n';
+		}
+		if (len > 0) {
+			log_push(line, len);
+		}
+		return;
+	}
+#endif
 	va_start(args, fmt);
 	vfprintf(stderr, fmt, args);
 	va_end(args);
@@ -120,6 +286,30 @@ u32_t gettime_ms(void) {
 #endif
 }
 
+// microsecond clock for timestamping playback position, same clock as alsa monotonic timestamps
+u64_t gettime_us(void) {
+#if WIN
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (u64_t)(count.QuadPart / freq.QuadPart) * 1000000 + (u64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+#if LINUX || FREEBSD
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
+#else
+	if (!clock_gettime(CLOCK_REALTIME, &ts)) {
+#endif
+		return (u64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+#endif
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (u64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 // mac address
 #if LINUX && !defined(SUN)
 // search first 4 interfaces returned by IFCONF